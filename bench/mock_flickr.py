@@ -0,0 +1,258 @@
+#!/usr/bin/env python3
+"""
+Local stand-in for the parts of the Flickr REST API that flickcurl calls,
+the upload endpoint and the static photo host, all on one port.
+
+    /services/rest/     REST methods, picked by the "method" parameter
+    /services/upload/   Photo uploads
+    /photos/...         Photo bytes. flickrms is pointed here with photo_host
+
+The account is generated from the command line so every run sees the same
+photos. Signatures are not checked. Every request waits --latency ms before
+it is answered and photo bodies are sent no faster than --bandwidth KB/s.
+"""
+
+import argparse
+import hashlib
+import re
+import sys
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlparse
+from xml.sax.saxutils import quoteattr
+
+WORDS = ["beach", "city", "dog", "sunset", "mountain", "river", "party", "snow",
+         "forest", "car", "bridge", "garden", "market", "harbor", "festival", "desert"]
+
+PHOTO_ID_BASE = 10 ** 9
+SET_ID_BASE = 7 * 10 ** 16
+FIRST_TAKEN = 1262304000        # 2010-01-01
+
+
+class Account:
+    """The photosets and photos, generated from (name, count, size) triples. A size of None is the default."""
+
+    def __init__(self, sets, loose, size):
+        self.lock = threading.Lock()
+        self.size = size
+        self.photos = {}            # id -> dict(title, taken, size)
+        self.sets = {}              # id -> dict(title, photos)
+        self.next_photo = PHOTO_ID_BASE
+
+        for n, (name, count, photo_size) in enumerate(sets):
+            set_id = str(SET_ID_BASE + n)
+            self.sets[set_id] = {"title": name, "photos": [self.new_photo(size=photo_size) for _ in range(count)]}
+        for _ in range(loose):
+            self.new_photo()
+
+    def new_photo(self, title=None, size=None):
+        photo_id = str(self.next_photo)
+        n = self.next_photo - PHOTO_ID_BASE
+        self.next_photo += 1
+        if title is None:
+            title = "%s %s %d" % (WORDS[n % len(WORDS)], WORDS[(n * 7) % len(WORDS)], n)
+        self.photos[photo_id] = {
+            "title": title,
+            "taken": FIRST_TAKEN + n * 5400,
+            "size": self.size if size is None else size,
+        }
+        return photo_id
+
+    def loose(self):
+        held = set()
+        for s in self.sets.values():
+            held.update(s["photos"])
+        return [p for p in self.photos if p not in held]
+
+
+def photo_bytes(photo_id, size):
+    """The same bytes every time for a given photo."""
+    seed = hashlib.sha256(photo_id.encode()).digest()
+    return (seed * (size // len(seed) + 1))[:size]
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    account = None
+    latency = 0.0
+    bandwidth = 0               # bytes per second, 0 is unlimited
+
+    def log_message(self, fmt, *args):
+        pass
+
+    def params(self):
+        query = parse_qs(urlparse(self.path).query)
+        length = int(self.headers.get("Content-Length") or 0)
+        body = self.rfile.read(length) if length else b""
+        if self.headers.get("Content-Type", "").startswith("application/x-www-form-urlencoded"):
+            query.update(parse_qs(body.decode()))
+        return {k: v[0] for k, v in query.items()}, body
+
+    def send(self, code, body, content_type="text/xml", head=False):
+        self.send_response(code)
+        self.send_header("Content-Type", content_type)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        if head:
+            return
+        if not self.bandwidth:
+            self.wfile.write(body)
+            return
+        start = time.monotonic()
+        for off in range(0, len(body), 65536):
+            self.wfile.write(body[off:off + 65536])
+            due = (off + 65536) / self.bandwidth - (time.monotonic() - start)
+            if due > 0:
+                time.sleep(due)
+
+    def rsp(self, inner=""):
+        self.send(200, ('<?xml version="1.0" encoding="utf-8" ?>\n<rsp stat="ok">%s</rsp>\n' % inner).encode())
+
+    def fail(self, code=1, msg="Not found"):
+        self.send(200, ('<?xml version="1.0" encoding="utf-8" ?>\n<rsp stat="fail">'
+                        '<err code="%d" msg=%s /></rsp>\n' % (code, quoteattr(msg))).encode())
+
+    def do_HEAD(self):
+        self.do_GET(head=True)
+
+    def do_GET(self, head=False):
+        time.sleep(self.latency)
+        path = urlparse(self.path).path
+        if path.startswith("/services/rest"):
+            return self.rest(self.params()[0])
+        match = re.search(r"/(\d+)_[^/]*$", path)
+        if path.startswith("/photos/") and match:
+            with self.account.lock:
+                photo = self.account.photos.get(match.group(1))
+            if photo:
+                return self.send(200, photo_bytes(match.group(1), photo["size"]), "image/jpeg", head)
+        self.send(404, b"")
+
+    def do_POST(self):
+        time.sleep(self.latency)
+        path = urlparse(self.path).path
+        params, body = self.params()
+        if path.startswith("/services/upload"):
+            title = re.search(rb'name="title"\r\n\r\n([^\r]*)', body)
+            with self.account.lock:
+                photo_id = self.account.new_photo(title.group(1).decode() if title else "", len(body))
+            return self.rsp("<photoid>%s</photoid>" % photo_id)
+        if path.startswith("/services/rest"):
+            return self.rest(params)
+        self.send(404, b"")
+
+    def photo_xml(self, photo_id):
+        p = self.account.photos[photo_id]
+        taken = time.strftime("%Y-%m-%d %H:%M:%S", time.gmtime(p["taken"]))
+        return ('<photo id="%s" owner="1@N00" secret="s" server="1" farm="1" title=%s ispublic="0" '
+                'isfriend="0" isfamily="0" datetaken="%s" datetakengranularity="0" originalsecret="o" '
+                'originalformat="jpg" tags=%s />' % (
+                    photo_id, quoteattr(p["title"]), taken, quoteattr(p["title"].split()[0] if p["title"] else "")))
+
+    def page(self, ids, params):
+        per_page = int(params.get("per_page", 100))
+        page = max(int(params.get("page", 1)), 1)
+        total = len(ids)
+        pages = (total + per_page - 1) // per_page
+        chunk = ids[(page - 1) * per_page:page * per_page]
+        attrs = 'page="%d" pages="%d" perpage="%d" total="%d"' % (page, pages, per_page, total)
+        return attrs, "".join(self.photo_xml(p) for p in chunk)
+
+    def rest(self, params):
+        method = params.get("method", "")
+        a = self.account
+
+        with a.lock:
+            if method == "flickr.test.login":
+                return self.rsp('<user id="1@N00"><username>bench</username></user>')
+
+            if method == "flickr.photosets.getList":
+                sets = "".join('<photoset id="%s" primary="" secret="s" server="1" farm="1" photos="%d" '
+                               'videos="0"><title>%s</title><description /></photoset>' % (
+                                   i, len(s["photos"]), s["title"]) for i, s in a.sets.items())
+                return self.rsp('<photosets page="1" pages="1" perpage="%d" total="%d">%s</photosets>' % (
+                    len(a.sets), len(a.sets), sets))
+
+            if method == "flickr.photosets.getPhotos":
+                s = a.sets.get(params.get("photoset_id"))
+                if not s:
+                    return self.fail()
+                attrs, photos = self.page(s["photos"], params)
+                return self.rsp('<photoset id="%s" owner="1@N00" %s>%s</photoset>' % (
+                    params["photoset_id"], attrs, photos))
+
+            if method == "flickr.photos.getNotInSet":
+                attrs, photos = self.page(a.loose(), params)
+                return self.rsp("<photos %s>%s</photos>" % (attrs, photos))
+
+            if method == "flickr.photos.setMeta":
+                if params.get("photo_id") in a.photos:
+                    a.photos[params["photo_id"]]["title"] = params.get("title", "")
+                return self.rsp()
+
+            if method == "flickr.photosets.editMeta":
+                if params.get("photoset_id") in a.sets:
+                    a.sets[params["photoset_id"]]["title"] = params.get("title", "")
+                return self.rsp()
+
+            if method == "flickr.photosets.create":
+                set_id = str(SET_ID_BASE + len(a.sets))
+                a.sets[set_id] = {"title": params.get("title", ""), "photos": [params.get("primary_photo_id")]}
+                return self.rsp('<photoset id="%s" url="" />' % set_id)
+
+            if method == "flickr.photosets.addPhoto":
+                s = a.sets.get(params.get("photoset_id"))
+                if s is not None and params.get("photo_id") not in s["photos"]:
+                    s["photos"].append(params.get("photo_id"))
+                return self.rsp()
+
+            if method == "flickr.photosets.removePhoto":
+                s = a.sets.get(params.get("photoset_id"))
+                if s is not None and params.get("photo_id") in s["photos"]:
+                    s["photos"].remove(params.get("photo_id"))
+                return self.rsp()
+
+            if method == "flickr.photos.delete":
+                for s in a.sets.values():
+                    if params.get("photo_id") in s["photos"]:
+                        s["photos"].remove(params.get("photo_id"))
+                a.photos.pop(params.get("photo_id"), None)
+                return self.rsp()
+
+        return self.fail(112, "Method not found")
+
+
+def parse_set(spec):
+    name, _, count = spec.rpartition("=")
+    count, _, size = count.partition(":")
+    return name, int(count), int(size) if size else None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--port", type=int, default=8642)
+    parser.add_argument("--set", action="append", type=parse_set, default=[], metavar="NAME=COUNT[:SIZE]",
+                        help="add a photoset of COUNT photos of SIZE bytes (repeatable)")
+    parser.add_argument("--loose", type=int, default=100, help="photos without a photoset")
+    parser.add_argument("--size", type=int, default=64 * 1024, help="bytes per photo")
+    parser.add_argument("--latency", type=float, default=0, help="ms before every response")
+    parser.add_argument("--bandwidth", type=int, default=0, help="KB/s for photo bodies, 0 is unlimited")
+    args = parser.parse_args()
+
+    Handler.account = Account(args.set, args.loose, args.size)
+    Handler.latency = args.latency / 1000.0
+    Handler.bandwidth = args.bandwidth * 1024
+
+    server = ThreadingHTTPServer(("127.0.0.1", args.port), Handler)
+    server.daemon_threads = True
+    print("listening on %d" % args.port, flush=True)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
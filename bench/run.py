@@ -0,0 +1,282 @@
+#!/usr/bin/env python3
+"""
+Mounts flickrms against bench/mock_flickr.py and times the workloads below.
+Each one prints a JSON line with its p50/p99 latency in ms and, where it
+moves data, the throughput in MB/s.
+
+    ls_cold, ls_warm    ls -l of photosets of 1k, 10k and 100k photos
+    cat_cold, cat_warm  Reading whole photos, first from the mock, then cached
+    stat_storm          Threads stat()ing random photos of the 10k photoset
+    cp_bulk             Copying new photos into a photoset (uploads)
+    read_large          Reading large cached photos, with read_buf and then
+                        remounted with no_read_buf, with the CPU seconds
+                        flickrms and the reader spend per GB read
+
+HOME is pointed at a scratch directory, so neither ~/.flickcurl.conf nor
+~/.flickrms is touched.
+"""
+
+import argparse
+import json
+import os
+import random
+import shutil
+import signal
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import zlib
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+SETS = [("bench-1k", 1000), ("bench-10k", 10000), ("bench-100k", 100000), ("bench-upload", 1)]
+LARGE_SET = "bench-large"
+READ_SIZE = 1024 * 1024         # Bytes per read() of read_large
+
+
+def percentile(samples, p):
+    ordered = sorted(samples)
+    return ordered[min(len(ordered) - 1, int(len(ordered) * p / 100.0))]
+
+
+def report(out, workload, samples, nbytes=None, elapsed=None, **extra):
+    result = {
+        "workload": workload,
+        "samples": len(samples),
+        "p50_ms": round(percentile(samples, 50) * 1000, 3),
+        "p99_ms": round(percentile(samples, 99) * 1000, 3),
+    }
+    if nbytes is not None and elapsed:
+        result["throughput_mb_s"] = round(nbytes / elapsed / 1e6, 3)
+    result.update(extra)
+    line = json.dumps(result)
+    print(line, flush=True)
+    out.write(line + "\n")
+
+
+def timed(func, *args):
+    start = time.perf_counter()
+    func(*args)
+    return time.perf_counter() - start
+
+
+def wait_for(predicate, timeout, what):
+    deadline = time.monotonic() + timeout
+    while not predicate():
+        if time.monotonic() > deadline:
+            sys.exit("timed out waiting for " + what)
+        time.sleep(0.05)
+
+
+def png(size):
+    """An uncompressed PNG of roughly size bytes, so the upload check accepts it."""
+    width = 256
+    height = max(1, size // (width * 3 + 1))
+    raw = b"".join(b"\0" + os.urandom(width * 3) for _ in range(height))
+
+    def chunk(kind, data):
+        return struct.pack(">I", len(data)) + kind + data + struct.pack(">I", zlib.crc32(kind + data))
+
+    return (b"\x89PNG\r\n\x1a\n" + chunk(b"IHDR", struct.pack(">IIBBBBB", width, height, 8, 2, 0, 0, 0)) +
+            chunk(b"IDAT", zlib.compress(raw, 0)) + chunk(b"IEND", b""))
+
+
+def ls_l(path):
+    subprocess.run(["ls", "-l", path], stdout=subprocess.DEVNULL, check=True)
+
+
+def cat(path):
+    with open(path, "rb") as f:
+        return len(f.read())
+
+
+def cpu_seconds(pid):
+    """User and system time of a process, from /proc."""
+    with open("/proc/%d/stat" % pid) as f:
+        fields = f.read().rpartition(")")[2].split()
+    return (int(fields[11]) + int(fields[12])) / os.sysconf("SC_CLK_TCK")
+
+
+def read_through(path, buf):
+    """Reads the whole file into buf a chunk at a time, past the kernel's copy of it."""
+    nbytes = 0
+    with open(path, "rb", buffering=0) as f:
+        os.posix_fadvise(f.fileno(), 0, 0, os.POSIX_FADV_DONTNEED)
+        while True:
+            n = f.readinto(buf)
+            if not n:
+                return nbytes
+            nbytes += n
+
+
+def run_ls(out, mnt, args):
+    for name, count in SETS[:3]:
+        if count > args.max_photos:
+            continue
+        path = os.path.join(mnt, name)
+        report(out, "ls_cold", [timed(ls_l, path)], photos=count)
+        report(out, "ls_warm", [timed(ls_l, path) for _ in range(args.repeat)], photos=count)
+
+
+def run_cat(out, mnt, args):
+    directory = os.path.join(mnt, "bench-1k")
+    names = random.Random(1).sample(sorted(os.listdir(directory)), args.files)
+
+    for workload in ("cat_cold", "cat_warm"):
+        samples, nbytes = [], 0
+        start = time.perf_counter()
+        for name in names:
+            t = time.perf_counter()
+            nbytes += cat(os.path.join(directory, name))
+            samples.append(time.perf_counter() - t)
+        report(out, workload, samples, nbytes, time.perf_counter() - start)
+
+
+def run_stat(out, mnt, args):
+    directory = os.path.join(mnt, "bench-10k" if args.max_photos >= 10000 else "bench-1k")
+    names = sorted(os.listdir(directory))
+    samples = []
+    lock = threading.Lock()
+
+    def storm(seed):
+        rng = random.Random(seed)
+        mine = []
+        for _ in range(args.stats):
+            path = os.path.join(directory, rng.choice(names))
+            t = time.perf_counter()
+            os.stat(path)
+            mine.append(time.perf_counter() - t)
+        with lock:
+            samples.extend(mine)
+
+    threads = [threading.Thread(target=storm, args=(i,)) for i in range(args.threads)]
+    start = time.perf_counter()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    elapsed = time.perf_counter() - start
+    report(out, "stat_storm", samples, threads=args.threads, ops_s=round(len(samples) / elapsed, 1))
+
+
+def run_cp(out, mnt, args, scratch):
+    source = os.path.join(scratch, "cp")
+    os.mkdir(source)
+    for i in range(args.files):
+        with open(os.path.join(source, "new-%04d.png" % i), "wb") as f:
+            f.write(png(args.size))
+
+    directory = os.path.join(mnt, "bench-upload")
+    samples, nbytes = [], 0
+    start = time.perf_counter()
+    for name in sorted(os.listdir(source)):
+        t = time.perf_counter()
+        shutil.copyfile(os.path.join(source, name), os.path.join(directory, name))
+        samples.append(time.perf_counter() - t)
+        nbytes += os.path.getsize(os.path.join(source, name))
+    report(out, "cp_bulk", samples, nbytes, time.perf_counter() - start)
+
+
+def run_read_large(out, mnt, args, fs, read_buf):
+    directory = os.path.join(mnt, LARGE_SET)
+    paths = [os.path.join(directory, name) for name in sorted(os.listdir(directory))]
+    buf = memoryview(bytearray(READ_SIZE))
+    for path in paths:          # Downloaded once, so only reads of the cached file are timed
+        read_through(path, buf)
+
+    samples, nbytes = [], 0
+    fs_cpu, client_cpu = cpu_seconds(fs.pid), sum(os.times()[:2])
+    start = time.perf_counter()
+    for _ in range(args.repeat):
+        for path in paths:
+            t = time.perf_counter()
+            nbytes += read_through(path, buf)
+            samples.append(time.perf_counter() - t)
+    elapsed = time.perf_counter() - start
+    gb = nbytes / 1e9
+    report(out, "read_large", samples, nbytes, elapsed, read_buf=read_buf,
+           cpu_s_per_gb=round((cpu_seconds(fs.pid) - fs_cpu) / gb, 3),
+           client_cpu_s_per_gb=round((sum(os.times()[:2]) - client_cpu) / gb, 3))
+
+
+def mount(args, mnt, env, extra=""):
+    opts = "-o" + ",".join(filter(None, ["listing_budget=1024", "api_quota=0", args.mount_opts, extra]))
+    fs = subprocess.Popen([args.binary, mnt, "-f", opts], env=env)
+    wait_for(lambda: os.path.ismount(mnt) or fs.poll() is not None, 600, "the mount")
+    if fs.poll() is not None:
+        sys.exit("flickrms exited with %d" % fs.returncode)
+    return fs
+
+
+def unmount(fs, mnt):
+    subprocess.run(["fusermount3", "-u", mnt], stderr=subprocess.DEVNULL)
+    try:
+        fs.wait(timeout=30)
+    except subprocess.TimeoutExpired:
+        fs.kill()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--binary", default=os.path.join(HERE, "..", "src", "flickrms"))
+    parser.add_argument("--out", default="bench-results.jsonl", help="JSON lines are appended here")
+    parser.add_argument("--port", type=int, default=8642)
+    parser.add_argument("--latency", type=float, default=20, help="mock REST/photo latency in ms")
+    parser.add_argument("--bandwidth", type=int, default=0, help="mock photo KB/s, 0 is unlimited")
+    parser.add_argument("--size", type=int, default=256 * 1024, help="bytes per photo")
+    parser.add_argument("--max-photos", type=int, default=100000, help="skip larger photosets")
+    parser.add_argument("--repeat", type=int, default=5, help="warm ls -l runs per photoset")
+    parser.add_argument("--files", type=int, default=50, help="photos read by cat and written by cp")
+    parser.add_argument("--threads", type=int, default=16)
+    parser.add_argument("--stats", type=int, default=2000, help="stat() calls per thread")
+    parser.add_argument("--large-files", type=int, default=4, help="photos read by read_large")
+    parser.add_argument("--large-size", type=int, default=64 * 1024 * 1024, help="bytes per read_large photo")
+    parser.add_argument("--mount-opts", default="", help="extra -o options for flickrms")
+    args = parser.parse_args()
+
+    scratch = tempfile.mkdtemp(prefix="flickrms-bench-")
+    mnt = os.path.join(scratch, "mnt")
+    os.mkdir(mnt)
+    service = "http://127.0.0.1:%d" % args.port
+    with open(os.path.join(scratch, ".flickcurl.conf"), "w") as f:
+        f.write("[flickr]\noauth_client_key=bench\noauth_client_secret=bench\n"
+                "oauth_token=bench\noauth_token_secret=bench\n"
+                "service_uri=%s/services/rest/\nupload_service_uri=%s/services/upload/\n"
+                "photo_host=%s/photos\n" % (service, service, service))
+
+    mock_cmd = [sys.executable, os.path.join(HERE, "mock_flickr.py"), "--port", str(args.port),
+                "--latency", str(args.latency), "--bandwidth", str(args.bandwidth), "--size", str(args.size)]
+    for name, count in SETS:
+        if count <= args.max_photos:
+            mock_cmd += ["--set", "%s=%d" % (name, count)]
+    mock_cmd += ["--set", "%s=%d:%d" % (LARGE_SET, args.large_files, args.large_size)]
+    mock = subprocess.Popen(mock_cmd, stdout=subprocess.PIPE, text=True)
+    mock.stdout.readline()
+
+    env = dict(os.environ, HOME=scratch)
+    fs = None
+    try:
+        with open(args.out, "a") as out:
+            fs = mount(args, mnt, env)
+            run_ls(out, mnt, args)
+            run_cat(out, mnt, args)
+            run_stat(out, mnt, args)
+            run_cp(out, mnt, args, scratch)
+            run_read_large(out, mnt, args, fs, True)
+            unmount(fs, mnt)
+
+            fs = mount(args, mnt, env, "no_read_buf")
+            run_read_large(out, mnt, args, fs, False)
+    finally:
+        if fs is not None:
+            unmount(fs, mnt)
+        mock.send_signal(signal.SIGINT)
+        mock.wait()
+        shutil.rmtree(scratch, ignore_errors=True)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
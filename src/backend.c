@@ -0,0 +1,379 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "backend.h"
+#include "stats.h"
+#include "latency.h"
+#include "sched.h"
+
+
+#define BREAKER_FAILURES    5       /* Failed calls in a row that trip the breaker */
+#define PROBE_MIN_SECONDS   5       /* Wait before the first probe of a tripped backend */
+#define PROBE_MAX_SECONDS   60
+
+
+/* cache_bench is built with WITHOUT_FLICKR so it doesn't need flickcurl. */
+static const backend *backends[] = {
+#ifndef WITHOUT_FLICKR
+    &flickr_backend,
+#endif
+    &synthetic_backend,
+    NULL
+};
+
+static const backend *current;
+
+backend_timeouts backend_timeout = { 10, 30, 300 };
+
+/*
+ * After BREAKER_FAILURES failed calls in a row the breaker trips: calls
+ * fail at once, without touching the network, until a probe thread gets
+ * an answer from the backend again.
+ */
+static pthread_mutex_t breaker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t breaker_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int failures;           /* Calls failed in a row */
+static unsigned short tripped;
+static unsigned short probing;          /* The probe thread is running */
+static unsigned short stopping;         /* backend_kill is waiting for the probe thread */
+static __thread unsigned short refused; /* The call of this thread was turned down */
+
+
+/*
+ * Picks the backend named at the start of spec and initializes it with
+ * the rest of spec, if any: "name" or "name:args".
+ */
+int backend_init(const char *spec) {
+    const char *args = strchr(spec, ':');
+    size_t len = args ? (size_t)(args - spec) : strlen(spec);
+    int i;
+
+    for(i = 0; backends[i]; i++) {
+        if(strlen(backends[i]->name) == len && !strncmp(backends[i]->name, spec, len)) {
+            if(backends[i]->init(args ? args + 1 : ""))
+                return FAIL;
+            current = backends[i];
+            sched_set_quota(current->quota);
+            return SUCCESS;
+        }
+    }
+
+    return FAIL;
+}
+
+void backend_kill() {
+    pthread_mutex_lock(&breaker_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&breaker_cond);
+    while(probing)
+        pthread_cond_wait(&breaker_cond, &breaker_lock);
+    pthread_mutex_unlock(&breaker_lock);
+
+    if(current)
+        current->kill();
+    current = NULL;
+}
+
+/*
+ * Tells that the call failing on this thread was turned down by the
+ * service, such as with a 4xx for a photo that is gone. The service
+ * answered, so the failure doesn't count towards the breaker.
+ */
+void backend_refused() {
+    refused = 1;
+}
+
+/* Whether backend calls go through, as opposed to failing at once while the breaker is tripped. */
+int backend_available() {
+    return !__atomic_load_n(&tripped, __ATOMIC_RELAXED);
+}
+
+/*
+ * Pings the backend, waiting twice as long after every ping that fails,
+ * until one gets through and the breaker can be reset.
+ */
+static void *probe(void *arg) {
+    unsigned int wait = PROBE_MIN_SECONDS;
+    struct timespec ts;
+    int ret;
+    (void)arg;
+
+    pthread_mutex_lock(&breaker_lock);
+    while(!stopping) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += wait;
+        while(!stopping && pthread_cond_timedwait(&breaker_cond, &breaker_lock, &ts) != ETIMEDOUT);
+        if(stopping)
+            break;
+        pthread_mutex_unlock(&breaker_lock);
+
+        sched_begin(SCHED_PROBE, 1);
+        ret = current->ping();
+        sched_end();
+
+        pthread_mutex_lock(&breaker_lock);
+        if(ret == SUCCESS) {
+            __atomic_store_n(&failures, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&tripped, 0, __ATOMIC_RELAXED);
+            stat_dec(STAT_BACKEND_DOWN);
+            syslog(LOG_NOTICE, "%s answers again", current->name);
+            break;
+        }
+        if((wait *= 2) > PROBE_MAX_SECONDS)
+            wait = PROBE_MAX_SECONDS;
+    }
+
+    probing = 0;
+    pthread_cond_broadcast(&breaker_cond);
+    pthread_mutex_unlock(&breaker_lock);
+    return NULL;
+}
+
+/* Trips the breaker and starts probing the backend. */
+static void trip() {
+    pthread_t thread;
+
+    pthread_mutex_lock(&breaker_lock);
+    if(!tripped && !probing && !stopping) {
+        if(!pthread_create(&thread, NULL, probe, NULL)) {
+            pthread_detach(thread);
+            probing = 1;
+            __atomic_store_n(&tripped, 1, __ATOMIC_RELAXED);
+            stat_inc(STAT_BACKEND_DOWN);
+            stat_inc(STAT_BREAKER_TRIPS);
+            syslog(LOG_WARNING, "%d %s calls failed in a row, failing calls until it answers again",
+              BREAKER_FAILURES, current->name);
+        }
+    }
+    pthread_mutex_unlock(&breaker_lock);
+}
+
+void backend_free_photosets(backend_photoset **photosets) {
+    int i;
+
+    if(!photosets)
+        return;
+
+    for(i = 0; photosets[i]; i++) {
+        free(photosets[i]->id);
+        free(photosets[i]->title);
+        free(photosets[i]);
+    }
+    free(photosets);
+}
+
+void backend_free_photos(backend_photo **photos) {
+    int i;
+
+    if(!photos)
+        return;
+
+    for(i = 0; photos[i]; i++) {
+        free(photos[i]->id);
+        free(photos[i]->title);
+        free(photos[i]->uri);
+        free(photos[i]->date_taken);
+        free(photos[i]->tags);
+        free(photos[i]->description);
+        free(photos[i]);
+    }
+    free(photos);
+}
+
+
+/**
+ * Calls into the current backend
+**/
+
+/*
+ * Waits for the turn of a backend call of the class, which also takes a
+ * token of the API quota if api is set. Returns when the call started.
+ */
+static inline uint64_t queued(sched_class sched, int api) {
+    sched_begin(sched, api);
+    refused = 0;
+    return latency_now();
+}
+
+/*
+ * Ends and times a backend call, both on its own and as part of the
+ * current operation, and counts whether it failed towards the breaker.
+ * Only failures to get an answer count, not calls turned down.
+ */
+static inline void timed(latency_op op, latency_phase phase, uint64_t start, int failed) {
+    uint64_t ns = latency_now() - start;
+
+    sched_end();
+    latency_record(op, ns);
+    latency_phase_add(phase, ns);
+
+    if(failed)
+        stat_inc(STAT_API_ERRORS);
+
+    if(failed && !refused) {
+        if(__atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED) >= BREAKER_FAILURES)
+            trip();
+    }
+    else if(__atomic_load_n(&failures, __ATOMIC_RELAXED))
+        __atomic_store_n(&failures, 0, __ATOMIC_RELAXED);
+}
+
+backend_photoset **backend_get_photosets() {
+    backend_photoset **photosets;
+    uint64_t start;
+
+    if(!backend_available())
+        return NULL;
+
+    start = queued(SCHED_LISTING, 1);
+    stat_inc(STAT_API_GET_PHOTOSETS);
+    photosets = current->get_photosets();
+    timed(LAT_API_GET_PHOTOSETS, PHASE_API, start, !photosets);
+    return photosets;
+}
+
+backend_photo **backend_get_photos(const char *photoset_id, int page, int per_page) {
+    backend_photo **photos;
+    uint64_t start;
+
+    if(!backend_available())
+        return NULL;
+
+    start = queued(SCHED_LISTING, 1);
+    stat_inc(STAT_API_GET_PHOTOS);
+    photos = current->get_photos(photoset_id, page, per_page);
+    timed(LAT_API_GET_PHOTOS, PHASE_API, start, !photos);
+    return photos;
+}
+
+int backend_fetch(const char *uri, const char *path) {
+    struct stat st;
+    uint64_t start;
+    int ret;
+
+    if(!backend_available())
+        return FAIL;
+
+    start = queued(SCHED_INTERACTIVE, 0);
+    stat_inc(STAT_API_FETCH);
+    stat_inc(STAT_DOWNLOADS);
+    ret = current->fetch(uri, path);
+    stat_dec(STAT_DOWNLOADS);
+    timed(LAT_API_FETCH, PHASE_DOWNLOAD, start, ret != SUCCESS);
+
+    if(!ret && !stat(path, &st))
+        stat_add(STAT_BYTES_DOWNLOADED, st.st_size);
+    return ret;
+}
+
+int backend_content_length(const char *uri) {
+    uint64_t start;
+    int length;
+
+    if(!backend_available())
+        return FAIL;
+
+    start = queued(SCHED_PROBE, 0);
+    stat_inc(STAT_API_CONTENT_LENGTH);
+    length = current->content_length(uri);
+    timed(LAT_API_CONTENT_LENGTH, PHASE_HEAD, start, length < 0);
+    return length;
+}
+
+char *backend_upload(const char *path, const char *title) {
+    struct stat st;
+    uint64_t start;
+    char *photo_id;
+
+    if(!backend_available())
+        return NULL;
+
+    start = queued(SCHED_INTERACTIVE, 1);
+    stat_inc(STAT_API_UPLOAD);
+    stat_inc(STAT_UPLOADS);
+    photo_id = current->upload(path, title);
+    stat_dec(STAT_UPLOADS);
+    timed(LAT_API_UPLOAD, PHASE_API, start, !photo_id);
+
+    if(photo_id && !stat(path, &st))
+        stat_add(STAT_BYTES_UPLOADED, st.st_size);
+    return photo_id;
+}
+
+/* Counts and times a call, started at start, that returned the SUCCESS or FAIL in ret. */
+static inline int counted(stat_counter counter, latency_op op, uint64_t start, int ret) {
+    timed(op, PHASE_API, start, ret != SUCCESS);
+    stat_inc(counter);
+    return ret;
+}
+
+int backend_set_photo_title(const char *photo_id, const char *title) {
+    uint64_t start;
+
+    if(!backend_available())
+        return FAIL;
+
+    start = queued(SCHED_INTERACTIVE, 1);
+    return counted(STAT_API_SET_PHOTO_TITLE, LAT_API_SET_PHOTO_TITLE, start,
+      current->set_photo_title(photo_id, title));
+}
+
+int backend_set_photoset_title(const char *photoset_id, const char *title) {
+    uint64_t start;
+
+    if(!backend_available())
+        return FAIL;
+
+    start = queued(SCHED_INTERACTIVE, 1);
+    return counted(STAT_API_SET_PHOTOSET_TITLE, LAT_API_SET_PHOTOSET_TITLE, start,
+      current->set_photoset_title(photoset_id, title));
+}
+
+char *backend_create_photoset(const char *title, const char *primary_photo_id) {
+    uint64_t start;
+    char *photoset_id;
+
+    if(!backend_available())
+        return NULL;
+
+    start = queued(SCHED_INTERACTIVE, 1);
+    stat_inc(STAT_API_CREATE_PHOTOSET);
+    photoset_id = current->create_photoset(title, primary_photo_id);
+    timed(LAT_API_CREATE_PHOTOSET, PHASE_API, start, !photoset_id);
+    return photoset_id;
+}
+
+int backend_add_photo(const char *photoset_id, const char *photo_id) {
+    uint64_t start;
+
+    if(!backend_available())
+        return FAIL;
+
+    start = queued(SCHED_INTERACTIVE, 1);
+    return counted(STAT_API_ADD_PHOTO, LAT_API_ADD_PHOTO, start, current->add_photo(photoset_id, photo_id));
+}
+
+int backend_remove_photo(const char *photoset_id, const char *photo_id) {
+    uint64_t start;
+
+    if(!backend_available())
+        return FAIL;
+
+    start = queued(SCHED_INTERACTIVE, 1);
+    return counted(STAT_API_REMOVE_PHOTO, LAT_API_REMOVE_PHOTO, start, current->remove_photo(photoset_id, photo_id));
+}
+
+int backend_delete_photo(const char *photo_id) {
+    uint64_t start;
+
+    if(!backend_available())
+        return FAIL;
+
+    start = queued(SCHED_INTERACTIVE, 1);
+    return counted(STAT_API_DELETE_PHOTO, LAT_API_DELETE_PHOTO, start, current->delete_photo(photo_id));
+}
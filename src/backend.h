@@ -0,0 +1,83 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include "common.h"
+
+typedef struct {
+    char *id;
+    char *title;
+    unsigned int photos_count;
+} backend_photoset;
+
+typedef struct {
+    char *id;
+    char *title;
+    char *uri;              /* Where fetch and content_length find the photo */
+    char *date_taken;       /* "YYYY-MM-DD HH:MM:SS", in local time */
+    char *tags;             /* Space separated. NULL if not known */
+    char *description;      /* NULL if not known */
+} backend_photo;
+
+/*
+ * A photo service the cache is filled from. Photosets are named by their
+ * id and the photos without a photoset by "". Pages start at 1. Lists are
+ * NULL terminated and freed with backend_free_photosets/backend_free_photos,
+ * and the strings they hold may be taken by setting them to NULL. Ids
+ * returned by upload and create_photoset must be freed. ping is a cheap
+ * call telling whether the service answers again.
+ */
+typedef struct {
+    const char *name;
+    unsigned int quota;     /* API calls an hour the service allows. 0 if it has no limit */
+    int (*init)(const char *args);
+    void (*kill)();
+    int (*ping)();
+    backend_photoset **(*get_photosets)();
+    backend_photo **(*get_photos)(const char *photoset_id, int page, int per_page);
+    int (*fetch)(const char *uri, const char *path);
+    int (*content_length)(const char *uri);
+    char *(*upload)(const char *path, const char *title);
+    int (*set_photo_title)(const char *photo_id, const char *title);
+    int (*set_photoset_title)(const char *photoset_id, const char *title);
+    char *(*create_photoset)(const char *title, const char *primary_photo_id);
+    int (*add_photo)(const char *photoset_id, const char *photo_id);
+    int (*remove_photo)(const char *photoset_id, const char *photo_id);
+    int (*delete_photo)(const char *photo_id);
+} backend;
+
+/*
+ * Seconds a call to the service may take. 0 for no limit. Downloads and
+ * calls that change something are only bound by connect and stall, as
+ * they may take long on a slow link.
+ */
+typedef struct {
+    unsigned int connect;       /* To connect */
+    unsigned int stall;         /* Without a byte going either way */
+    unsigned int transfer;      /* For the whole call */
+} backend_timeouts;
+
+extern backend_timeouts backend_timeout;
+
+extern const backend flickr_backend;
+extern const backend synthetic_backend;
+
+int backend_init(const char *spec);
+void backend_kill();
+int backend_available();
+void backend_refused();
+void backend_free_photosets(backend_photoset **photosets);
+void backend_free_photos(backend_photo **photos);
+
+backend_photoset **backend_get_photosets();
+backend_photo **backend_get_photos(const char *photoset_id, int page, int per_page);
+int backend_fetch(const char *uri, const char *path);
+int backend_content_length(const char *uri);
+char *backend_upload(const char *path, const char *title);
+int backend_set_photo_title(const char *photo_id, const char *title);
+int backend_set_photoset_title(const char *photoset_id, const char *title);
+char *backend_create_photoset(const char *title, const char *primary_photo_id);
+int backend_add_photo(const char *photoset_id, const char *photo_id);
+int backend_remove_photo(const char *photoset_id, const char *photo_id);
+int backend_delete_photo(const char *photo_id);
+
+#endif
@@ -1,94 +1,159 @@
-#include <flickcurl.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
-#include <glib.h>
 #include <pthread.h>
 
 #include "cache.h"
-#include "conf.h"
+#include "htable.h"
+#include "search.h"
+#include "backend.h"
+#include "stats.h"
+#include "latency.h"
+#include "pool.h"
 
 
 #define DEFAULT_CACHE_TIMEOUT   14400 /* In seconds. */
 
-/* Valid sizes: http://librdf.org/flickcurl/api/flickcurl-section-photo.html#flickcurl-photo-as-source-uri */
-#define GET_PHOTO_SIZE      'o'
 #define PHOTOS_PER_API_CALL 100
-#define PHOTO_EXTRAS        "date_taken,url_o,original_format"
+#define PAGES_AT_ONCE       8   /* Pages of a photoset fetched in parallel */
 
+#define SEARCH_CACHE_SIZE   64  /* Queries whose results are kept */
+#define OFFSET_CACHE_SIZE   64  /* Hours whose UTC offset is kept. Power of two */
 
-/* Photo parameters */
-#define SAFETY_LEVEL    1
-#define CONTENT_TYPE    1
 
 #define CACHE_UNSET     0
 #define CACHE_SET       1
 
+/* Inode numbers */
+#define ROOT_INO        1               /* The photoset of photos without a photoset is the mount root */
+#define PHOTOSET_INO    (1ULL << 63)    /* Photoset and photo ids may overlap */
+#define LOCAL_INO       (1ULL << 62)    /* Not uploaded yet so there is no Flickr id */
+
 
 typedef struct {
     cached_information ci;
     unsigned short set;
-    GHashTable *photo_ht;
+    htable *photo_ht;
+    size_t bytes;                           /* Approximate memory held by photo_ht */
+    size_t search_bytes;                    /* Memory held by search */
+    unsigned long last_used;                /* use_clock at the last access */
+    photo_listing *listing;                 /* Sorted photo names. NULL until asked for */
+    search_index *search;                   /* Words of the photos. NULL until a photo is added */
+    unsigned short evicted;                 /* search still holds the photos evicted from photo_ht */
+    unsigned int pins;                      /* Threads loading the photos, under load_lock */
+    unsigned short fetching;                /* A thread is fetching the pages, under load_lock */
 } cached_photoset;
 
 typedef struct {
     cached_information ci;
+    unsigned int refs;                      /* photo_ht tables holding the photo, and threads calling the backend for it */
+    unsigned int writes;                    /* Times it was marked dirty, so an upload sees writes made meanwhile */
+    char strings[];                         /* ci.name and ci.id live here */
 } cached_photo;
 
+/* The photos without a photoset that were taken in one month. */
+typedef struct {
+    htable *photo_ht;                       /* Keys and photos borrowed from the root photoset */
+    photo_listing *listing;
+} date_shard;
+
+/* The UTC offset of the local time during an hour, counted in hours since 1970. */
+typedef struct {
+    long hour;
+    long offset;
+    unsigned short set;
+} local_offset;
+
+/* A photo matching a search, before it is placed in the search_results. */
+typedef struct {
+    const char *photoset;
+    const char *key;
+    uint64_t ino;
+    char *name;                             /* Set if another photoset has a photo with the same key */
+} search_hit;
+
 
-static GHashTable *photoset_ht;             /* The photoset cache */
+static htable *photoset_ht;                 /* The photoset cache */
+static htable *photo_id_ht;                 /* Every uploaded photo, keyed by Flickr id */
+static htable *date_ht;                     /* "YYYY/MM" to date_shard. NULL unless enabled */
+static htable *search_ht;                   /* Query to search_results. Emptied whenever a search_index changes */
 static pthread_rwlock_t cache_lock;         /* To make thread safe */
+static pthread_mutex_t refresh_lock = PTHREAD_MUTEX_INITIALIZER;    /* Held while the photosets are fetched */
+static pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;       /* For pins and fetching */
+static pthread_cond_t load_cond = PTHREAD_COND_INITIALIZER;         /* A photoset was fetched */
+static pthread_mutex_t change_lock = PTHREAD_MUTEX_INITIALIZER;     /* Held while a photoset is created or renamed */
 static time_t last_cleaned;                 /* To age/invalidate the cache */
 
-static flickcurl *fc;
+static local_offset offset_cache[OFFSET_CACHE_SIZE];  /* For parse_date_taken */
 
+static size_t listing_bytes;                /* Sum of the bytes of every photoset */
+static size_t search_bytes;                 /* Sum of the bytes of every search index, kept out of the budget */
+static unsigned short search_enabled;       /* Photos are only indexed for search_photos */
+static size_t listing_budget = (size_t)DEFAULT_LISTING_BUDGET * 1024 * 1024;
+static unsigned long use_clock;             /* Orders photoset accesses for eviction */
 
-static inline cached_photo *create_cached_photo() {
-    return (cached_photo *)calloc(1, sizeof(cached_photo));
-}
+static cache_invalidate_func invalidate_func;   /* Told about entries that changed */
 
-static inline cached_photoset *create_cached_photoset() {
-    return (cached_photoset *)calloc(1, sizeof(cached_photoset));
-}
 
-static inline GHashTable *create_cache() {
-    return g_hash_table_new(g_str_hash, g_str_equal);
+/*
+ * Take the cache lock. Only a lock that is not free right away is timed,
+ * as part of the filesystem operation waiting on it.
+ */
+static inline void read_lock() {
+    uint64_t start;
+
+    if(!pthread_rwlock_tryrdlock(&cache_lock))
+        return;
+
+    start = latency_now();
+    pthread_rwlock_rdlock(&cache_lock);
+    latency_phase_add(PHASE_LOCK, latency_now() - start);
 }
 
+static inline void write_lock() {
+    uint64_t start;
 
-/*
- * Initialize the flickcurl connection
-*/
-static int flickr_init() {
-    char *conf_path;
-    char *login;
+    if(!pthread_rwlock_trywrlock(&cache_lock))
+        return;
 
-    flickcurl_init();
-    fc = flickcurl_new();
+    start = latency_now();
+    pthread_rwlock_wrlock(&cache_lock);
+    latency_phase_add(PHASE_LOCK, latency_now() - start);
+}
 
-    conf_path = get_conf_path();
-    if(!conf_path)
-        return FAIL;
+/*
+ * Allocates the photo along with its name and id, so loading a photo takes
+ * one allocation instead of three. The strings are freed with the photo.
+ */
+static cached_photo *create_cached_photo(const char *name, const char *id) {
+    size_t name_len = strlen(name) + 1;
+    size_t id_len = strlen(id) + 1;
+    cached_photo *cp = (cached_photo *)calloc(1, sizeof(cached_photo) + name_len + id_len);
 
-    if(check_conf_file(conf_path, fc))
-        return FAIL;
+    if(!cp)
+        return NULL;
 
-    /* Read from the config file, ~/.flickcurl.conf */
-    if(flickcurl_config_read_ini(fc, conf_path, "flickr", fc, flickcurl_config_var_handler))
-        return FAIL;
+    cp->ci.name = memcpy(cp->strings, name, name_len);
+    cp->ci.id = memcpy(cp->strings + name_len, id, id_len);
+    return cp;
+}
 
-    login = flickcurl_test_login(fc);
-    if(!login)
-        return FAIL;
+static inline cached_photoset *create_cached_photoset() {
+    return (cached_photoset *)calloc(1, sizeof(cached_photoset));
+}
 
-    free(login);
-    free(conf_path);
-    return SUCCESS;
+static inline htable *create_cache() {
+    return htable_new();
+}
+
+/* Inode numbers come from the Flickr ids so they stay the same across cache refreshes. */
+static inline uint64_t id_ino(const char *id) {
+    return strtoull(id, NULL, 10) & ~(PHOTOSET_INO | LOCAL_INO);
 }
 
-static void flickr_kill() {
-    flickcurl_free(fc);
-    flickcurl_finish();
+static inline uint64_t local_ino(const char *photoset, const char *name) {
+    return LOCAL_INO | ((uint64_t)htable_hash(photoset) << 32) | htable_hash(name);
 }
 
 
@@ -97,7 +162,7 @@ static void flickr_kill() {
 **/
 
 /* Creates a new cached_photoset using the photoset or a blank one if NULL is passed in */
-static int new_cached_photoset(cached_photoset **cps, flickcurl_photoset *fps) {
+static int new_cached_photoset(cached_photoset **cps, const backend_photoset *fps) {
     unsigned int i;
     cached_information *ci;
 
@@ -109,10 +174,11 @@ static int new_cached_photoset(cached_photoset **cps, flickcurl_photoset *fps) {
     ci->name = strdup(fps ? fps->title : "");
     ci->id = strdup(fps ? fps->id : "");
     ci->time = 0;
-    ci->size = fps ? (unsigned int)fps->photos_count : 0;
+    ci->size = fps ? fps->photos_count : 0;
+    ci->ino = fps ? (id_ino(fps->id) | PHOTOSET_INO) : ROOT_INO;
     ci->dirty = CLEAN;
     (*cps)->set = CACHE_UNSET;
-    (*cps)->photo_ht = g_hash_table_new(g_str_hash, g_str_equal);
+    (*cps)->photo_ht = create_cache();
 
     /* Replace backslashes with spaces */
     for(i = 0; i < strlen(ci->name); i++) {
@@ -142,187 +208,643 @@ void free_cached_info(cached_information *ci) {
     }
 }
 
-/* All of our keys and values will be dynamic so we will want to free them. */
-static gboolean free_photo_ht(gpointer key, gpointer value, gpointer user_data) {
-    (void)user_data;
+/*
+ * Drops a photoset's reference to the photo. The photo is only freed once
+ * no photoset holds it anymore.
+ */
+static void unref_cached_photo(cached_photo *cp) {
+    if(--cp->refs)
+        return;
+
+    if(htable_lookup(photo_id_ht, cp->ci.id) == cp)
+        htable_remove(photo_id_ht, cp->ci.id);
+
+    free(cp->ci.uri);
+    free(cp);
+}
+
+/*
+ * Reports that a photo, or the photoset itself if photo is NULL, may have
+ * changed so anything cached about it outside of this cache can be dropped.
+ */
+static inline void invalidate(const char *photoset, const char *photo) {
+    if(invalidate_func)
+        invalidate_func(photoset, photo);
+}
+
+/*
+ * All of our keys and values will be dynamic so we will want to free them.
+ * If user_data is the photoset name, the removed photos are invalidated.
+ */
+static int free_photo_ht(char *key, void *value, void *user_data) {
     cached_photo *cp = value;
 
     if(cp->ci.dirty == CLEAN) {
-        free(cp->ci.uri);
-        free(cp->ci.name);
-        free(cp->ci.id);
+        if(user_data)
+            invalidate((const char *)user_data, key);
         free(key);
-        free(value);
-        return TRUE;
+        unref_cached_photo(cp);
+        return 1;
     }
     else {
-        return FALSE;
+        return 0;
+    }
+}
+
+/* Drops our reference to a sorted listing once the photos it lists change. */
+static inline void drop_listing(photo_listing **listing) {
+    if(*listing) {
+        release_photo_listing(*listing);
+        *listing = NULL;
+    }
+}
+
+/*
+ * Approximate memory held by the photos of a photoset. A photo shared with
+ * other photosets is counted once for each of them.
+ */
+static size_t photoset_memory(const cached_photoset *cps) {
+    htable_iter iter;
+    char *key;
+    cached_photo *cp;
+    size_t bytes = htable_memory(cps->photo_ht);
+
+    htable_iter_init(&iter, cps->photo_ht);
+    while(htable_iter_next(&iter, &key, (void **)&cp)) {
+        bytes += sizeof(cached_photo) + strlen(key) + 1;
+        bytes += strlen(cp->ci.name) + strlen(cp->ci.id) + 2;
+        if(cp->ci.uri)
+            bytes += strlen(cp->ci.uri) + 1;
+    }
+    return bytes;
+}
+
+/* Recomputes the memory accounted to the photoset and its search index. */
+static void account_photoset(cached_photoset *cps) {
+    listing_bytes -= cps->bytes;
+    cps->bytes = photoset_memory(cps);
+    listing_bytes += cps->bytes;
+
+    search_bytes -= cps->search_bytes;
+    cps->search_bytes = cps->search ? search_index_memory(cps->search) : 0;
+    search_bytes += cps->search_bytes;
+}
+
+/**
+ * ===Date Index===
+ * Photos without a photoset, grouped by the month they were taken in.
+ * The index is kept up to date as the root photoset is filled and is
+ * cleared whenever the root photoset drops its photos.
+**/
+
+static inline void date_shard_name(time_t time, char *name) {
+    struct tm tm;
+
+    localtime_r(&time, &tm);
+    snprintf(name, DATE_SHARD_SIZE, "%04u/%02u", (unsigned int)(tm.tm_year + 1900) % 10000,
+      (unsigned int)(tm.tm_mon + 1) % 100);
+}
+
+static void free_date_shard(date_shard *ds) {
+    if(ds->listing)
+        release_photo_listing(ds->listing);
+    htable_destroy(ds->photo_ht);
+    free(ds);
+}
+
+static int free_date_ht(char *key, void *value, void *user_data) {
+    (void)user_data;
+    free(key);
+    free_date_shard(value);
+    return 1;
+}
+
+static void index_photo_date(char *key, cached_photo *cp) {
+    char name[DATE_SHARD_SIZE];
+    date_shard *ds;
+
+    if(!date_ht)
+        return;
+
+    date_shard_name(cp->ci.time, name);
+    if(!(ds = htable_lookup(date_ht, name))) {
+        if(!(ds = (date_shard *)calloc(1, sizeof(date_shard))))
+            return;
+        ds->photo_ht = create_cache();
+        htable_insert(date_ht, strdup(name), ds);
+    }
+
+    htable_insert(ds->photo_ht, key, cp);
+    drop_listing(&ds->listing);
+}
+
+static void unindex_photo_date(const char *key, const cached_photo *cp) {
+    char name[DATE_SHARD_SIZE];
+    char *shard_key;
+    void *value;
+    date_shard *ds;
+
+    if(!date_ht)
+        return;
+
+    date_shard_name(cp->ci.time, name);
+    if(!htable_lookup_extended(date_ht, name, &shard_key, &value))
+        return;
+
+    ds = value;
+    htable_remove(ds->photo_ht, key);
+    drop_listing(&ds->listing);
+
+    if(htable_size(ds->photo_ht) == 0) {
+        htable_remove(date_ht, name);
+        free(shard_key);
+        free_date_shard(ds);
+    }
+}
+
+static inline void clear_date_index() {
+    if(date_ht)
+        htable_foreach_remove(date_ht, free_date_ht, NULL);
+}
+
+/**
+ * ===Search Index===
+ * Once enabled, every photoset has an index of the words in the titles,
+ * tags and descriptions of its photos, filled in as its pages come in.
+ * The index outlives photos evicted for the listing budget, as they did
+ * not change, so a search doesn't fetch them again. It is rebuilt when
+ * they are loaded again or dropped for having changed. Search results
+ * are kept until any index changes.
+**/
+
+static int free_search_ht(char *key, void *value, void *user_data) {
+    (void)user_data;
+    free(key);
+    release_search_results(value);
+    return 1;
+}
+
+/* The cached results may be out of date once the photos they hold change. */
+static inline void search_changed() {
+    if(search_ht)
+        htable_foreach_remove(search_ht, free_search_ht, NULL);
+}
+
+/*
+ * Adds the words of the photo to the photoset search index. bp may be NULL
+ * for local photos. The caller calls search_changed once it is done.
+ */
+static void index_photo_words(cached_photoset *cps, const char *key, const cached_photo *cp,
+  const backend_photo *bp) {
+    if(!search_enabled || (!cps->search && !(cps->search = search_index_new())))
+        return;
+
+    search_index_add(cps->search, key, cp->ci.ino, cp->ci.name);
+    if(bp) {
+        search_index_add(cps->search, key, cp->ci.ino, bp->tags);
+        search_index_add(cps->search, key, cp->ci.ino, bp->description);
+    }
+}
+
+/*
+ * Rebuilds the search index from the photos left in the photoset. Only the
+ * titles of those are known at this point.
+ */
+static void reindex_photoset(cached_photoset *cps) {
+    htable_iter iter;
+    char *key;
+    cached_photo *cp;
+
+    search_index_destroy(cps->search);
+    cps->search = NULL;
+    cps->evicted = 0;
+
+    htable_iter_init(&iter, cps->photo_ht);
+    while(htable_iter_next(&iter, &key, (void **)&cp))
+        index_photo_words(cps, key, cp, NULL);
+    search_changed();
+}
+
+/*
+ * Frees the clean photos of a photoset. Dirty photos are kept so they
+ * are not lost before being uploaded. If the photos are dropped because
+ * they may have changed, pass the photoset name to invalidate them;
+ * otherwise they are only evicted, and stay in the search index.
+ */
+static void release_photoset_photos(cached_photoset *cps, const char *invalidate_photoset) {
+    if(cps->ci.ino == ROOT_INO)
+        clear_date_index();
+    htable_foreach_remove(cps->photo_ht, free_photo_ht, (void *)invalidate_photoset);
+    drop_listing(&cps->listing);
+
+    /* The table does not shrink on its own. */
+    if(htable_size(cps->photo_ht) == 0) {
+        htable_destroy(cps->photo_ht);
+        cps->photo_ht = create_cache();
+    }
+    if(invalidate_photoset)
+        reindex_photoset(cps);
+    else if(cps->search)
+        cps->evicted = 1;
+    account_photoset(cps);
+}
+
+/* Keeps the photoset from being freed while the cache is unlocked. */
+static inline void pin_photoset(cached_photoset *cps) {
+    pthread_mutex_lock(&load_lock);
+    cps->pins++;
+    pthread_mutex_unlock(&load_lock);
+}
+
+static inline void unpin_photoset(cached_photoset *cps) {
+    pthread_mutex_lock(&load_lock);
+    cps->pins--;
+    pthread_mutex_unlock(&load_lock);
+}
+
+/* Looks up a photoset, counting the hit or miss. */
+static inline cached_photoset *find_photoset(const char *photoset) {
+    cached_photoset *cps = htable_lookup(photoset_ht, photoset);
+
+    stat_inc(cps ? STAT_PHOTOSET_HIT : STAT_PHOTOSET_MISS);
+    return cps;
+}
+
+static inline void touch_photoset(cached_photoset *cps) {
+    __atomic_store_n(&cps->last_used, __atomic_add_fetch(&use_clock, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+/*
+ * Drops the photo listings of the least recently used photosets until the
+ * cached listings fit within the budget. Photosets that only exist locally
+ * are never evicted.
+ * Assumes there is a write lock initiated
+ */
+static void enforce_listing_budget(const cached_photoset *keep) {
+    htable_iter iter;
+    cached_photoset *cps, *lru;
+
+    while(listing_budget && listing_bytes > listing_budget) {
+        lru = NULL;
+
+        htable_iter_init(&iter, photoset_ht);
+        while(htable_iter_next(&iter, NULL, (void **)&cps)) {
+            if(cps == keep || cps->set == CACHE_UNSET || cps->ci.dirty == DIRTY)
+                continue;
+            if(!lru || cps->last_used < lru->last_used)
+                lru = cps;
+        }
+
+        if(!lru)
+            break;
+
+        release_photoset_photos(lru, NULL);      /* Evicted, not changed */
+        lru->set = CACHE_UNSET;
     }
 }
 
 /* All of our keys and values will be dynamic so we will want to free them. */
-static gboolean free_photoset_ht(gpointer key, gpointer value, gpointer user_data) {
-    GHashTable *photo_ht;
+static int free_photoset_ht(char *key, void *value, void *user_data) {
+    htable *photo_ht;
+    int pinned;
     (void)user_data;
 
     cached_photoset *cps = value;
+
+    release_photoset_photos(cps, key);
     photo_ht = cps->photo_ht;
+    invalidate(key, NULL);
 
-    g_hash_table_foreach_remove(photo_ht, free_photo_ht, NULL);
+    pthread_mutex_lock(&load_lock);
+    pinned = cps->pins > 0;                 /* Its photos are being fetched */
+    pthread_mutex_unlock(&load_lock);
 
-    if(cps->ci.dirty == CLEAN && g_hash_table_size(photo_ht) == 0) {
-        g_hash_table_destroy(photo_ht);
+    if(cps->ci.dirty == CLEAN && htable_size(photo_ht) == 0 && !pinned) {
+        listing_bytes -= cps->bytes;
+        search_bytes -= cps->search_bytes;
+        htable_destroy(photo_ht);
+        search_index_destroy(cps->search);
 
         free(key);
         free(cps->ci.name);
         free(cps->ci.id);
         free(value);
-        return TRUE;
+        return 1;
     }
     else {
         cps->set = (cps->ci.dirty == CLEAN) ? CACHE_UNSET : CACHE_SET;
-        return FALSE;
+        return 0;
     }
 }
 
 /*
  * Checks whether the cache should be cleaned. Time can be changed in
- * DEFAULT_CACHE_TIMEOUT define.
+ * DEFAULT_CACHE_TIMEOUT define. If the photosets can't be listed, the cache
+ * is kept as it is and served until they can. The photosets are fetched
+ * with the cache unlocked, one thread at a time, so no one waits on the
+ * cache lock behind the backend.
  * Assumes there is a lock initiated
 */
 static int check_cache() {
-    flickcurl_photoset **fps;
+    backend_photoset **fps = NULL;
     cached_photoset *cps;
-    int i;
+    int stale, i;
 
     if((time(NULL) - last_cleaned) < DEFAULT_CACHE_TIMEOUT)
         return SUCCESS;
 
-    pthread_rwlock_unlock(&cache_lock); /* Release the read lock and lock for writting */
-    pthread_rwlock_wrlock(&cache_lock);
+    pthread_rwlock_unlock(&cache_lock);
+    pthread_mutex_lock(&refresh_lock);
 
-    if((time(NULL) - last_cleaned) < DEFAULT_CACHE_TIMEOUT)
+    read_lock();
+    stale = (time(NULL) - last_cleaned) >= DEFAULT_CACHE_TIMEOUT;
+    pthread_rwlock_unlock(&cache_lock);
+
+    if(stale)
+        fps = backend_get_photosets();
+
+    write_lock();
+    pthread_mutex_unlock(&refresh_lock);
+
+    if(!stale)                          /* Another thread refreshed it meanwhile */
         return SUCCESS;
 
+    if(!fps)
+        return htable_size(photoset_ht) ? SUCCESS : FAIL;
+
     /* Wipe clean entries from the cache. */
-    g_hash_table_foreach_remove(photoset_ht, free_photoset_ht, NULL);
+    htable_foreach_remove(photoset_ht, free_photoset_ht, NULL);
 
-    if(g_hash_table_size(photoset_ht) == 0) {
-        g_hash_table_destroy(photoset_ht);
+    if(htable_size(photoset_ht) == 0) {
+        htable_destroy(photoset_ht);
         photoset_ht = create_cache();
     }
 
-    if(!g_hash_table_lookup(photoset_ht, "")) {
+    if(!htable_lookup(photoset_ht, "")) {
         /* Create an empty photoset container for the photos not in a photoset */
-        if(new_cached_photoset(&cps, NULL))
+        if(new_cached_photoset(&cps, NULL)) {
+            backend_free_photosets(fps);
             return FAIL;
+        }
 
-        g_hash_table_insert(photoset_ht, strdup(""), cps);
+        htable_insert(photoset_ht, strdup(""), cps);
     }
 
-    if(!(fps = flickcurl_photosets_getList(fc, NULL)))
-        return FAIL;
-
     /* Add the photosets to the cache */
     for(i = 0; fps[i]; i++) {
-        if(!g_hash_table_lookup(photoset_ht, fps[i]->title)) {
-            if(new_cached_photoset(&cps, fps[i]))
+        if(!htable_lookup(photoset_ht, fps[i]->title)) {
+            if(new_cached_photoset(&cps, fps[i])) {
+                backend_free_photosets(fps);
                 return FAIL;
-            g_hash_table_insert(photoset_ht, strdup(cps->ci.name), cps);
+            }
+            htable_insert(photoset_ht, strdup(cps->ci.name), cps);
         }
     }
-    flickcurl_free_photosets(fps);
+    backend_free_photosets(fps);
 
     last_cleaned = time(NULL);
 
     return SUCCESS;
 }
 
-static int populate_photoset_cache(cached_photoset *cps, flickcurl_photo **fp) {
+/*
+ * Adds the photo to the photoset. Can't place empty or duplicate names into
+ * the hash table. If this is the case, use the photo id instead.
+ */
+static void insert_photo(cached_photoset *cps, cached_photo *cp, const backend_photo *bp) {
+    char *key;
+
+    if(cp->ci.name[0] == '\0' || htable_lookup(cps->photo_ht, cp->ci.name))
+        key = strdup(cp->ci.id);
+    else
+        key = strdup(cp->ci.name);
+
+    htable_insert(cps->photo_ht, key, cp);
+    index_photo_words(cps, key, cp, bp);
+
+    if(cps->ci.ino == ROOT_INO)
+        index_photo_date(key, cp);
+}
+
+/* Days since 1970-01-01 of a date in the Gregorian calendar. */
+static inline long days_from_civil(long year, unsigned int mon, unsigned int day) {
+    unsigned int yoe, doy, doe;
+    long era;
+
+    year -= (mon <= 2);
+    era = (year >= 0 ? year : year - 399) / 400;
+    yoe = (unsigned int)(year - era * 400);
+    doy = (153 * (mon > 2 ? mon - 3 : mon + 9) + 2) / 5 + day - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (long)doe - 719468;
+}
+
+/* Reads len digits. Returns -1 if there is anything else. */
+static inline int parse_digits(const char *str, int len) {
+    int value = 0;
+
+    for(; len > 0; len--, str++) {
+        if(*str < '0' || *str > '9')
+            return -1;
+        value = value * 10 + (*str - '0');
+    }
+    return value;
+}
+
+/*
+ * Flickr gives the date taken as "YYYY-MM-DD HH:MM:SS", in the local time
+ * of the camera. It is read as local time, like mktime would, but without
+ * an allocation or the timezone lock for each photo. mktime is only asked
+ * for the UTC offset of an hour that is not in offset_cache yet.
+ * Returns 0 if the date can't be read.
+ * Assumes there is a write lock initiated
+ */
+static time_t parse_date_taken(const char *date) {
+    int year, mon, day, hour, min, sec;
+    local_offset *lo;
+    long days, hours;
+
+    if(!date || strlen(date) < 19 || date[4] != '-' || date[7] != '-' || date[10] != ' ' ||
+      date[13] != ':' || date[16] != ':')
+        return 0;
+
+    year = parse_digits(date, 4);
+    mon  = parse_digits(date + 5, 2);
+    day  = parse_digits(date + 8, 2);
+    hour = parse_digits(date + 11, 2);
+    min  = parse_digits(date + 14, 2);
+    sec  = parse_digits(date + 17, 2);
+
+    if(year < 0 || mon < 1 || mon > 12 || day < 1 || day > 31 || hour < 0 || hour > 23 ||
+      min < 0 || min > 59 || sec < 0 || sec > 60)
+        return 0;
+
+    days = days_from_civil(year, (unsigned int)mon, (unsigned int)day);
+    hours = days * 24 + hour;
+
+    lo = &offset_cache[(unsigned long)hours & (OFFSET_CACHE_SIZE - 1)];
+    if(!lo->set || lo->hour != hours) {
+        struct tm tm = {0};
+
+        tm.tm_year = year - 1900;
+        tm.tm_mon = mon - 1;
+        tm.tm_mday = day;
+        tm.tm_hour = hour;
+        tm.tm_isdst = -1;           /* Let mktime work out daylight saving time */
+
+        lo->hour = hours;
+        lo->offset = (long)(hours * 3600 - mktime(&tm));
+        lo->set = 1;
+    }
+
+    return (time_t)(hours * 3600 + min * 60 + sec - lo->offset);
+}
+
+static int populate_photoset_cache(cached_photoset *cps, backend_photo **bp) {
     int j = 0;
 
-    if(!fp)
+    if(!bp)
         return FAIL;
 
     /* Add photos to photoset cache */
-    for(; fp[j]; j++) {
+    for(; bp[j]; j++) {
         cached_photo *cp;
-        struct tm tm = {0};
         char *title;
         char *id;
 
-        title = fp[j]->fields[PHOTO_FIELD_title].string;
-        id    = fp[j]->id;
+        title = bp[j]->title ? bp[j]->title : "";
+        id    = bp[j]->id;
 
         /* Check if dirty version already exists in the database. */
-        if((cp = g_hash_table_lookup(cps->photo_ht, title))) {
+        if((cp = htable_lookup(cps->photo_ht, title))) {
             if(!strcmp(cp->ci.id, id))
                 continue;
         }
-        else if((cp = g_hash_table_lookup(cps->photo_ht, id))) {
+        else if((cp = htable_lookup(cps->photo_ht, id))) {
             if(!strcmp(cp->ci.id, id))
                 continue;
             else
                 continue;              /* TODO: Need to figure out what to do here. */
         }
 
-        if(!(cp = create_cached_photo())) {
+        /* The photo may already be loaded through another photoset. */
+        if((cp = htable_lookup(photo_id_ht, id))) {
+            cp->refs++;
+            insert_photo(cps, cp, bp[j]);
+            continue;
+        }
+
+        if(!(cp = create_cached_photo(title, id))) {
             return FAIL;
         }
 
-        cp->ci.uri = flickcurl_photo_as_source_uri(fp[j], GET_PHOTO_SIZE);
-        cp->ci.name = strdup(title);
-        cp->ci.id = strdup(id);
+        cp->ci.uri = bp[j]->uri;                /* Taken, not copied */
+        bp[j]->uri = NULL;
+        cp->ci.ino = id_ino(id);
         cp->ci.size = PHOTO_SIZE_UNSET;
         cp->ci.dirty = CLEAN;
+        cp->ci.time = parse_date_taken(bp[j]->date_taken);
+        cp->refs = 1;
 
-        sscanf(fp[j]->fields[PHOTO_FIELD_dates_taken].string, "%4d-%2d-%2d %2d:%2d:%2d",
-          &(tm.tm_year), &(tm.tm_mon), &(tm.tm_mday), &(tm.tm_hour), &(tm.tm_min), &(tm.tm_sec));
-        tm.tm_year = tm.tm_year - 1900;     /* Years since 1900 */
-        tm.tm_mon--;                        /* Programmers start with 0... */
-        tm.tm_sec--;
-        tm.tm_min--;
-        tm.tm_hour--;
-        cp->ci.time = mktime(&tm);
-
-        /* Can't place empty or duplicate names into the hash table. If this is the case, use the photo id instead. */
-        if(cp->ci.name[0] == '\0' || g_hash_table_lookup(cps->photo_ht, cp->ci.name))
-            g_hash_table_insert(cps->photo_ht, strdup(cp->ci.id), cp);
-        else
-            g_hash_table_insert(cps->photo_ht, strdup(cp->ci.name), cp);
+        htable_insert(photo_id_ht, cp->ci.id, cp);
+        insert_photo(cps, cp, bp[j]);
     }
 
+    if(j > 0)
+        search_changed();
     return j;
 }
 
-static inline flickcurl_photo **get_photoset_photos(cached_photoset *cps, int page) {
-    flickcurl_photo **fp;
+/* A page of photos fetched on the pool. */
+typedef struct {
+    pool_group *group;
+    const char *photoset_id;
+    int page;
+    backend_photo **photos;
+} page_fetch;
+
+/* A failed page ends the photoset, so the pages after it are dropped. */
+static void fetch_page(void *arg) {
+    page_fetch *pf = (page_fetch *)arg;
+
+    if(!(pf->photos = backend_get_photos(pf->photoset_id, pf->page, PHOTOS_PER_API_CALL)))
+        pool_cancel(pf->group);
+}
 
-    /* Are we searching for photos in a photoset or not? */
-    if(!strcmp(cps->ci.id, "")) {   /* Get photos NOT in a photoset */
-        if(!(fp = flickcurl_photos_getNotInSet(fc, 0, 0, NULL, NULL, 0, PHOTO_EXTRAS, PHOTOS_PER_API_CALL, page)))
-            return NULL;
-    }
-    else {                          /* Add the photos of the photoset into the cache */
-        if(!(fp = flickcurl_photosets_getPhotos(fc, cps->ci.id, PHOTO_EXTRAS, 0, PHOTOS_PER_API_CALL, page)))
-            return NULL;
+/*
+ * Fetches the pages of the photoset with the id, with no lock held. Its
+ * photo count tells how many pages there are, so up to PAGES_AT_ONCE of
+ * them are fetched together; the pages past it, if the count was short,
+ * come one at a time. Pages after a short or failed one are thrown away.
+ * Returns how many pages were placed in pages, which is to be freed.
+ */
+static unsigned int fetch_photoset_pages(const char *id, unsigned int count, backend_photo ****pages) {
+    page_fetch fetches[PAGES_AT_ONCE];
+    backend_photo ***kept = NULL, ***grown;
+    unsigned int num_kept = 0, known, i, n, len;
+    int page = 1;
+    int more = 1;
+
+    known = (count + PHOTOS_PER_API_CALL - 1) / PHOTOS_PER_API_CALL;
+
+    /* The photoset with no id holds the photos that are in no photoset */
+    while(more) {
+        pool_group group = { 0 };
+
+        n = ((unsigned int)page <= known) ? known - (unsigned int)page + 1 : 1;
+        if(n > PAGES_AT_ONCE)
+            n = PAGES_AT_ONCE;
+
+        for(i = 0; i < n; i++) {
+            fetches[i].group = &group;
+            fetches[i].photoset_id = id;
+            fetches[i].page = page + (int)i;
+            fetches[i].photos = NULL;
+            pool_submit(&group, SCHED_LISTING, fetch_page, &fetches[i]);
+        }
+        pool_wait(&group);
+        page += (int)n;
+
+        for(i = 0; i < n; i++) {
+            backend_photo **bp = fetches[i].photos;
+
+            if(!bp || !more || !(grown = (backend_photo ***)realloc(kept, (num_kept + 1) * sizeof(*kept)))) {
+                more = 0;
+                if(bp)
+                    backend_free_photos(bp);
+                continue;
+            }
+
+            kept = grown;
+            kept[num_kept++] = bp;
+
+            for(len = 0; bp[len]; len++);
+            if(len < PHOTOS_PER_API_CALL)
+                more = 0;
+        }
     }
 
-    return fp;
+    *pages = kept;
+    return num_kept;
 }
 
 /*
  * The photosets are filled dynamically based on which photosets are loaded
  * (it would be a waste to load all flickr info if not needed).
  * This method needs to be called in order to fill the photoset cache
- * with photo information.
+ * with photo information. The pages are fetched with the cache unlocked,
+ * by one thread while any other wanting the same photoset waits for it,
+ * so only the photos being added hold up the rest of the filesystem.
+ * Returns with a write lock if the photos were not loaded yet.
  * Assumes there is a lock initiated
  */
 static int check_photoset_cache(cached_photoset *cps) {
-    flickcurl_photo **fp;
-    unsigned int total_size = 0;
-    int processed = 0;
-    int page = 0;
+    backend_photo ***pages = NULL;
+    unsigned int num_pages = 0, total_size = 0, count = 0, i;
+    char *id = NULL;
+    int processed;
+    int fetcher;
+    int failed = 0;
 
     if(!cps)
         return FAIL;
@@ -331,54 +853,359 @@ static int check_photoset_cache(cached_photoset *cps) {
     if(cps->set)
         return SUCCESS;
 
-    pthread_rwlock_unlock(&cache_lock); /* Release the read lock and lock for writting */
-    pthread_rwlock_wrlock(&cache_lock);
+    /* Pinned, so it is not freed while the lock is let go */
+    pthread_mutex_lock(&load_lock);
+    cps->pins++;
+    if((fetcher = !cps->fetching))
+        cps->fetching = 1;
+    pthread_mutex_unlock(&load_lock);
 
-    if(cps->set)
-        return SUCCESS;
+    if(fetcher) {
+        id = strdup(cps->ci.id);
+        count = cps->ci.size;
+    }
+    pthread_rwlock_unlock(&cache_lock);
 
-    while((fp = get_photoset_photos(cps, page++))) {
-        processed = populate_photoset_cache(cps, fp);
-        flickcurl_free_photos(fp);
-        if(processed < 0)
-            return FAIL;
+    if(fetcher) {
+        if(id)
+            num_pages = fetch_photoset_pages(id, count, &pages);
+    }
+    else {
+        pthread_mutex_lock(&load_lock);
+        while(cps->fetching)
+            pthread_cond_wait(&load_cond, &load_lock);
+        pthread_mutex_unlock(&load_lock);
+    }
 
-        total_size += (unsigned int)processed;
+    write_lock();
 
-        if(processed < PHOTOS_PER_API_CALL)
-            break;
+    if(fetcher && !cps->set) {
+        stat_inc(STAT_PHOTOSET_LOAD);
+        drop_listing(&cps->listing);
+        if(cps->evicted)
+            reindex_photoset(cps);              /* The photos are indexed again as they come */
+
+        for(i = 0; i < num_pages; i++) {
+            if(!failed) {
+                if((processed = populate_photoset_cache(cps, pages[i])) < 0)
+                    failed = 1;
+                else
+                    total_size += (unsigned int)processed;
+            }
+            backend_free_photos(pages[i]);
+        }
+
+        /* Left unloaded if no page came, so the next access tries again */
+        if(!failed && num_pages > 0) {
+            cps->ci.time = time(NULL);
+            cps->ci.size = total_size;
+            cps->set = CACHE_SET;
+            account_photoset(cps);
+        }
     }
+    free(pages);
+    free(id);
+
+    pthread_mutex_lock(&load_lock);
+    cps->pins--;
+    if(fetcher) {
+        cps->fetching = 0;
+        pthread_cond_broadcast(&load_cond);
+    }
+    pthread_mutex_unlock(&load_lock);
 
-    cps->ci.time = time(NULL);
-    cps->ci.size = total_size;
-    cps->set = CACHE_SET;
+    if(!cps->set)
+        return FAIL;
 
+    if(fetcher)
+        enforce_listing_budget(cps);
     return SUCCESS;
 }
 
 /*
- * Initiates a new flickcurl connection and creates the caching
- * mechanism.
+ * Creates the caching mechanism. The backend must be initialized first.
 */
 int flickr_cache_init() {
-    if(flickr_init())
-        return FAIL;
     photoset_ht = create_cache();
+    photo_id_ht = create_cache();
+    search_ht = create_cache();
     last_cleaned = 0;
     pthread_rwlock_init(&cache_lock, NULL);
     return SUCCESS;
 }
 
 /*
- * Destroys the caches and the flickcurl connection
+ * Destroys the caches
 */
 void flickr_cache_kill() {
     /* Wipe existing cache */
-    pthread_rwlock_wrlock(&cache_lock);
+    write_lock();
     pthread_rwlock_destroy(&cache_lock);
-    g_hash_table_foreach_remove(photoset_ht, free_photoset_ht, NULL);
-    g_hash_table_destroy(photoset_ht);
-    flickr_kill();
+    htable_foreach_remove(photoset_ht, free_photoset_ht, NULL);
+    htable_destroy(photoset_ht);
+    htable_destroy(photo_id_ht);
+    search_changed();
+    htable_destroy(search_ht);
+    if(date_ht)
+        htable_destroy(date_ht);
+}
+
+/*
+ * Sets the function told about photos and photosets that changed. It is
+ * called with the cache locked, so it must not call back into the cache.
+ */
+void set_cache_invalidate(cache_invalidate_func func) {
+    write_lock();
+    invalidate_func = func;
+    pthread_rwlock_unlock(&cache_lock);
+}
+
+static void load_photoset_task(void *arg) {
+    load_photoset((const char *)arg);
+}
+
+/*
+ * Loads the photos of every photoset not in the search indexes yet, on the
+ * pool, so a search covers the whole account. Photosets only evicted for
+ * the listing budget are still indexed and cost nothing.
+ * Assumes no lock is held
+ */
+static void load_unindexed_photosets() {
+    pool_group group = { 0 };
+    htable_iter iter;
+    char *key;
+    char **names;
+    cached_photoset *cps;
+    unsigned int num_names = 0, i;
+
+    read_lock();
+    if(!(names = (char **)malloc(sizeof(char *) * (htable_size(photoset_ht) + 1)))) {
+        pthread_rwlock_unlock(&cache_lock);
+        return;
+    }
+
+    htable_iter_init(&iter, photoset_ht);
+    while(htable_iter_next(&iter, &key, (void **)&cps))
+        if(cps->set == CACHE_UNSET && !cps->evicted && (names[num_names] = strdup(key)))
+            num_names++;
+    pthread_rwlock_unlock(&cache_lock);
+
+    for(i = 0; i < num_names; i++)
+        pool_submit(&group, SCHED_LISTING, load_photoset_task, names[i]);
+    pool_wait(&group);
+
+    for(i = 0; i < num_names; i++)
+        free(names[i]);
+    free(names);
+}
+
+static int compare_hits_by_ino(const void *a, const void *b) {
+    const search_hit *ha = a, *hb = b;
+
+    if(ha->ino != hb->ino)
+        return (ha->ino > hb->ino) ? 1 : -1;
+    return strcmp(ha->photoset, hb->photoset);
+}
+
+static int compare_hits_by_key(const void *a, const void *b) {
+    const search_hit *ha = a, *hb = b;
+    int cmp = strcmp(ha->key, hb->key);
+
+    return cmp ? cmp : strcmp(ha->photoset, hb->photoset);
+}
+
+static inline const char *hit_name(const search_hit *hit) {
+    return hit->name ? hit->name : hit->key;
+}
+
+static int compare_hits_by_name(const void *a, const void *b) {
+    return strcmp(hit_name(a), hit_name(b));
+}
+
+/*
+ * Runs the query against the search index of every loaded photoset. The
+ * results are placed in a single allocation like a photo_listing.
+ * Assumes there is a write lock initiated
+ */
+static search_results *build_search_results(const char *query) {
+    htable_iter iter;
+    char *name;
+    char **keys;
+    char *strings;
+    cached_photoset *cps;
+    search_hit *hits = NULL, *more;
+    search_results *results = NULL;
+    uint64_t ino;
+    unsigned int num_hits = 0, n, i, j;
+    size_t bytes;
+
+    htable_iter_init(&iter, photoset_ht);
+    while(htable_iter_next(&iter, &name, (void **)&cps)) {
+        if(!cps->search || !(n = search_index_query(cps->search, query, &keys)))
+            continue;
+
+        if(!(more = (search_hit *)realloc(hits, (num_hits + n) * sizeof(search_hit)))) {
+            free(keys);
+            goto fail;
+        }
+        hits = more;
+
+        for(i = 0; i < n; i++) {
+            if(!(ino = search_index_id(cps->search, keys[i])))
+                continue;
+            hits[num_hits].photoset = name;
+            hits[num_hits].key = keys[i];
+            hits[num_hits].ino = ino;
+            hits[num_hits].name = NULL;
+            num_hits++;
+        }
+        free(keys);
+    }
+
+    /* A photo in several photosets is listed once, preferably without a photoset. */
+    qsort(hits, num_hits, sizeof(search_hit), compare_hits_by_ino);
+    for(i = 0, j = 0; i < num_hits; i++)
+        if(j == 0 || hits[i].ino != hits[j - 1].ino)
+            hits[j++] = hits[i];
+    num_hits = j;
+
+    /* Different photos with the same key are told apart by their photoset. */
+    qsort(hits, num_hits, sizeof(search_hit), compare_hits_by_key);
+    for(i = 1; i < num_hits; i++) {
+        if(!strcmp(hits[i].key, hits[i - 1].key)) {
+            size_t len = strlen(hits[i].key) + strlen(hits[i].photoset) + 4;
+
+            if((hits[i].name = (char *)malloc(len)))
+                snprintf(hits[i].name, len, "%s (%s)", hits[i].key, hits[i].photoset);
+        }
+    }
+    qsort(hits, num_hits, sizeof(search_hit), compare_hits_by_name);
+
+    /* Each entry is its name and a target of "../../photoset/key" */
+    bytes = sizeof(search_results) + num_hits * sizeof(search_entry);
+    for(i = 0; i < num_hits; i++)
+        bytes += strlen(hit_name(&hits[i])) + strlen(hits[i].photoset) + strlen(hits[i].key) + 9;
+
+    if(!(results = (search_results *)malloc(bytes)))
+        goto fail;
+
+    results->refs = 0;
+    results->count = num_hits;
+    strings = (char *)(results->entries + num_hits);
+
+    for(i = 0; i < num_hits; i++) {
+        results->entries[i].name = strcpy(strings, hit_name(&hits[i]));
+        strings += strlen(strings) + 1;
+
+        results->entries[i].target = strings;
+        strcpy(strings, "../../");
+        if(hits[i].photoset[0] != '\0') {
+            strcat(strings, hits[i].photoset);
+            strcat(strings, "/");
+        }
+        strcat(strings, hits[i].key);
+        strings += strlen(strings) + 1;
+    }
+
+fail:
+    for(i = 0; i < num_hits; i++)
+        free(hits[i].name);
+    free(hits);
+    return results;
+}
+
+/*
+ * Returns the photos whose titles, tags or descriptions hold every word of
+ * the query. The first search loads every photoset. Later ones are answered
+ * from the search indexes, or straight from the results of an earlier
+ * identical query if no photo changed since.
+ * Release the results with release_search_results.
+ */
+search_results *search_photos(const char *query) {
+    search_results *results = NULL;
+    char *key;
+
+    read_lock();
+    if(check_cache())
+        goto fail;
+
+    if(!(results = htable_lookup(search_ht, query))) {
+        pthread_rwlock_unlock(&cache_lock);
+        load_unindexed_photosets();
+
+        /* Queries sort the postings they read, so they need the write lock. */
+        write_lock();
+
+        if(!(results = htable_lookup(search_ht, query))) {
+            if(!(results = build_search_results(query)))
+                goto fail;
+
+            if(htable_size(search_ht) >= SEARCH_CACHE_SIZE)
+                search_changed();
+
+            if((key = strdup(query)) && !htable_insert(search_ht, key, results))
+                results->refs++;
+            else
+                free(key);
+        }
+    }
+
+    __atomic_add_fetch(&results->refs, 1, __ATOMIC_RELAXED);
+
+fail: pthread_rwlock_unlock(&cache_lock);
+    return results;
+}
+
+void release_search_results(search_results *results) {
+    if(results && __atomic_sub_fetch(&results->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(results);
+}
+
+static int compare_entry_name(const void *name, const void *entry) {
+    return strcmp((const char *)name, ((const search_entry *)entry)->name);
+}
+
+/* Finds the entry with the given name in the results. */
+const search_entry *search_results_lookup(const search_results *results, const char *name) {
+    return bsearch(name, results->entries, results->count, sizeof(search_entry), compare_entry_name);
+}
+
+/*
+ * Starts grouping the photos without a photoset by the month they were
+ * taken in. Must be called before the photos are loaded.
+ */
+void enable_date_index() {
+    write_lock();
+    if(!date_ht)
+        date_ht = create_cache();
+    pthread_rwlock_unlock(&cache_lock);
+}
+
+/*
+ * Starts indexing the words of the photos for search_photos. Must be
+ * called before the photos are loaded.
+ */
+void enable_search_index() {
+    write_lock();
+    search_enabled = 1;
+    pthread_rwlock_unlock(&cache_lock);
+}
+
+/* Sets the memory budget, in bytes, for the cached photo listings. */
+void set_listing_budget(size_t bytes) {
+    write_lock();
+    listing_budget = bytes;
+    pthread_rwlock_unlock(&cache_lock);
+}
+
+/* The approximate memory, in bytes, held by the cached photosets and their search indexes. */
+size_t get_cache_memory() {
+    size_t bytes;
+
+    read_lock();
+    bytes = listing_bytes + search_bytes;
+    pthread_rwlock_unlock(&cache_lock);
+    return bytes;
 }
 
 /**
@@ -391,21 +1218,21 @@ void flickr_cache_kill() {
  * IMPORTANT: Make sure you free(names) after you are done!
  */
 unsigned int get_photoset_names(char ***names) {
-    GHashTableIter iter;
+    htable_iter iter;
     char *key;
     unsigned int size, i;
 
     if(!names)
         return 0;
 
-    pthread_rwlock_rdlock(&cache_lock);
+    read_lock();
     if(check_cache()) {
         pthread_rwlock_unlock(&cache_lock);
         return 0;
     }
 
     /* We dont want to add the "" photoset (used for photos without a photoset) into this list */
-    size = g_hash_table_size(photoset_ht) - 1;
+    size = htable_size(photoset_ht) - 1;
 
     if(!(*names = (char **)malloc(sizeof(*names) * size))) {
         pthread_rwlock_unlock(&cache_lock);
@@ -413,9 +1240,9 @@ unsigned int get_photoset_names(char ***names) {
     }
 
     /* Add each photoset to the list. We add the keys since the names may be duplicates/NULL */
-    g_hash_table_iter_init(&iter, photoset_ht);
+    htable_iter_init(&iter, photoset_ht);
     i = 0;
-    while(g_hash_table_iter_next(&iter, (gpointer)&key, NULL)) {
+    while(htable_iter_next(&iter, &key, NULL)) {
         if(key && strcmp(key, "")) {
             (*names)[i] = strdup(key);
             i++;
@@ -433,7 +1260,7 @@ unsigned int get_photoset_names(char ***names) {
  * after you are done!
  */
 unsigned int get_photo_names(const char *photoset, char ***names) {
-    GHashTableIter iter;
+    htable_iter iter;
     char *key;
     cached_photoset *cps;
     cached_photo *cp;
@@ -442,25 +1269,26 @@ unsigned int get_photo_names(const char *photoset, char ***names) {
     if(!names || !photoset)
         return 0;
 
-    pthread_rwlock_rdlock(&cache_lock);
+    read_lock();
     if(check_cache())
         goto fail;
 
     /* If the photoset is not found in the cache, return */
-    if(!(cps = g_hash_table_lookup(photoset_ht, photoset)))
+    if(!(cps = find_photoset(photoset)))
         goto fail;
 
     if(check_photoset_cache(cps))
         goto fail;
 
-    size = g_hash_table_size(cps->photo_ht);
+    touch_photoset(cps);
+    size = htable_size(cps->photo_ht);
 
     if(!(*names = (char **)malloc(sizeof(*names) * size)))
         goto fail;
 
     /* Add each photo to the list. We add the keys since the names may be duplicates/NULL */
-    g_hash_table_iter_init(&iter, cps->photo_ht);
-    for(i = 0; g_hash_table_iter_next(&iter, (gpointer)&key, (gpointer)&cp); i++)
+    htable_iter_init(&iter, cps->photo_ht);
+    for(i = 0; htable_iter_next(&iter, &key, (void **)&cp); i++)
     {
         (*names)[i] = strdup(key);
     }
@@ -472,6 +1300,217 @@ fail:   pthread_rwlock_unlock(&cache_lock);
     return 0;
 }
 
+/* Newest photos first, then by name. */
+static int compare_listing_entries(const void *a, const void *b) {
+    const listing_entry *ea = a;
+    const listing_entry *eb = b;
+
+    if(ea->time != eb->time)
+        return (ea->time > eb->time) ? -1 : 1;
+    return strcmp(ea->name, eb->name);
+}
+
+/*
+ * Builds the sorted listing of a photoset in a single allocation: the
+ * header, then the entries, then the names they point to.
+ */
+static photo_listing *build_photo_listing(const htable *photo_ht) {
+    htable_iter iter;
+    char *key, *names;
+    cached_photo *cp;
+    photo_listing *listing;
+    unsigned int count = htable_size(photo_ht);
+    size_t bytes = 0;
+    unsigned int i = 0;
+
+    htable_iter_init(&iter, photo_ht);
+    while(htable_iter_next(&iter, &key, NULL))
+        bytes += strlen(key) + 1;
+
+    listing = (photo_listing *)malloc(sizeof(photo_listing) + count * sizeof(listing_entry) + bytes);
+    if(!listing)
+        return NULL;
+
+    listing->refs = 1;      /* Held by the photoset */
+    listing->count = count;
+    names = (char *)(listing->entries + count);
+
+    htable_iter_init(&iter, photo_ht);
+    while(htable_iter_next(&iter, &key, (void **)&cp)) {
+        strcpy(names, key);
+        listing->entries[i].name = names;
+        listing->entries[i].time = cp->ci.time;
+        names += strlen(key) + 1;
+        i++;
+    }
+
+    qsort(listing->entries, count, sizeof(listing_entry), compare_listing_entries);
+    return listing;
+}
+
+/*
+ * Returns a new reference to the listing kept in *slot, building it from
+ * photo_ht first if needed.
+ * Assumes there is a lock initiated
+ */
+static photo_listing *ref_listing(photo_listing **slot, const htable *photo_ht) {
+    photo_listing *listing;
+    photo_listing *expected = NULL;
+
+    /* Several readers may build it at once. Only one gets to keep it. */
+    if(!(listing = __atomic_load_n(slot, __ATOMIC_ACQUIRE))) {
+        if(!(listing = build_photo_listing(photo_ht)))
+            return NULL;
+
+        if(!__atomic_compare_exchange_n(slot, &expected, listing, 0,
+          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            free(listing);
+            listing = expected;
+        }
+    }
+
+    __atomic_add_fetch(&listing->refs, 1, __ATOMIC_RELAXED);
+    return listing;
+}
+
+/*
+ * Returns the sorted, immutable listing of the photos in a photoset. The
+ * same listing is handed out until photos are added to or removed from the
+ * photoset, so paging through a large directory does not rebuild it.
+ *
+ * IMPORTANT: Give it back with release_photo_listing when done.
+ */
+photo_listing *get_photo_listing(const char *photoset) {
+    cached_photoset *cps;
+    photo_listing *listing = NULL;
+
+    read_lock();
+    if(check_cache())
+        goto fail;
+
+    if(!(cps = find_photoset(photoset)))
+        goto fail;
+
+    if(check_photoset_cache(cps))
+        goto fail;
+
+    touch_photoset(cps);
+    listing = ref_listing(&cps->listing, cps->photo_ht);
+
+fail: pthread_rwlock_unlock(&cache_lock);
+    return listing;
+}
+
+void release_photo_listing(photo_listing *listing) {
+    if(listing && __atomic_sub_fetch(&listing->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(listing);
+}
+
+/*
+ * Makes sure the photos without a photoset, and so the date index, are
+ * loaded.
+ * Assumes there is a lock initiated
+ */
+static int check_date_index() {
+    cached_photoset *cps;
+
+    if(!date_ht || check_cache())
+        return FAIL;
+
+    if(!(cps = htable_lookup(photoset_ht, "")))
+        return FAIL;
+
+    if(check_photoset_cache(cps))
+        return FAIL;
+
+    touch_photoset(cps);
+    return SUCCESS;
+}
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Lists the date index. With an empty prefix, returns the years ("YYYY")
+ * photos were taken in. With a year as the prefix, returns the months
+ * ("MM") of that year. Names are sorted.
+ *
+ * IMPORTANT: Make sure you free(names) after you are done!
+ */
+unsigned int get_date_names(const char *prefix, char ***names) {
+    htable_iter iter;
+    char *key;
+    size_t prefix_len = strlen(prefix);
+    unsigned int i, count = 0;
+
+    if(!names)
+        return 0;
+
+    read_lock();
+    if(check_date_index())
+        goto fail;
+
+    if(!(*names = (char **)malloc(sizeof(char *) * (htable_size(date_ht) + 1))))
+        goto fail;
+
+    htable_iter_init(&iter, date_ht);
+    while(htable_iter_next(&iter, &key, NULL)) {
+        if(prefix_len == 0)
+            (*names)[count++] = strndup(key, 4);
+        else if(!strncmp(key, prefix, prefix_len) && key[prefix_len] == '/')
+            (*names)[count++] = strdup(key + prefix_len + 1);
+    }
+    pthread_rwlock_unlock(&cache_lock);
+
+    qsort(*names, count, sizeof(char *), compare_strings);
+
+    /* Several months share a year */
+    for(i = 1; i < count; i++) {
+        if(!strcmp((*names)[i], (*names)[i - 1])) {
+            free((*names)[i]);
+            memmove(&(*names)[i], &(*names)[i + 1], (count - i - 1) * sizeof(char *));
+            count--;
+            i--;
+        }
+    }
+
+    if(count == 0)
+        free(*names);
+    return count;
+
+fail:   pthread_rwlock_unlock(&cache_lock);
+    return 0;
+}
+
+/* Returns the sorted listing of the photos taken in the "YYYY/MM" shard. */
+photo_listing *get_date_listing(const char *shard) {
+    date_shard *ds;
+    photo_listing *listing = NULL;
+
+    read_lock();
+    if(!check_date_index() && (ds = htable_lookup(date_ht, shard)))
+        listing = ref_listing(&ds->listing, ds->photo_ht);
+    pthread_rwlock_unlock(&cache_lock);
+
+    return listing;
+}
+
+/* Looks for the photo in the "YYYY/MM" shard. */
+cached_information *date_photo_lookup(const char *shard, const char *photo) {
+    date_shard *ds;
+    cached_photo *cp;
+    cached_information *ci_copy = NULL;
+
+    read_lock();
+    if(!check_date_index() && (ds = htable_lookup(date_ht, shard)))
+        if((cp = htable_lookup(ds->photo_ht, photo)))
+            ci_copy = copy_cached_info(&(cp->ci));
+    pthread_rwlock_unlock(&cache_lock);
+
+    return ci_copy;
+}
+
 /* Looks for the photoset specified in the argument.
  * Returns pointer to the stored cached_information
  * or 0 if not found.
@@ -480,11 +1519,11 @@ cached_information *photoset_lookup(const char *photoset) {
     cached_photoset *cps;
     cached_information *ci_copy = NULL;
 
-    pthread_rwlock_rdlock(&cache_lock);
+    read_lock();
     if(check_cache())
         goto fail;
 
-    cps = g_hash_table_lookup(photoset_ht, photoset);
+    cps = find_photoset(photoset);
     if(cps)
         ci_copy = copy_cached_info(&(cps->ci));
 
@@ -499,17 +1538,21 @@ fail: pthread_rwlock_unlock(&cache_lock);
  */
 static cached_photo *get_photo(const char *photoset, const char *photo) {
     cached_photoset *cps;
+    cached_photo *cp;
 
     if(check_cache())
         return NULL;
 
-    if(!(cps = g_hash_table_lookup(photoset_ht, photoset)))
+    if(!(cps = find_photoset(photoset)))
         return NULL;
 
     if(check_photoset_cache(cps))
         return NULL;
 
-    return g_hash_table_lookup(cps->photo_ht, photo);
+    touch_photoset(cps);
+    cp = htable_lookup(cps->photo_ht, photo);
+    stat_inc(cp ? STAT_PHOTO_HIT : STAT_PHOTO_MISS);
+    return cp;
 }
 
 /* Looks for the photo specified in the arguments.
@@ -520,7 +1563,7 @@ cached_information *photo_lookup(const char *photoset, const char *photo) {
     cached_photo *cp;
     cached_information *ci_copy = NULL;
 
-    pthread_rwlock_rdlock(&cache_lock);
+    read_lock();
     if((cp = get_photo(photoset, photo)))
         ci_copy = copy_cached_info(&(cp->ci));
     pthread_rwlock_unlock(&cache_lock);
@@ -528,6 +1571,21 @@ cached_information *photo_lookup(const char *photoset, const char *photo) {
     return ci_copy;
 }
 
+/*
+ * Loads the photos of the photoset into the cache, unless they are there
+ * already. Nothing is looked up, so the hit counters are left alone.
+ */
+int load_photoset(const char *photoset) {
+    int retval = FAIL;
+
+    read_lock();
+    if(!check_cache())
+        retval = check_photoset_cache(htable_lookup(photoset_ht, photoset));
+    pthread_rwlock_unlock(&cache_lock);
+
+    return retval;
+}
+
 /* Returns the URI used to get the actual image of
  * picture.
  */
@@ -535,7 +1593,7 @@ char *get_photo_uri(const char *photoset, const char *photo) {
     cached_photo *cp;
     char *uri_copy = NULL;
 
-    pthread_rwlock_rdlock(&cache_lock);
+    read_lock();
     if((cp = get_photo(photoset, photo))) {
         if(cp->ci.uri) {
             uri_copy = strdup(cp->ci.uri);
@@ -547,50 +1605,76 @@ char *get_photo_uri(const char *photoset, const char *photo) {
 }
 
 /* Renames the photo specified in the args to the
- * new name.
+ * new name. Flickr is told with the cache unlocked.
  */
 int set_photo_name(const char *photoset, const char *photo, const char *newname) {
     cached_photo *cp;
 
-    pthread_rwlock_wrlock(&cache_lock);
+    write_lock();
     if(!(cp = get_photo(photoset, photo))) {
         pthread_rwlock_unlock(&cache_lock);
         return FAIL;
     }
+    cp->refs++;                                 /* Its id stays while the lock is let go */
+    pthread_rwlock_unlock(&cache_lock);
+
+    backend_set_photo_title(cp->ci.id, newname);
 
-    flickcurl_photos_setMeta(fc, cp->ci.id, newname, "");
+    write_lock();
+    unref_cached_photo(cp);
+    invalidate(photoset, photo);
+    invalidate(photoset, newname);
     last_cleaned = 0;
     pthread_rwlock_unlock(&cache_lock);
     return SUCCESS;
 }
 
-/* Renames the photoset */
+/*
+ * Renames the photoset. Flickr is told with the cache unlocked, and
+ * change_lock keeps an upload from creating it under the old name meanwhile.
+ */
 int set_photoset_name(const char *photoset, const char *newname) {
-    void *key, *value;
+    char *key;
+    void *value;
+    char *id = NULL;
     cached_photoset *cps;
+    int failed;
     int retval = FAIL;
 
-    pthread_rwlock_wrlock(&cache_lock);
+    pthread_mutex_lock(&change_lock);
+    read_lock();
+    if(!(cps = htable_lookup(photoset_ht, photoset))) {
+        pthread_rwlock_unlock(&cache_lock);
+        goto fail;
+    }
+    pin_photoset(cps);
+    if(cps->ci.dirty == CLEAN)                  /* One not created yet is only renamed here */
+        id = strdup(cps->ci.id);
+    pthread_rwlock_unlock(&cache_lock);
 
-    if(g_hash_table_lookup_extended(photoset_ht, photoset, &key, &value)) {
-        cps = value;
+    failed = id && backend_set_photoset_title(id, newname);
 
-        if(cps->ci.dirty == CLEAN)
-            if(flickcurl_photosets_editMeta(fc, cps->ci.id, newname, NULL))
-                goto fail;
+    write_lock();
+    unpin_photoset(cps);
 
+    /* Still under its old name, as renames hold change_lock */
+    if(!failed && htable_lookup_extended(photoset_ht, photoset, &key, &value) && value == cps) {
         free(cps->ci.name);
         cps->ci.name = strdup(newname);
 
-        g_hash_table_remove(photoset_ht, photoset);
-        g_hash_table_insert(photoset_ht, strdup(newname), cps);
+        htable_remove(photoset_ht, photoset);
+        htable_insert(photoset_ht, strdup(newname), cps);
+        search_changed();                       /* Results link to the photoset by name */
 
+        invalidate(photoset, NULL);
+        invalidate(newname, NULL);
         free(key);
         retval = SUCCESS;
     }
+    pthread_rwlock_unlock(&cache_lock);
 
-fail: pthread_rwlock_unlock(&cache_lock);
-
+fail: pthread_mutex_unlock(&change_lock);
+    free(id);
     return retval;
 }
 
@@ -598,12 +1682,16 @@ fail: pthread_rwlock_unlock(&cache_lock);
 int set_photo_size(const char *photoset, const char *photo, unsigned int newsize) {
     cached_photo *cp;
 
-    pthread_rwlock_wrlock(&cache_lock);
+    write_lock();
     if(!(cp = get_photo(photoset, photo))) {
         pthread_rwlock_unlock(&cache_lock);
         return FAIL;
     }
 
+    /* The kernel may hold on to the old size */
+    if(cp->ci.size != PHOTO_SIZE_UNSET && cp->ci.size != newsize)
+        invalidate(photoset, photo);
+
     cp->ci.size = newsize;
     pthread_rwlock_unlock(&cache_lock);
 
@@ -613,13 +1701,15 @@ int set_photo_size(const char *photoset, const char *photo, unsigned int newsize
 int set_photo_dirty(const char *photoset, const char *photo, unsigned short dirty) {
     cached_photo *cp;
 
-    pthread_rwlock_wrlock(&cache_lock);
+    write_lock();
     if(!(cp = get_photo(photoset, photo))) {
         pthread_rwlock_unlock(&cache_lock);
         return FAIL;
     }
 
     cp->ci.dirty = dirty;
+    if(dirty == DIRTY)
+        cp->writes++;
     pthread_rwlock_unlock(&cache_lock);
 
     return SUCCESS;
@@ -629,7 +1719,7 @@ int get_photo_dirty(const char *photoset, const char *photo) {
     cached_photo *cp;
     unsigned short dirty;
 
-    pthread_rwlock_rdlock(&cache_lock);
+    read_lock();
     if(!(cp = get_photo(photoset, photo))) {
         pthread_rwlock_unlock(&cache_lock);
         return FAIL;
@@ -644,9 +1734,9 @@ int create_empty_photoset(const char *photoset) {
     cached_photoset *cps;
     int retval = FAIL;
 
-    pthread_rwlock_wrlock(&cache_lock);
+    write_lock();
 
-    if(g_hash_table_lookup(photoset_ht, photoset))
+    if(htable_lookup(photoset_ht, photoset))
         goto fail;
 
     /* The new empty photoset */
@@ -655,12 +1745,13 @@ int create_empty_photoset(const char *photoset) {
 
     cps->ci.name = strdup(photoset);
     cps->ci.id = strdup("");
+    cps->ci.ino = local_ino(photoset, "") | PHOTOSET_INO;
     cps->ci.dirty = DIRTY;
     cps->ci.time = time(NULL);
     cps->set = CACHE_SET;
     cps->photo_ht = create_cache();
 
-    g_hash_table_insert(photoset_ht, strdup(cps->ci.name), cps);
+    htable_insert(photoset_ht, strdup(cps->ci.name), cps);
 
     retval = SUCCESS;
 
@@ -669,33 +1760,38 @@ fail: pthread_rwlock_unlock(&cache_lock);
 }
 
 int create_empty_photo(const char *photoset, const char *photo) {
+    char *key;
     cached_photoset *cps;
     cached_photo *cp;
     int retval = FAIL;
 
-    pthread_rwlock_wrlock(&cache_lock);
+    write_lock();
 
-    cps = g_hash_table_lookup(photoset_ht, photoset);
+    cps = htable_lookup(photoset_ht, photoset);
 
     /* Check to see photoset exists. */
     if(!cps)
         goto fail;
 
    /* Check if photo already exists */
-    if(g_hash_table_lookup(cps->photo_ht, photo))
+    if(htable_lookup(cps->photo_ht, photo))
         goto fail;
 
     /* The new empty photo */
-    if(!(cp = create_cached_photo()))
+    if(!(cp = create_cached_photo(photo, "")))
         goto fail;
 
-    cp->ci.name = strdup(photo);
-    cp->ci.id = strdup("");
+    cp->ci.ino = local_ino(photoset, photo);
     cp->ci.dirty = DIRTY;
     cp->ci.time = time(NULL);
     cp->ci.size = PHOTO_SIZE_UNSET;
+    cp->refs = 1;
 
-    g_hash_table_insert(cps->photo_ht, strdup(cp->ci.name), cp);
+    key = strdup(cp->ci.name);
+    htable_insert(cps->photo_ht, key, cp);
+    index_photo_words(cps, key, cp, NULL);
+    search_changed();
+    drop_listing(&cps->listing);
 
     retval = SUCCESS;
 
@@ -703,84 +1799,127 @@ fail: pthread_rwlock_unlock(&cache_lock);
     return retval;
 }
 
+/*
+ * Uploads the photo at path and adds it to its photoset, creating the
+ * photoset on Flickr if it only exists here. Flickr is called with the
+ * cache unlocked while the photo and photoset are pinned. A photo that
+ * could not be uploaded, or was written to meanwhile, stays dirty so it is
+ * uploaded again. change_lock keeps two uploads from creating the
+ * photoset twice.
+ */
 int upload_photo(const char *photoset, const char *photo, const char *path) {
-    flickcurl_upload_status* status;
-    flickcurl_upload_params params;
+    char *photo_id, *photoset_id;
+    char *name = NULL, *id = NULL;
     cached_photoset *cps;
     cached_photo *cp;
+    unsigned int writes;
     int retval = FAIL;
 
-    pthread_rwlock_wrlock(&cache_lock);
+    write_lock();
 
-    cps = g_hash_table_lookup(photoset_ht, photoset);
+    cps = htable_lookup(photoset_ht, photoset);
 
     if(!cps)
         goto fail;
 
-    if(!(cp = g_hash_table_lookup(cps->photo_ht, photo)))
+    if(!(cp = htable_lookup(cps->photo_ht, photo)))
         goto fail;
 
-    memset(&params, '\0', sizeof(flickcurl_upload_params));
-    params.safety_level = SAFETY_LEVEL;    /* default safety */
-    params.content_type = CONTENT_TYPE;    /* default photo */
-    params.photo_file = path;
-    params.title = cp->ci.name;
-
-    status = flickcurl_photos_upload_params(fc, &params);
+    pin_photoset(cps);
+    cp->refs++;
+    writes = cp->writes;
+    pthread_rwlock_unlock(&cache_lock);
 
-    if(status) {
-        if(cps->ci.dirty == DIRTY) { // if photoset is dirty, create it
-            char * photosetid = flickcurl_photosets_create(fc, cps->ci.name, NULL, status->photoid, NULL);
+    if((photo_id = backend_upload(path, cp->ci.name))) {
+        pthread_mutex_lock(&change_lock);
+        read_lock();
+        if(cps->ci.dirty == DIRTY)
+            name = strdup(cps->ci.name);
+        else
+            id = strdup(cps->ci.id);
+        pthread_rwlock_unlock(&cache_lock);
 
-            if(photosetid) {
-                cps->ci.id = photosetid;
+        if(name) {  // if photoset is dirty, create it
+            if((photoset_id = backend_create_photoset(name, photo_id))) {
+                write_lock();
+                free(cps->ci.id);
+                cps->ci.id = photoset_id;
                 cps->ci.dirty = CLEAN;
+                pthread_rwlock_unlock(&cache_lock);
             }
         }
-        else if(strcmp(cps->ci.id, "")) { // if photoset has an id, add new photo to it
-            flickcurl_photosets_addPhoto(fc, cps->ci.id, status->photoid);
+        else if(id && strcmp(id, "")) { // if photoset has an id, add new photo to it
+            backend_add_photo(id, photo_id);
         }
+        pthread_mutex_unlock(&change_lock);
 
-        flickcurl_free_upload_status(status);
+        free(name);
+        free(id);
+        free(photo_id);
+        retval = SUCCESS;
     }
 
-    cp->ci.dirty = CLEAN;
-
-    cps->set = CACHE_UNSET;
-
-    retval = SUCCESS;
+    write_lock();
+    if(retval == SUCCESS) {
+        if(cp->writes == writes)
+            cp->ci.dirty = CLEAN;
+        cps->set = CACHE_UNSET;
+        invalidate(photoset, photo);
+        invalidate(photoset, NULL);
+    }
+    unref_cached_photo(cp);
+    unpin_photoset(cps);
 
 fail: pthread_rwlock_unlock(&cache_lock);
     return retval;
 }
 
+/* Moves the photo to new_photoset. Flickr is called with the cache unlocked. */
 int set_photo_photoset(const char *photoset, const char *photo, const char *new_photoset) {
     cached_photoset *cps;
     cached_photoset *new_cps;
     cached_photo *cp;
+    char *id, *new_id;
     int retval = FAIL;
 
-    pthread_rwlock_wrlock(&cache_lock);
+    write_lock();
 
-    cps = g_hash_table_lookup(photoset_ht, photoset);
-    new_cps = g_hash_table_lookup(photoset_ht, new_photoset);
+    cps = htable_lookup(photoset_ht, photoset);
+    new_cps = htable_lookup(photoset_ht, new_photoset);
 
     if(!cps || !new_cps)
         goto fail;
 
-    if(!(cp = g_hash_table_lookup(cps->photo_ht, photo)))
+    if(!(cp = htable_lookup(cps->photo_ht, photo)))
         goto fail;
 
-    if(strcmp(cps->ci.id, "")) {
-        flickcurl_photosets_removePhoto(fc, cps->ci.id, cp->ci.id);
+    pin_photoset(cps);
+    pin_photoset(new_cps);
+    cp->refs++;
+    id = strdup(cps->ci.id);
+    new_id = strdup(new_cps->ci.id);
+    pthread_rwlock_unlock(&cache_lock);
+
+    if(id && strcmp(id, "")) {
+        backend_remove_photo(id, cp->ci.id);
     }
 
-    if(strcmp(new_cps->ci.id, "")) {
-        flickcurl_photosets_addPhoto(fc, new_cps->ci.id, cp->ci.id);
+    if(new_id && strcmp(new_id, "")) {
+        backend_add_photo(new_id, cp->ci.id);
     }
+    free(id);
+    free(new_id);
 
-    g_hash_table_foreach_remove(cps->photo_ht, free_photo_ht, NULL);
-    g_hash_table_foreach_remove(new_cps->photo_ht, free_photo_ht, NULL);
+    write_lock();
+    unref_cached_photo(cp);
+    unpin_photoset(cps);
+    unpin_photoset(new_cps);
+
+    release_photoset_photos(cps, photoset);
+    release_photoset_photos(new_cps, new_photoset);
+    invalidate(photoset, photo);
+    invalidate(photoset, NULL);
+    invalidate(new_photoset, NULL);
 
     cps->set = CACHE_UNSET;
     new_cps->set = CACHE_UNSET;
@@ -792,27 +1931,32 @@ fail: pthread_rwlock_unlock(&cache_lock);
 }
 
 int remove_photo_from_cache(const char *photoset, const char *photo) {
-    void *key, *value;
+    char *key;
+    void *value;
     cached_photoset *cps;
     cached_photo *cp;
     int retval = FAIL;
 
-    pthread_rwlock_wrlock(&cache_lock);
+    write_lock();
 
-    if(!(cps = g_hash_table_lookup(photoset_ht, photoset)))
+    if(!(cps = htable_lookup(photoset_ht, photoset)))
         goto fail;
 
-    if(g_hash_table_lookup_extended(cps->photo_ht, photo, &key, &value)) {
+    if(htable_lookup_extended(cps->photo_ht, photo, &key, &value)) {
         cp = value;
 
         if(cp->ci.dirty) {
-            g_hash_table_remove(cps->photo_ht, photo);
+            htable_remove(cps->photo_ht, photo);
+            drop_listing(&cps->listing);
+            if(cps->ci.ino == ROOT_INO)
+                unindex_photo_date(key, cp);
+            if(cps->search)
+                search_index_remove(cps->search, key);
+            search_changed();
+            invalidate(photoset, photo);
 
-            free(cp->ci.uri);
-            free(cp->ci.name);
-            free(cp->ci.id);
             free(key);
-            free(value);
+            unref_cached_photo(cp);
 
             retval = SUCCESS;
         }
@@ -823,6 +1967,6 @@ fail: pthread_rwlock_unlock(&cache_lock);
 }
 
 int photoDelete(char *photo_id) {
-    return flickcurl_photos_delete(fc, photo_id);
+    return backend_delete_photo(photo_id);
 }
 
@@ -1,28 +1,73 @@
 #ifndef CACHE_H
 #define CACHE_H
 
+#include <stdint.h>
+#include <time.h>
+
 #include "common.h"
 
 #define PHOTO_SIZE_UNSET 0
+#define DEFAULT_LISTING_BUDGET  64  /* In MB. 0 disables the budget. */
 
 typedef struct {
     char *name;
     char *id;
     char *uri;
+    uint64_t ino;
     time_t time;
     unsigned int size;
     unsigned short dirty;
 } cached_information;
 
+typedef struct {
+    const char *name;
+    time_t time;
+} listing_entry;
+
+typedef struct {
+    unsigned int refs;
+    unsigned int count;
+    listing_entry entries[];
+} photo_listing;
+
+typedef struct {
+    const char *name;       /* Name of the symlink in the search directory */
+    const char *target;     /* Path of the photo, relative to the search directory */
+} search_entry;
+
+typedef struct {
+    unsigned int refs;
+    unsigned int count;
+    search_entry entries[]; /* Sorted by name */
+} search_results;
+
+#define DATE_SHARD_SIZE 16      /* Buffer for a "YYYY/MM" date shard name */
+
+typedef void (*cache_invalidate_func)(const char *photoset, const char *photo);
+
 
 int flickr_cache_init();
 void flickr_cache_kill();
+void set_cache_invalidate(cache_invalidate_func func);
+void set_listing_budget(size_t bytes);
+size_t get_cache_memory();
+void enable_date_index();
+void enable_search_index();
 
 int photoDelete(char *photo_id);
 unsigned int get_photoset_names(char ***names);
 unsigned int get_photo_names(const char *photoset, char ***names);
+photo_listing *get_photo_listing(const char *photoset);
+void release_photo_listing(photo_listing *listing);
+unsigned int get_date_names(const char *prefix, char ***names);
+photo_listing *get_date_listing(const char *shard);
+cached_information *date_photo_lookup(const char *shard, const char *photo);
+search_results *search_photos(const char *query);
+void release_search_results(search_results *results);
+const search_entry *search_results_lookup(const search_results *results, const char *name);
 cached_information *photoset_lookup(const char *photoset);
 cached_information *photo_lookup(const char *photoset, const char *photo);
+int load_photoset(const char *photoset);
 void free_cached_info(cached_information *ci);
 char *get_photo_uri(const char *photoset, const char *photo);
 int set_photo_name(const char *photoset, const char *photo, const char *newname);
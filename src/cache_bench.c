@@ -0,0 +1,333 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include "cache.h"
+#include "backend.h"
+
+
+/*
+ * Measures the cache on its own, filled from the synthetic backend. Every
+ * account size is run in a forked child so its memory starts clean. Each
+ * result is printed as a JSON line.
+ *
+ *   cache_bench [-n photos[,photos...]] [-p photos per set] [-t max threads] [-d ms]
+ *   cache_bench -g -n photos [-p photos per set]
+ *
+ * -g prints the generated account as tab separated photoset, id, date
+ * taken and title instead, to feed other tools the same dataset.
+ */
+
+#define DEFAULT_COUNTS      "10000,100000,1000000"
+#define DEFAULT_PER_SET     1000
+#define DEFAULT_THREADS     64
+#define DEFAULT_DURATION    1000            /* In ms, for each thread count */
+#define PHOTOS_PER_PAGE     100             /* As cache.c asks for them */
+#define SPEC_SIZE           128
+
+typedef enum {
+    OP_LOOKUP,
+    OP_NAMES,
+    OP_SET_SIZE
+} bench_op;
+
+static const char *op_names[] = { "photo_lookup", "get_photo_names", "set_photo_size" };
+
+typedef struct {
+    char *photoset;
+    char **photos;
+    unsigned int count;
+} bench_set;
+
+static bench_set *bench_sets;
+static unsigned int num_bench_sets;
+
+typedef struct {
+    pthread_t thread;
+    bench_op op;
+    unsigned int seed;
+    unsigned long ops;
+} bench_thread;
+
+static volatile int running;
+
+
+static double now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static size_t resident_bytes() {
+    unsigned long size, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+
+    if(!statm)
+        return 0;
+    if(fscanf(statm, "%lu %lu", &size, &resident) != 2)
+        resident = 0;
+    fclose(statm);
+    return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+/* Splits the account into sets of per_set photos, with the rest in no photoset. */
+static int start_backend(unsigned int count, unsigned int per_set) {
+    char spec[SPEC_SIZE];
+
+    snprintf(spec, sizeof(spec), "synthetic:sets=%u:photos=%u:loose=%u:size=1024",
+      count / per_set, per_set, count % per_set);
+    return backend_init(spec);
+}
+
+/* Prints the account as the backend pages it out. */
+static int generate(unsigned int count, unsigned int per_set) {
+    backend_photoset **fps;
+    backend_photo **bp;
+    const char *id;
+    int i = 0, j, page;
+
+    if(start_backend(count, per_set) || !(fps = backend_get_photosets()))
+        return FAIL;
+
+    do {
+        id = fps[i] ? fps[i]->id : "";  /* Then the photos without a photoset */
+        for(page = 1; (bp = backend_get_photos(id, page, PHOTOS_PER_PAGE)); page++) {
+            for(j = 0; bp[j]; j++)
+                printf("%s\t%s\t%s\t%s\n", fps[i] ? fps[i]->title : "", bp[j]->id,
+                  bp[j]->date_taken ? bp[j]->date_taken : "", bp[j]->title ? bp[j]->title : "");
+            backend_free_photos(bp);
+            if(j < PHOTOS_PER_PAGE)
+                break;
+        }
+    } while(fps[i++]);
+
+    backend_free_photosets(fps);
+    backend_kill();
+    return SUCCESS;
+}
+
+/* Loads every photoset into the cache. A lookup of a missing photo loads it without copying anything. */
+static double load_cache() {
+    char **names = NULL;
+    unsigned int i, n;
+    double start;
+
+    n = get_photoset_names(&names);
+    if(!(bench_sets = (bench_set *)calloc(n + 1, sizeof(bench_set))))
+        return 0;
+
+    for(i = 0; i < n; i++)
+        bench_sets[i].photoset = names[i];
+    bench_sets[n].photoset = strdup("");
+    num_bench_sets = n + 1;
+    free(names);
+
+    start = now();
+    for(i = 0; i < num_bench_sets; i++)
+        photo_lookup(bench_sets[i].photoset, "");
+    return now() - start;
+}
+
+/* Keeps the photo names of every photoset to pick from. Returns the number of photos. */
+static unsigned int collect_names() {
+    unsigned int i, total = 0;
+
+    for(i = 0; i < num_bench_sets; i++) {
+        bench_sets[i].count = get_photo_names(bench_sets[i].photoset, &bench_sets[i].photos);
+        total += bench_sets[i].count;
+    }
+    return total;
+}
+
+/* The time the backend alone takes to hand out the pages load_cache read. */
+static double backend_time(unsigned long *pages) {
+    backend_photoset **fps;
+    backend_photo **bp;
+    int i = 0, j, page;
+    double start = now();
+
+    *pages = 0;
+    if(!(fps = backend_get_photosets()))
+        return 0;
+
+    do {
+        for(page = 1; (bp = backend_get_photos(fps[i] ? fps[i]->id : "", page, PHOTOS_PER_PAGE)); page++) {
+            for(j = 0; bp[j]; j++);
+            backend_free_photos(bp);
+            (*pages)++;
+            if(j < PHOTOS_PER_PAGE)
+                break;
+        }
+    } while(fps[i++]);
+
+    backend_free_photosets(fps);
+    return now() - start;
+}
+
+static inline unsigned int next_random(unsigned int *seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+static void *bench_worker(void *arg) {
+    bench_thread *bt = arg;
+    cached_information *ci;
+    char **names;
+    unsigned int i, n;
+
+    while(running) {
+        const bench_set *bs = &bench_sets[next_random(&bt->seed) % num_bench_sets];
+        const char *photo;
+
+        if(!bs->count)
+            continue;
+        photo = bs->photos[next_random(&bt->seed) % bs->count];
+
+        switch(bt->op) {
+        case OP_LOOKUP:
+            if((ci = photo_lookup(bs->photoset, photo)))
+                free_cached_info(ci);
+            break;
+        case OP_NAMES:
+            names = NULL;
+            n = get_photo_names(bs->photoset, &names);
+            for(i = 0; i < n; i++)
+                free(names[i]);
+            free(names);
+            break;
+        case OP_SET_SIZE:
+            set_photo_size(bs->photoset, photo, next_random(&bt->seed) % (1 << 20));
+            break;
+        }
+        bt->ops++;
+    }
+    return NULL;
+}
+
+/* Runs op on threads threads for duration ms and returns the operations per second. */
+static double run_op(bench_op op, unsigned int threads, unsigned int duration) {
+    bench_thread *bt;
+    unsigned long ops = 0;
+    unsigned int i;
+    double start;
+
+    if(!(bt = (bench_thread *)calloc(threads, sizeof(bench_thread))))
+        return 0;
+
+    running = 1;
+    start = now();
+    for(i = 0; i < threads; i++) {
+        bt[i].op = op;
+        bt[i].seed = 2463534242u + i * 7919u;
+        pthread_create(&bt[i].thread, NULL, bench_worker, &bt[i]);
+    }
+
+    usleep(duration * 1000);
+    running = 0;
+
+    for(i = 0; i < threads; i++) {
+        pthread_join(bt[i].thread, NULL);
+        ops += bt[i].ops;
+    }
+    start = now() - start;
+    free(bt);
+    return (double)ops / start;
+}
+
+static int bench(unsigned int count, unsigned int per_set, unsigned int max_threads, unsigned int duration) {
+    size_t before, after;
+    unsigned long pages;
+    unsigned int loaded, threads, op;
+    double ingest, fetch;
+
+    if(start_backend(count, per_set))
+        return FAIL;
+    flickr_cache_init();
+    set_listing_budget(0);
+
+    malloc_trim(0);
+    before = resident_bytes();
+    ingest = load_cache();
+    malloc_trim(0);
+    after = resident_bytes();
+
+    if(!(loaded = collect_names()))
+        return FAIL;
+
+    fetch = backend_time(&pages);
+    printf("{\"bench\": \"memory\", \"photos\": %u, \"resident_bytes\": %zu, \"bytes_per_photo\": %.1f}\n",
+      loaded, after - before, (double)(after - before) / loaded);
+    printf("{\"bench\": \"ingest\", \"photos\": %u, \"pages\": %lu, \"us_per_page\": %.2f, \"backend_us_per_page\": %.2f}\n",
+      loaded, pages, (ingest - fetch) * 1e6 / (double)pages, fetch * 1e6 / (double)pages);
+    fflush(stdout);
+
+    for(op = OP_LOOKUP; op <= OP_SET_SIZE; op++) {
+        for(threads = 1; threads <= max_threads; threads *= 2) {
+            printf("{\"bench\": \"%s\", \"photos\": %u, \"threads\": %u, \"ops_s\": %.0f}\n",
+              op_names[op], loaded, threads, run_op((bench_op)op, threads, duration));
+            fflush(stdout);
+        }
+    }
+
+    flickr_cache_kill();
+    backend_kill();
+    return SUCCESS;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-g] [-n photos[,photos...]] [-p photos per set] [-t max threads] [-d ms]\n", name);
+}
+
+int main(int argc, char **argv) {
+    const char *counts = DEFAULT_COUNTS;
+    unsigned int per_set = DEFAULT_PER_SET;
+    unsigned int max_threads = DEFAULT_THREADS;
+    unsigned int duration = DEFAULT_DURATION;
+    int gen = 0, opt, status, failed = 0;
+    char *next;
+
+    while((opt = getopt(argc, argv, "gn:p:t:d:")) != -1) {
+        switch(opt) {
+        case 'g': gen = 1; break;
+        case 'n': counts = optarg; break;
+        case 'p': per_set = (unsigned int)atoi(optarg); break;
+        case 't': max_threads = (unsigned int)atoi(optarg); break;
+        case 'd': duration = (unsigned int)atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(!per_set || !max_threads) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if(gen)
+        return generate((unsigned int)strtoul(counts, NULL, 10), per_set) ? 1 : 0;
+
+    for(; *counts; counts = (*next == ',') ? next + 1 : next) {
+        unsigned int count = (unsigned int)strtoul(counts, &next, 10);
+        pid_t pid;
+
+        if(next == counts) {
+            usage(argv[0]);
+            return 1;
+        }
+
+        if((pid = fork()) == 0)
+            return bench(count, per_set, max_threads, duration) ? 1 : 0;
+        if(pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+            failed = 1;
+    }
+
+    return failed;
+}
@@ -0,0 +1,658 @@
+#include <flickcurl.h>
+#include <curl/curl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "backend.h"
+#include "conf.h"
+#include "wget.h"
+#include "sched.h"
+#include "stats.h"
+
+
+/* Valid sizes: http://librdf.org/flickcurl/api/flickcurl-section-photo.html#flickcurl-photo-as-source-uri */
+#define GET_PHOTO_SIZE      'o'
+#define PHOTO_EXTRAS        "date_taken,url_o,original_format,tags"
+
+/* https://www.flickr.com/services/developer/api/ */
+#define API_QUOTA       3600
+
+/* Photo parameters */
+#define SAFETY_LEVEL    1
+#define CONTENT_TYPE    1
+
+#define MAX_IDLE_HANDLES    16  /* flickcurl handles kept for the next calls */
+#define HTTP_CLIENT_ERROR   400
+#define HTTP_SERVER_ERROR   500
+
+
+typedef struct api_call api_call;
+
+/* Makes the call on fc. Returns NULL if it failed. */
+typedef void *(*api_func)(flickcurl *fc, const api_call *call);
+
+/* A thread making a call. A call that is hedged is made twice at most. */
+typedef struct {
+    api_call *call;
+    unsigned short hedge;           /* The duplicate */
+} api_attempt;
+
+/*
+ * A Flickr API call. It runs on a thread of its own so its caller can give
+ * up on it, as flickcurl has no timeout for a whole call, and on a flickcurl handle of its
+ * own, as a handle can't make two calls at once. The last of the caller
+ * and the attempts to be done with it frees it.
+ */
+struct api_call {
+    api_func func;
+    void (*discard)(void *result);  /* Frees the results no one took */
+    char *args[2];
+    int page;
+    int per_page;
+    latency_op hedge_op;            /* The timings a duplicate is sent by, LAT_COUNT for none */
+    api_attempt attempts[2];
+    void *result;
+    unsigned short mutates;         /* Changes something, so it is never given up on */
+    unsigned short refused;         /* Flickr turned it down */
+    unsigned short running;         /* Attempts still running */
+    unsigned short done;
+    unsigned short abandoned;       /* The caller is gone */
+};
+
+static char *conf_path;
+static char *photo_host;    /* Replaces the scheme and host of photo URIs when set */
+static char succeeded;      /* The result of calls that only succeed or fail */
+
+static pthread_mutex_t calls_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t calls_cond = PTHREAD_COND_INITIALIZER;
+static flickcurl *idle_handles[MAX_IDLE_HANDLES];
+static unsigned int num_idle;
+static unsigned int num_running;    /* Calls still running, including those given up on */
+static __thread unsigned short refused;     /* The last call of this thread was turned down */
+
+
+/*
+ * Besides the flickcurl settings, ~/.flickcurl.conf may point the backend at
+ * another REST endpoint (service_uri, upload_service_uri) and photo host
+ * (photo_host, e.g. "http://127.0.0.1:8642/photos"). bench/ uses this.
+ */
+static void config_var_handler(void *userdata, const char *key, const char *value) {
+    flickcurl *fc = (flickcurl *)userdata;
+
+    if(!strcmp(key, "service_uri"))
+        flickcurl_set_service_uri(fc, value);
+    else if(!strcmp(key, "upload_service_uri"))
+        flickcurl_set_upload_service_uri(fc, value);
+    else if(!strcmp(key, "photo_host")) {
+        if(!photo_host)     /* Every new handle reads the file, other threads may be using it */
+            photo_host = strdup(value);
+    }
+    else
+        flickcurl_config_var_handler(userdata, key, value);
+}
+
+/*
+ * Whether the message tells that Flickr answered and turned the call
+ * down, with an API error ("failed with error") or a 4xx HTTP status,
+ * rather than failing or not answering at all.
+ */
+static int turned_down(const char *message) {
+    const char *status;
+    long code;
+
+    if(strstr(message, "failed with error"))
+        return 1;
+
+    if(!(status = strstr(message, "status")))
+        return 0;
+    status += strcspn(status, "0123456789");
+    code = strtol(status, NULL, 10);
+    return code >= HTTP_CLIENT_ERROR && code < HTTP_SERVER_ERROR;
+}
+
+/*
+ * flickcurl only tells about failed calls through its error handler, with
+ * the HTTP status in the message, so that is where a 429 is spotted.
+ */
+static void error_handler(void *userdata, const char *message) {
+    (void)userdata;
+
+    if(strstr(message, " 429") || strstr(message, "Too Many Requests"))
+        sched_rate_limited();
+    if(turned_down(message))
+        refused = 1;
+    fprintf(stderr, "flickcurl: %s\n", message);
+}
+
+/*
+ * Bounds every request of the handle by the connect and stall timeouts,
+ * like the downloads. Calls that change something are not given up on, so
+ * these are all that keep a dead connection from holding one for good.
+ */
+static void setopt_handler(void *userdata, void *curl_handle) {
+    CURL *curl = (CURL *)curl_handle;
+    (void)userdata;
+
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);    /* Threads can't time out on SIGALRM */
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, (long)backend_timeout.connect);
+    if(backend_timeout.stall) {
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, (long)backend_timeout.stall);
+    }
+}
+
+/* Moves the path of uri onto photo_host. */
+static char *rehost(char *uri) {
+    char *path, *moved;
+
+    if(!photo_host || !uri || !(path = strstr(uri, "://")) || !(path = strchr(path + 3, '/')))
+        return uri;
+
+    if(!(moved = (char *)malloc(strlen(photo_host) + strlen(path) + 1)))
+        return uri;
+
+    strcpy(moved, photo_host);
+    strcat(moved, path);
+    free(uri);
+    return moved;
+}
+
+
+/**
+ * flickcurl handles and calls
+**/
+
+static flickcurl *new_handle() {
+    flickcurl *fc;
+
+    if(!(fc = flickcurl_new()))
+        return NULL;
+
+    flickcurl_set_error_handler(fc, error_handler, NULL);
+    flickcurl_set_curl_setopt_handler(fc, setopt_handler, NULL);
+
+    /* Read from the config file, ~/.flickcurl.conf */
+    if(flickcurl_config_read_ini(fc, conf_path, "flickr", fc, config_var_handler)) {
+        flickcurl_free(fc);
+        return NULL;
+    }
+    return fc;
+}
+
+static flickcurl *take_handle() {
+    flickcurl *fc = NULL;
+
+    pthread_mutex_lock(&calls_lock);
+    if(num_idle > 0)
+        fc = idle_handles[--num_idle];
+    pthread_mutex_unlock(&calls_lock);
+
+    return fc ? fc : new_handle();
+}
+
+static void give_handle(flickcurl *fc) {
+    pthread_mutex_lock(&calls_lock);
+    if(num_idle < MAX_IDLE_HANDLES) {
+        idle_handles[num_idle++] = fc;
+        fc = NULL;
+    }
+    pthread_mutex_unlock(&calls_lock);
+
+    if(fc)
+        flickcurl_free(fc);
+}
+
+static void free_call(api_call *call) {
+    free(call->args[0]);
+    free(call->args[1]);
+    free(call);
+}
+
+/* Makes the call with a handle of its own. refused tells whether Flickr turned it down. */
+static void *make_call(const api_call *call) {
+    flickcurl *fc;
+    void *result;
+
+    refused = 0;
+    if(!(fc = take_handle()))
+        return NULL;
+
+    result = call->func(fc, call);
+    give_handle(fc);
+    return result;
+}
+
+/*
+ * Makes an attempt at the call and hands the result to its caller, unless
+ * another attempt was first or the caller gave up. A failure is only handed
+ * over by the last attempt, as the other may still succeed.
+ */
+static void *call_thread(void *data) {
+    api_attempt *attempt = (api_attempt *)data;
+    api_call *call = attempt->call;
+    void *result = make_call(call);
+    int last;
+
+    pthread_mutex_lock(&calls_lock);
+    num_running--;
+    call->running--;
+    if(!call->done && !call->abandoned && (result || !call->running)) {
+        call->result = result;
+        call->refused = !result && refused;
+        call->done = 1;
+        if(result && attempt->hedge)
+            stat_inc(STAT_HEDGE_WINS);
+        result = NULL;
+        pthread_cond_broadcast(&calls_cond);
+    }
+    last = call->abandoned && !call->running;
+    pthread_mutex_unlock(&calls_lock);
+
+    if(result && call->discard)
+        call->discard(result);
+    if(last)
+        free_call(call);
+    return NULL;
+}
+
+/* Starts an attempt at the call. Assumes calls_lock is held. */
+static int start_attempt(api_call *call, unsigned short hedge) {
+    api_attempt *attempt = &call->attempts[hedge];
+    pthread_t thread;
+
+    attempt->call = call;
+    attempt->hedge = hedge;
+    if(pthread_create(&thread, NULL, call_thread, attempt))
+        return FAIL;
+
+    pthread_detach(thread);
+    num_running++;
+    call->running++;
+    return SUCCESS;
+}
+
+/* The time ns from now, for pthread_cond_timedwait. */
+static void time_in(struct timespec *ts, uint64_t ns) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ns += (uint64_t)ts->tv_nsec;
+    ts->tv_sec += (time_t)(ns / 1000000000);
+    ts->tv_nsec = (long)(ns % 1000000000);
+}
+
+/*
+ * Makes the call and frees it. Waits at most the transfer timeout for it,
+ * after which it is left to finish in the background and NULL is returned.
+ * A call that changes something is waited for until it ends, as Flickr may
+ * still carry it out after its caller took it for failed. It is only bound
+ * by the connect and stall timeouts of its handle.
+ * A call with a hedge_op is made a second time if the first attempt is
+ * slower than most calls timed as hedge_op, and the first result is taken.
+ */
+static void *call_api(api_call *call) {
+    uint64_t timeout, delay = 0;
+    struct timespec deadline, hedge_at;
+    void *result;
+    int last;
+
+    if(!call)
+        return NULL;
+
+    if(call->mutates || !(timeout = (uint64_t)backend_timeout.transfer * 1000000000)) {
+        if(!(result = make_call(call)) && refused)
+            backend_refused();
+        free_call(call);
+        return result;
+    }
+
+    if(call->hedge_op != LAT_COUNT && (delay = sched_hedge_delay(call->hedge_op)) >= timeout)
+        delay = 0;
+
+    pthread_mutex_lock(&calls_lock);
+    if(start_attempt(call, 0)) {
+        pthread_mutex_unlock(&calls_lock);
+        free_call(call);
+        return NULL;
+    }
+
+    time_in(&deadline, timeout);
+    if(delay)
+        time_in(&hedge_at, delay);
+
+    while(!call->done) {
+        if(delay) {
+            if(pthread_cond_timedwait(&calls_cond, &calls_lock, &hedge_at) == ETIMEDOUT && !call->done) {
+                delay = 0;
+                if(sched_hedge(1))
+                    start_attempt(call, 1);
+            }
+        }
+        else if(pthread_cond_timedwait(&calls_cond, &calls_lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+
+    result = call->done ? call->result : NULL;
+    if(!call->done)
+        stat_inc(STAT_TIMEOUTS);
+    else if(call->refused)
+        backend_refused();
+    call->abandoned = 1;
+    last = !call->running;
+    pthread_mutex_unlock(&calls_lock);
+
+    if(last)
+        free_call(call);
+    return result;
+}
+
+/* Like call_api, for calls that change something on Flickr. */
+static void *call_api_to_end(api_call *call) {
+    if(call)
+        call->mutates = 1;
+    return call_api(call);
+}
+
+/* A call to func with up to two string arguments, which are copied. */
+static api_call *new_call(api_func func, void (*discard)(void *result), const char *arg0, const char *arg1) {
+    api_call *call;
+
+    if(!(call = (api_call *)calloc(1, sizeof(api_call))))
+        return NULL;
+
+    call->func = func;
+    call->discard = discard;
+    call->hedge_op = LAT_COUNT;
+    if((arg0 && !(call->args[0] = strdup(arg0))) || (arg1 && !(call->args[1] = strdup(arg1)))) {
+        free_call(call);
+        return NULL;
+    }
+    return call;
+}
+
+static void discard_photosets(void *photosets) {
+    backend_free_photosets((backend_photoset **)photosets);
+}
+
+static void discard_photos(void *photos) {
+    backend_free_photos((backend_photo **)photos);
+}
+
+
+/**
+ * API calls, made by call_api
+**/
+
+static void *test_login(flickcurl *fc, const api_call *call) {
+    (void)call;
+
+    return flickcurl_test_login(fc);
+}
+
+/* Takes the string out of the flickcurl struct so it isn't copied. */
+static inline char *take(char **str) {
+    char *taken = *str;
+
+    *str = NULL;
+    return taken;
+}
+
+static void *get_photosets(flickcurl *fc, const api_call *call) {
+    flickcurl_photoset **fps;
+    backend_photoset **photosets;
+    int i, count;
+    (void)call;
+
+    if(!(fps = flickcurl_photosets_getList(fc, NULL)))
+        return NULL;
+
+    for(count = 0; fps[count]; count++);
+
+    if(!(photosets = (backend_photoset **)calloc((size_t)count + 1, sizeof(backend_photoset *))))
+        goto fail;
+
+    for(i = 0; i < count; i++) {
+        if(!(photosets[i] = (backend_photoset *)malloc(sizeof(backend_photoset)))) {
+            backend_free_photosets(photosets);
+            photosets = NULL;
+            goto fail;
+        }
+        photosets[i]->id = take(&fps[i]->id);
+        photosets[i]->title = take(&fps[i]->title);
+        photosets[i]->photos_count = fps[i]->photos_count > 0 ? (unsigned int)fps[i]->photos_count : 0;
+    }
+
+fail: flickcurl_free_photosets(fps);
+    return photosets;
+}
+
+/* The tags of the photo, space separated as Flickr sends them. */
+static char *join_tags(const flickcurl_photo *fp) {
+    size_t len = 0;
+    char *tags;
+    int i;
+
+    if(fp->tags_count <= 0)
+        return NULL;
+
+    for(i = 0; i < fp->tags_count; i++)
+        len += strlen(fp->tags[i]->cooked) + 1;
+
+    if(!(tags = (char *)malloc(len)))
+        return NULL;
+
+    tags[0] = '\0';
+    for(i = 0; i < fp->tags_count; i++) {
+        if(i > 0)
+            strcat(tags, " ");
+        strcat(tags, fp->tags[i]->cooked);
+    }
+    return tags;
+}
+
+static void *get_photos(flickcurl *fc, const api_call *call) {
+    const char *photoset_id = call->args[0];
+    flickcurl_photo **fp;
+    backend_photo **photos;
+    int i, count;
+
+    /* Are we searching for photos in a photoset or not? */
+    if(!strcmp(photoset_id, "")) {  /* Get photos NOT in a photoset */
+        if(!(fp = flickcurl_photos_getNotInSet(fc, 0, 0, NULL, NULL, 0, PHOTO_EXTRAS, call->per_page, call->page)))
+            return NULL;
+    }
+    else {                          /* Get the photos of the photoset */
+        if(!(fp = flickcurl_photosets_getPhotos(fc, photoset_id, PHOTO_EXTRAS, 0, call->per_page, call->page)))
+            return NULL;
+    }
+
+    for(count = 0; fp[count]; count++);
+
+    if(!(photos = (backend_photo **)calloc((size_t)count + 1, sizeof(backend_photo *))))
+        goto fail;
+
+    for(i = 0; i < count; i++) {
+        if(!(photos[i] = (backend_photo *)malloc(sizeof(backend_photo)))) {
+            backend_free_photos(photos);
+            photos = NULL;
+            goto fail;
+        }
+        photos[i]->id = take(&fp[i]->id);
+        photos[i]->title = take(&fp[i]->fields[PHOTO_FIELD_title].string);
+        photos[i]->uri = rehost(flickcurl_photo_as_source_uri(fp[i], GET_PHOTO_SIZE));
+        photos[i]->date_taken = take(&fp[i]->fields[PHOTO_FIELD_dates_taken].string);
+        photos[i]->tags = join_tags(fp[i]);
+        photos[i]->description = take(&fp[i]->fields[PHOTO_FIELD_description].string);
+    }
+
+fail: flickcurl_free_photos(fp);
+    return photos;
+}
+
+static void *upload(flickcurl *fc, const api_call *call) {
+    flickcurl_upload_status* status;
+    flickcurl_upload_params params;
+    char *photo_id;
+
+    memset(&params, '\0', sizeof(flickcurl_upload_params));
+    params.safety_level = SAFETY_LEVEL;    /* default safety */
+    params.content_type = CONTENT_TYPE;    /* default photo */
+    params.photo_file = call->args[0];
+    params.title = call->args[1];
+
+    if(!(status = flickcurl_photos_upload_params(fc, &params)))
+        return NULL;
+
+    photo_id = status->photoid ? strdup(status->photoid) : NULL;
+    flickcurl_free_upload_status(status);
+    return photo_id;
+}
+
+static void *set_photo_title(flickcurl *fc, const api_call *call) {
+    return flickcurl_photos_setMeta(fc, call->args[0], call->args[1], "") ? NULL : &succeeded;
+}
+
+static void *set_photoset_title(flickcurl *fc, const api_call *call) {
+    return flickcurl_photosets_editMeta(fc, call->args[0], call->args[1], NULL) ? NULL : &succeeded;
+}
+
+static void *create_photoset(flickcurl *fc, const api_call *call) {
+    return flickcurl_photosets_create(fc, call->args[0], NULL, call->args[1], NULL);
+}
+
+static void *add_photo(flickcurl *fc, const api_call *call) {
+    return flickcurl_photosets_addPhoto(fc, call->args[0], call->args[1]) ? NULL : &succeeded;
+}
+
+static void *remove_photo(flickcurl *fc, const api_call *call) {
+    return flickcurl_photosets_removePhoto(fc, call->args[0], call->args[1]) ? NULL : &succeeded;
+}
+
+static void *delete_photo(flickcurl *fc, const api_call *call) {
+    return flickcurl_photos_delete(fc, call->args[0]) ? NULL : &succeeded;
+}
+
+
+/**
+ * The backend
+**/
+
+static int flickr_ping() {
+    char *login = (char *)call_api(new_call(test_login, free, NULL, NULL));
+    int ret = login ? SUCCESS : FAIL;
+
+    free(login);
+    return ret;
+}
+
+/*
+ * Initialize the flickcurl connection
+*/
+static int flickr_init(const char *args) {
+    flickcurl *fc;
+    (void)args;
+
+    if(wget_init())
+        return FAIL;
+
+    flickcurl_init();
+    if(!(fc = flickcurl_new()))
+        return FAIL;
+
+    conf_path = get_conf_path();
+    if(!conf_path || check_conf_file(conf_path, fc)) {
+        flickcurl_free(fc);
+        return FAIL;
+    }
+    flickcurl_free(fc);
+
+    return flickr_ping();
+}
+
+/*
+ * Calls given up on may still be using flickcurl and curl, in which case
+ * they are left alone, as the process is about to end anyway.
+ */
+static void flickr_kill() {
+    pthread_mutex_lock(&calls_lock);
+    while(num_idle > 0)
+        flickcurl_free(idle_handles[--num_idle]);
+
+    if(num_running == 0) {
+        flickcurl_finish();
+        wget_destroy();
+        free(photo_host);
+        photo_host = NULL;
+        free(conf_path);
+        conf_path = NULL;
+    }
+    pthread_mutex_unlock(&calls_lock);
+}
+
+static backend_photoset **flickr_get_photosets() {
+    api_call *call = new_call(get_photosets, discard_photosets, NULL, NULL);
+
+    if(call)
+        call->hedge_op = LAT_API_GET_PHOTOSETS;
+    return (backend_photoset **)call_api(call);
+}
+
+static backend_photo **flickr_get_photos(const char *photoset_id, int page, int per_page) {
+    api_call *call = new_call(get_photos, discard_photos, photoset_id, NULL);
+
+    if(call) {
+        call->page = page;
+        call->per_page = per_page;
+        call->hedge_op = LAT_API_GET_PHOTOS;
+    }
+    return (backend_photo **)call_api(call);
+}
+
+static char *flickr_upload(const char *path, const char *title) {
+    return (char *)call_api_to_end(new_call(upload, free, path, title));
+}
+
+static int flickr_set_photo_title(const char *photo_id, const char *title) {
+    return call_api_to_end(new_call(set_photo_title, NULL, photo_id, title)) ? SUCCESS : FAIL;
+}
+
+static int flickr_set_photoset_title(const char *photoset_id, const char *title) {
+    return call_api_to_end(new_call(set_photoset_title, NULL, photoset_id, title)) ? SUCCESS : FAIL;
+}
+
+static char *flickr_create_photoset(const char *title, const char *primary_photo_id) {
+    return (char *)call_api_to_end(new_call(create_photoset, free, title, primary_photo_id));
+}
+
+static int flickr_add_photo(const char *photoset_id, const char *photo_id) {
+    return call_api_to_end(new_call(add_photo, NULL, photoset_id, photo_id)) ? SUCCESS : FAIL;
+}
+
+static int flickr_remove_photo(const char *photoset_id, const char *photo_id) {
+    return call_api_to_end(new_call(remove_photo, NULL, photoset_id, photo_id)) ? SUCCESS : FAIL;
+}
+
+static int flickr_delete_photo(const char *photo_id) {
+    return call_api_to_end(new_call(delete_photo, NULL, photo_id, NULL)) ? SUCCESS : FAIL;
+}
+
+const backend flickr_backend = {
+    .name = "flickr",
+    .quota = API_QUOTA,
+    .init = flickr_init,
+    .kill = flickr_kill,
+    .ping = flickr_ping,
+    .get_photosets = flickr_get_photosets,
+    .get_photos = flickr_get_photos,
+    .fetch = wget,
+    .content_length = get_url_content_length,
+    .upload = flickr_upload,
+    .set_photo_title = flickr_set_photo_title,
+    .set_photoset_title = flickr_set_photoset_title,
+    .create_photoset = flickr_create_photoset,
+    .add_photo = flickr_add_photo,
+    .remove_photo = flickr_remove_photo,
+    .delete_photo = flickr_delete_photo
+};
@@ -1,4 +1,4 @@
-#define FUSE_USE_VERSION 30
+#define FUSE_USE_VERSION 31
 #define _XOPEN_SOURCE 500
 
 #include <fuse.h>
@@ -6,24 +6,52 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <stddef.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <time.h>
 #include <ftw.h>
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-parameter"
-#pragma GCC diagnostic ignored "-Wconversion"
-#pragma GCC diagnostic ignored "-Wfloat-conversion"
-#pragma GCC diagnostic ignored "-Wsign-conversion"
-#include <wand/magick_wand.h>
-#pragma GCC diagnostic pop
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <syslog.h>
 
 #include "cache.h"
-#include "wget.h"
+#include "backend.h"
+#include "stats.h"
+#include "latency.h"
+#include "trace.h"
+#include "replay.h"
+#include "sched.h"
+#include "pool.h"
+#include "memtier.h"
+#include "sniff.h"
+#include "unshare.h"
 
 
 #define PERMISSIONS     0755        /* Cached file permissions. */
-#define TMP_DIR_NAME    ".flickrms" /* Where to place cached photos. */
+#define LINK_PERMISSIONS 0777       /* Search result permissions. */
+#define TMP_DIR_NAME    ".flickrms" /* Where to place cached photos, in cache_dir or $HOME. */
+#define ID_DIR_NAME     ".ids"      /* Where photos are downloaded to, by Flickr id. */
+#define BY_DATE_DIR     ".by-date"  /* Photos without a photoset, by the month they were taken in. */
+#define SEARCH_DIR      ".search"   /* Searches of the photo titles, tags and descriptions. */
+#define STATS_DIR       ".flickrms" /* Holds STATS_FILE and LATENCY_FILE. */
+#define STATS_FILE      "stats"     /* The counters of stats.h, read only. */
+#define LATENCY_FILE    "latency"   /* The histograms of latency.h, read only. */
+#define STATS_PERMISSIONS 0444
 #define PHOTO_TIMEOUT   14400       /* In seconds. */
+#define READDIR_BATCH   64          /* Photos primed and listed at a time. */
+#define POOL_THREADS    16          /* As many as sched.c lets call the backend at once */
+#define WARM_PARALLEL   4           /* Photosets warmed at once */
+#define WARM_POLL_MS    250         /* How often a waiting warm-up checks whether it may go on */
+#define WARM_SHARE      2           /* The warm-up fills at most 1/2 of the listing budget */
+
+/* How long the kernel may cache entries and attributes. Our metadata only
+ * changes on a cache refresh or our own writes, both of which invalidate the
+ * kernel's copy, so this can be long.
+ */
+#define KERNEL_CACHE_TIMEOUT_OPT "-oentry_timeout=3600,attr_timeout=3600"
 
 
 /* Determines whether to report the true file size in getattr before the file
@@ -46,62 +74,270 @@
 #define CLEAN_TMP_DIR_UMOUNT 1      /* 1 or 0. */
 
 
+/* An open file. Stored in fi->fh from open/create until release. */
+typedef struct {
+    int fd;
+    char *photoset;
+    char *photo;
+    unsigned short dirty;   /* Written to since open. Synced to the cache on release. */
+} file_handle;
+
+/* An open root directory. Stored in fi->fh from opendir until releasedir. */
+typedef struct {
+    char **names;           /* The photosets, sorted, as they were at opendir */
+    unsigned int num_names;
+    photo_listing *listing; /* The photos without a photoset */
+} root_dir;
+
+
+/* A kernel cache invalidation waiting to be sent. */
+typedef struct invalidation {
+    struct invalidation *next;
+    char path[];
+} invalidation;
+
+
 static uid_t uid;   /* The user id of the user that mounted the filesystem */
 static gid_t gid;   /* The group id of the user */
 
 static char *tmp_path;
 
+static struct fuse *fuse;                       /* For sending invalidations */
+static pthread_t invalidate_thread;
+static pthread_mutex_t invalidate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t invalidate_cond = PTHREAD_COND_INITIALIZER;
+static invalidation *invalidate_head;           /* Queued invalidations, oldest first */
+static invalidation **invalidate_tail = &invalidate_head;
+static unsigned short invalidate_running;
+
+static sem_t dump_sem;                          /* Posted on SIGUSR1 */
+static pthread_t dump_thread;
+static unsigned short dump_running;
+
+static pthread_t warm_thread;
+static pthread_mutex_t warm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t warm_cond = PTHREAD_COND_INITIALIZER;
+static pool_group *warm_group;                  /* The photosets being warmed */
+static unsigned short warm_running;
+
+/* Mount options, given with -o. */
+static struct options {
+    unsigned int listing_budget;    /* In MB. Memory for cached photo listings. */
+    unsigned int memory_budget;     /* In MB. Memory for photos read or written lately. */
+    char *cache_dir;                /* Holds TMP_DIR_NAME. Defaults to $HOME. */
+    int by_date;                    /* Show the /.by-date/YYYY/MM tree. */
+    int search;                     /* Show the /.search/query tree. */
+    char *backend;                  /* Where photos come from, "name" or "name:args". */
+    unsigned int slow_ms;           /* Operations taking longer are logged. 0 disables the log. */
+    char *trace;                    /* Every operation is written to this file. */
+    char *replay;                   /* Replays this trace instead of mounting. */
+    int replay_fast;                /* Replays without waiting between operations. */
+    int api_quota;                  /* API calls an hour. -1 keeps the quota of the backend, 0 lifts it. */
+    int warm;                       /* Loads every photoset in the background once mounted. */
+    int warm_sizes;                 /* The warm-up looks up the size of every photo too. */
+    int no_read_buf;                /* Reads copy the data instead of handing FUSE the file. */
+    backend_timeouts timeouts;      /* Defaults to backend_timeout. */
+} options = {
+    .listing_budget = DEFAULT_LISTING_BUDGET,
+    .memory_budget = 128,
+    .slow_ms = 1000,
+    .api_quota = -1
+};
+
+#define OPTION(t, p) { t, offsetof(struct options, p), 1 }
+
+static const struct fuse_opt option_spec[] = {
+    OPTION("listing_budget=%u", listing_budget),
+    OPTION("memory_budget=%u", memory_budget),
+    OPTION("cache_dir=%s", cache_dir),
+    OPTION("by_date", by_date),
+    OPTION("search", search),
+    OPTION("backend=%s", backend),
+    OPTION("slow_ms=%u", slow_ms),
+    OPTION("trace=%s", trace),
+    OPTION("replay=%s", replay),
+    OPTION("replay_fast", replay_fast),
+    OPTION("api_quota=%d", api_quota),
+    OPTION("warm", warm),
+    OPTION("warm_sizes", warm_sizes),
+    OPTION("no_read_buf", no_read_buf),
+    OPTION("connect_timeout=%u", timeouts.connect),
+    OPTION("stall_timeout=%u", timeouts.stall),
+    OPTION("transfer_timeout=%u", timeouts.transfer),
+    FUSE_OPT_END
+};
+
 
 /**
  * Helper functions
 **/
 
 /*
- * Returns the first index of a '/' or negative if non exists in the
- * path supplied.
+ * Internal method for splitting a path of the format:
+ * "/photosetname/photoname"
+ * into: photoset = "photosetname" and photo = "photoname"
+ * Nothing is allocated. The photoset name is copied into the photoset
+ * buffer, which must hold strlen(path) + 1 bytes, and photo points into
+ * path. Photoset titles can be longer than NAME_MAX, so the buffer is sized
+ * from the path rather than fixed.
  */
-static size_t get_slash_index(const char *path, unsigned short *found) {
-    size_t i;
-    *found = 0;
-    if(!path)
-        return 0;
-    for(i = 0; i < strlen(path); i++) {
-        if(path[i] == '/') {
-            *found = 1;
-            break;
-        }
+static int split_path(const char *path, char *photoset, const char **photo) {
+    const char *slash;
+    size_t len;
+
+    if(!path || path[0] != '/')
+        return FAIL;
+
+    if(!(slash = strchr(path + 1, '/'))) {
+        photoset[0] = '\0';
+        *photo = path + 1;
+        return SUCCESS;
     }
-    return i;
+
+    len = (size_t)(slash - path - 1);
+    memcpy(photoset, path + 1, len);
+    photoset[len] = '\0';
+    *photo = slash + 1;
+    return SUCCESS;
 }
 
-/* 
- * Internal method for splitting a path of the format:
- * "/photosetname/photoname"
- * into: photoset = "photosetname" and photo = "photoname"
+/*
+ * Internal method for splitting a path in the date tree of the format:
+ * "/.by-date/YYYY/MM/photoname"
+ * into: shard = "YYYY/MM" and photo = "photoname"
+ * The shard buffer must hold DATE_SHARD_SIZE bytes. Returns how deep the
+ * path is in the tree: 0 for the tree itself, 1 for a year (shard is then
+ * just "YYYY"), 2 for a month and 3 for a photo. Returns FAIL if the path
+ * is not in the tree.
  */
-static int get_photoset_photo_from_path(const char *path, char **photoset, char **photo) {
-    size_t i;
-    unsigned short found;
-    char *path_dup;
+static int split_date_path(const char *path, char *shard, const char **photo) {
+    size_t len = strlen(BY_DATE_DIR);
+    const char *year, *month, *slash;
 
-    path_dup = strdup(path + 1);
-    i = get_slash_index(path_dup, &found);
+    if(!options.by_date || path[0] != '/' || strncmp(path + 1, BY_DATE_DIR, len))
+        return FAIL;
 
-    if(!path || !photoset || !photo || !path_dup)
+    year = path + 1 + len;
+    if(year[0] == '\0')
+        return 0;
+    if(year[0] != '/')
         return FAIL;
+    year++;
 
-    if(found) {
-        path_dup[i] = '\0';
-        *photoset = strdup(path_dup);
-        *photo = strdup(path_dup + i + 1);
+    if(!(slash = strchr(year, '/'))) {
+        if(strlen(year) != 4)
+            return FAIL;
+        memcpy(shard, year, 5);
+        return 1;
     }
-    else {
-        *photoset = strdup("");
-        *photo = strdup(path_dup);
+    if(slash - year != 4)
+        return FAIL;
+
+    month = slash + 1;
+    memcpy(shard, year, 5);
+    if(!(slash = strchr(month, '/'))) {
+        if(strlen(month) != 2)
+            return FAIL;
+        memcpy(shard + 5, month, 3);
+        return 2;
     }
+    if(slash - month != 2 || strchr(slash + 1, '/'))
+        return FAIL;
 
-    free(path_dup);
-    return SUCCESS;
+    memcpy(shard + 5, month, 2);
+    shard[7] = '\0';
+    *photo = slash + 1;
+    return 3;
+}
+
+/*
+ * Internal method for splitting a path in the search tree of the format:
+ * "/.search/query/name"
+ * into: query = "query" and name = "name"
+ * The query buffer must hold strlen(path) + 1 bytes. Returns how deep the path
+ * is in the tree: 0 for the tree itself, 1 for a query and 2 for one of
+ * its results. Returns FAIL if the path is not in the tree.
+ */
+static int split_search_path(const char *path, char *query, const char **name) {
+    size_t len = strlen(SEARCH_DIR);
+    const char *start, *slash;
+
+    if(!options.search || path[0] != '/' || strncmp(path + 1, SEARCH_DIR, len))
+        return FAIL;
+
+    start = path + 1 + len;
+    if(start[0] == '\0')
+        return 0;
+    if(start[0] != '/')
+        return FAIL;
+    start++;
+
+    if(!(slash = strchr(start, '/'))) {
+        strcpy(query, start);
+        return 1;
+    }
+
+    len = (size_t)(slash - start);
+    if(strchr(slash + 1, '/'))
+        return FAIL;
+
+    memcpy(query, start, len);
+    query[len] = '\0';
+    *name = slash + 1;
+    return 2;
+}
+
+/*
+ * Returns 0 if path is the stats directory, 1 if it is in the directory,
+ * with name pointing at its name, and FAIL otherwise.
+ */
+static int split_stats_path(const char *path, const char **name) {
+    size_t len = strlen(STATS_DIR);
+
+    if(path[0] != '/' || strncmp(path + 1, STATS_DIR, len))
+        return FAIL;
+
+    if(path[1 + len] == '\0')
+        return 0;
+    if(path[1 + len] != '/')
+        return FAIL;
+
+    *name = path + 2 + len;
+    return 1;
+}
+
+/*
+ * The date and search trees are views of the real photos and the stats
+ * directory is made up. None of them can be changed through.
+ */
+static inline int is_virtual_path(const char *path) {
+    char shard[DATE_SHARD_SIZE];
+    char query[strlen(path) + 1];
+    const char *name;
+
+    return split_date_path(path, shard, &name) != FAIL || split_search_path(path, query, &name) != FAIL ||
+      split_stats_path(path, &name) != FAIL;
+}
+
+/*
+ * Returns the path of the photo in the tmp directory.
+ *
+ * IMPORTANT: Make sure you free() the path after you are done!
+ */
+static char *get_cached_path(const char *photoset, const char *photo) {
+    char *cached_path = (char *)malloc(strlen(photoset) + strlen(photo) + strlen(tmp_path) + 3);
+
+    if(!cached_path)
+        return NULL;
+
+    strcpy(cached_path, tmp_path);
+    if(strcmp(photoset,"")) {
+        strcat(cached_path, "/");
+        strcat(cached_path, photoset);
+    }
+    strcat(cached_path, "/");
+    strcat(cached_path, photo);
+    return cached_path;
 }
 
 /*
@@ -116,12 +352,13 @@ static inline int set_user_variables() {
 
 /*
  * Set the path to the directory that will be used to get the image
- * data from Flickr.
+ * data from Flickr. It is made in cache_dir, so a slow home directory
+ * can be kept out of the way of reads.
  */
 static inline int set_tmp_path() {
-    char *home;
+    char *home = options.cache_dir;
 
-    if(!(home = getenv("HOME")))
+    if(!home && !(home = getenv("HOME")))
         return FAIL;
 
     tmp_path = (char *)malloc(strlen(home) + strlen(TMP_DIR_NAME) + 2);
@@ -148,12 +385,208 @@ static inline void remove_tmp_path() {
     free(tmp_path);
 }
 
-static inline void imagemagick_init() {
-    MagickWandGenesis();
+static file_handle *new_file_handle(int fd, const char *photoset, const char *photo, unsigned short dirty) {
+    file_handle *fh = (file_handle *)malloc(sizeof(file_handle));
+
+    if(!fh)
+        return NULL;
+
+    fh->fd = fd;
+    fh->photoset = strdup(photoset);
+    fh->photo = strdup(photo);
+    fh->dirty = dirty;
+    return fh;
+}
+
+static void free_file_handle(file_handle *fh) {
+    free(fh->photoset);
+    free(fh->photo);
+    free(fh);
+}
+
+static inline file_handle *get_file_handle(const struct fuse_file_info *fi) {
+    return (file_handle *)(uintptr_t)fi->fh;
+}
+
+/*
+ * Called by the cache whenever a photo or photoset changed. The cache is
+ * locked at that point and the change may come from inside a filesystem
+ * operation on the same path, so the kernel is notified later from
+ * invalidate_thread_run instead.
+ */
+static void queue_invalidation(const char *photoset, const char *photo) {
+    size_t len = strlen(photoset) + (photo ? strlen(photo) : 0) + 3;
+    invalidation *inv = (invalidation *)malloc(sizeof(invalidation) + len);
+
+    if(!inv)
+        return;
+
+    strcpy(inv->path, "/");
+    strcat(inv->path, photoset);
+    if(photo) {
+        if(photoset[0] != '\0')
+            strcat(inv->path, "/");
+        strcat(inv->path, photo);
+    }
+    inv->next = NULL;
+
+    pthread_mutex_lock(&invalidate_lock);
+    *invalidate_tail = inv;
+    invalidate_tail = &inv->next;
+    pthread_cond_signal(&invalidate_cond);
+    pthread_mutex_unlock(&invalidate_lock);
+
+    /* The date tree shows the photos without a photoset */
+    if(photoset[0] == '\0' && options.by_date)
+        queue_invalidation(BY_DATE_DIR, NULL);
+}
+
+static void *invalidate_thread_run(void *arg) {
+    invalidation *inv;
+    (void)arg;
+
+    pthread_mutex_lock(&invalidate_lock);
+    while(invalidate_running) {
+        if(!(inv = invalidate_head)) {
+            pthread_cond_wait(&invalidate_cond, &invalidate_lock);
+            continue;
+        }
+        if(!(invalidate_head = inv->next))
+            invalidate_tail = &invalidate_head;
+        pthread_mutex_unlock(&invalidate_lock);
+
+        fuse_invalidate_path(fuse, inv->path);  /* -ENOENT if the kernel never saw it */
+        free(inv);
+
+        pthread_mutex_lock(&invalidate_lock);
+    }
+    pthread_mutex_unlock(&invalidate_lock);
+    return NULL;
+}
+
+static void start_invalidations(struct fuse *f) {
+    fuse = f;
+    invalidate_running = 1;
+    if(pthread_create(&invalidate_thread, NULL, invalidate_thread_run, NULL)) {
+        invalidate_running = 0;
+        return;
+    }
+    set_cache_invalidate(queue_invalidation);
 }
 
-static inline void imagemagick_destroy() {
-    MagickWandTerminus();
+static void stop_invalidations() {
+    invalidation *inv;
+
+    if(!invalidate_running)
+        return;
+
+    set_cache_invalidate(NULL);
+
+    pthread_mutex_lock(&invalidate_lock);
+    invalidate_running = 0;
+    pthread_cond_signal(&invalidate_cond);
+    pthread_mutex_unlock(&invalidate_lock);
+    pthread_join(invalidate_thread, NULL);
+
+    while((inv = invalidate_head)) {
+        invalidate_head = inv->next;
+        free(inv);
+    }
+    invalidate_tail = &invalidate_head;
+}
+
+static inline int is_stats_file(const char *name) {
+    return !strcmp(name, STATS_FILE) || !strcmp(name, LATENCY_FILE);
+}
+
+/*
+ * Writes a snapshot of the file in the stats directory to an unlinked file
+ * and returns a descriptor for it, or -errno.
+ */
+static int open_stats(const char *name) {
+    FILE *out, *statm;
+    long size, resident = 0;
+    int fd;
+
+    if(!(out = tmpfile()))
+        return -errno;
+
+    if(!strcmp(name, LATENCY_FILE))
+        latency_print(out);
+    else {
+        stats_print(out);
+        sched_print(out);
+        fprintf(out, "cache_memory %zu\n", get_cache_memory());
+
+        if((statm = fopen("/proc/self/statm", "r"))) {
+            if(fscanf(statm, "%ld %ld", &size, &resident) != 2)
+                resident = 0;
+            fclose(statm);
+        }
+        fprintf(out, "resident_memory %ld\n", resident * sysconf(_SC_PAGESIZE));
+    }
+
+    fd = (fflush(out) == EOF) ? -1 : dup(fileno(out));
+    if(fd < 0)
+        fd = -errno;
+    fclose(out);
+    return fd;
+}
+
+/* Counts the time since start as disk time of the current operation. */
+static inline void disk_time(uint64_t start) {
+    latency_phase_add(PHASE_DISK, latency_now() - start);
+}
+
+/* Only marks the dump as wanted, as the signal may land on any thread. */
+static void request_dump(int sig) {
+    (void)sig;
+    sem_post(&dump_sem);
+}
+
+/* Sends the latency histograms to syslog for every SIGUSR1. */
+static void *dump_thread_run(void *arg) {
+    (void)arg;
+
+    for(;;) {
+        if(sem_wait(&dump_sem))         /* EINTR */
+            continue;
+        if(!dump_running)
+            break;
+        latency_log();
+    }
+    return NULL;
+}
+
+static void start_dumps() {
+    struct sigaction sa;
+
+    if(sem_init(&dump_sem, 0, 0))
+        return;
+
+    dump_running = 1;
+    if(pthread_create(&dump_thread, NULL, dump_thread_run, NULL)) {
+        dump_running = 0;
+        sem_destroy(&dump_sem);
+        return;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_dump;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+}
+
+static void stop_dumps() {
+    if(!dump_running)
+        return;
+
+    signal(SIGUSR1, SIG_DFL);
+    dump_running = 0;
+    sem_post(&dump_sem);
+    pthread_join(dump_thread, NULL);
+    sem_destroy(&dump_sem);
 }
 
 
@@ -171,6 +604,12 @@ static inline void set_stbuf(struct stat *stbuf, mode_t mode, uid_t uid,
     stbuf->st_nlink = nlink;
 }
 
+/* Sets the attributes of a cached photo or photoset, including its inode. */
+static inline void set_stbuf_ci(struct stat *stbuf, mode_t mode, const cached_information *ci) {
+    set_stbuf(stbuf, mode, uid, gid, ci->size, ci->time, 1);
+    stbuf->st_ino = (ino_t)ci->ino;
+}
+
 /*
  * Get photo size if needed.
  */
@@ -179,7 +618,7 @@ static int process_photo(const char *photoset, const char *photo, cached_informa
         int photo_size = FAKE_PHOTO_SIZE;
 
         if(USE_TRUE_PHOTO_SIZE) {
-            photo_size = get_url_content_length(ci->uri);
+            photo_size = backend_content_length(ci->uri);
 
             if(photo_size < 0)
                 return FAIL;
@@ -189,16 +628,9 @@ static int process_photo(const char *photoset, const char *photo, cached_informa
     }
     else { /* Possibly dirty. Try stating cached directory. */
         struct stat st_buf;
-        char *cached_path = (char *)malloc(strlen(photoset) + strlen(photo) + strlen(tmp_path) + 3);
-        strcpy(cached_path, tmp_path);
-        if(strcmp(photoset,"")) {
-            strcat(cached_path, "/");
-            strcat(cached_path, photoset);
-        }
-        strcat(cached_path, "/");
-        strcat(cached_path, photo);
+        char *cached_path = get_cached_path(photoset, photo);
 
-        if(!stat(cached_path, &st_buf)) {
+        if(cached_path && !stat(cached_path, &st_buf)) {
             ci->size = (unsigned int)st_buf.st_size;
         }
 
@@ -209,27 +641,131 @@ static int process_photo(const char *photoset, const char *photo, cached_informa
     return SUCCESS;
 }
 
-static int prime_photo_size_cache(const char *photoset, char **names, unsigned int num_names) {
+/* A photo whose size prime_photo_size_cache looks up on the pool. */
+typedef struct {
+    pool_group *group;
+    const char *photoset;
+    const char *name;
+    struct stat *stbuf;
+} size_probe;
+
+/* Once the backend is down the other probes would fail at once, so they are dropped. */
+static void probe_size(void *arg) {
+    size_probe *sp = (size_probe *)arg;
+    cached_information *ci = photo_lookup(sp->photoset, sp->name);
+
+    if(ci) {
+        if(process_photo(sp->photoset, sp->name, ci) && !backend_available())
+            pool_cancel(sp->group);
+        if(sp->stbuf)
+            set_stbuf_ci(sp->stbuf, S_IFREG | PERMISSIONS, ci);
+        free_cached_info(ci);
+    }
+}
+
+/*
+ * Makes sure the size of every photo is cached. If stats is given, it is
+ * filled with the attributes of each photo so a listing can return them
+ * without a getattr per entry. Photos that could not be found are left
+ * with a zero st_mode.
+ */
+static int prime_photo_size_cache(const char *photoset, const char **names, unsigned int num_names,
+  struct stat *stats) {
+    pool_group group = { 0 };
+    size_probe *probes;
     unsigned int i;
 
-    #pragma omp parallel for
+    if(!(probes = (size_probe *)malloc(num_names * sizeof(size_probe))))
+        return FAIL;
+
     for(i = 0; i < num_names; i++) {
-        cached_information *ci = photo_lookup(photoset, names[i]);
+        probes[i].group = &group;
+        probes[i].photoset = photoset;
+        probes[i].name = names[i];
+        probes[i].stbuf = stats ? &stats[i] : NULL;
+        pool_submit(&group, SCHED_PROBE, probe_size, &probes[i]);
+    }
+    pool_wait(&group);
 
-        if(ci) {
-            process_photo(photoset, names[i], ci);
-            free_cached_info(ci);
-        }
+    free(probes);
+    return SUCCESS;
+}
+
+/*
+ * Gets the attributes of a node in the date tree. Years and months only
+ * exist while they have photos.
+ */
+static int date_getattr(int depth, const char *shard, const char *photo, struct stat *stbuf) {
+    cached_information *ci;
+    photo_listing *listing;
+    char **names;
+    unsigned int num_names, i;
+
+    switch(depth) {
+    case 0:
+        break;
+    case 1:
+        if((num_names = get_date_names(shard, &names)) == 0)
+            return -ENOENT;
+        for(i = 0; i < num_names; i++)
+            free(names[i]);
+        free(names);
+        break;
+    case 2:
+        if(!(listing = get_date_listing(shard)))
+            return -ENOENT;
+        release_photo_listing(listing);
+        break;
+    default:
+        if(!(ci = date_photo_lookup(shard, photo)))
+            return -ENOENT;
+        process_photo("", photo, ci);
+        set_stbuf_ci(stbuf, S_IFREG | PERMISSIONS, ci);
+        free_cached_info(ci);
+        return SUCCESS;
     }
 
+    set_stbuf(stbuf, S_IFDIR | PERMISSIONS, uid, gid, 0, 0, 1);
     return SUCCESS;
 }
 
+/*
+ * Gets the attributes of a node in the search tree. Every query is a
+ * directory, even if nothing matches it, and every result is a symlink.
+ */
+static int search_getattr(int depth, const char *query, const char *name, struct stat *stbuf) {
+    search_results *results;
+    const search_entry *se;
+    int retval = -ENOENT;
+
+    if(depth < 2) {
+        set_stbuf(stbuf, S_IFDIR | PERMISSIONS, uid, gid, 0, 0, 1);
+        return SUCCESS;
+    }
+
+    if(!(results = search_photos(query)))
+        return -ENOENT;
+
+    if((se = search_results_lookup(results, name))) {
+        set_stbuf(stbuf, S_IFLNK | LINK_PERMISSIONS, uid, gid, (off_t)strlen(se->target), 0, 1);
+        retval = SUCCESS;
+    }
+
+    release_search_results(results);
+    return retval;
+}
+
 /*
  * Gets the attributes (stat) of the node at path.
  */
-static int fms_getattr(const char *path, struct stat *stbuf) {
+static int fms_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
     int retval = -ENOENT;
+
+    if(fi) {    /* Open file, it may not have been uploaded yet. */
+        int ret = fstat(get_file_handle(fi)->fd, stbuf);
+        return (ret < 0) ? -errno : SUCCESS;
+    }
+
     memset((void *)stbuf, 0, sizeof(struct stat));
 
     if(!strcmp(path, "/")) { /* Path is mount directory */
@@ -239,41 +775,39 @@ static int fms_getattr(const char *path, struct stat *stbuf) {
     }
     else {
         cached_information *ci = NULL;
-        /* Point to charcter after root directory */
-        const char *lookup_path = path + 1;
-        unsigned short found;
-        size_t index = get_slash_index(lookup_path, &found);    /* Look up first forward slash */
-        /* If forward slash doesn't exist, we are looking at a photo without a photoset or a photoset. */
-        if(!found) {
-            if((ci = photoset_lookup(lookup_path))) {   /* See if path is to a photoset (i.e. a directory ) */
-                set_stbuf(stbuf, S_IFDIR | PERMISSIONS, uid, gid, ci->size, ci->time, 1);
-                retval = SUCCESS;
-            }
-            else if((ci = photo_lookup("", lookup_path))) { /* See if path is to a photo (i.e. a file ) */
-                process_photo("", lookup_path, ci);
-                set_stbuf(stbuf, S_IFREG | PERMISSIONS, uid, gid, ci->size, ci->time, 1);
-                retval = SUCCESS;
-            }
+        char photoset[strlen(path) + 1];
+        char shard[DATE_SHARD_SIZE];
+        const char *photo;
+        int depth;
+
+        if((depth = split_date_path(path, shard, &photo)) != FAIL)
+            return date_getattr(depth, shard, photo, stbuf);
+
+        if((depth = split_search_path(path, photoset, &photo)) != FAIL)
+            return search_getattr(depth, photoset, photo, stbuf);
+
+        if((depth = split_stats_path(path, &photo)) != FAIL) {
+            if(depth == 0)
+                set_stbuf(stbuf, S_IFDIR | PERMISSIONS, uid, gid, 0, 0, 1);
+            else if(is_stats_file(photo))           /* Its size is only known once it is open */
+                set_stbuf(stbuf, S_IFREG | STATS_PERMISSIONS, uid, gid, 0, time(NULL), 1);
+            else
+                return -ENOENT;
+            return SUCCESS;
         }
-        else {
-            /* If forward slash does exist, it means that we have a photo with a photoset (the chars before
-             * the slash are the photoset name and the chars after the slash are the photo name.
-             */
-            char *photoset = (char *)malloc(index + 1);
-            if(!photoset)
-                retval = -ENOMEM;
-            else {
-                strncpy(photoset, lookup_path, index);  /* Extract the photoset from the path */
-                photoset[index] = '\0';
-
-                ci = photo_lookup(photoset, lookup_path + index + 1);   /* Look for the photo */
-                if(ci) {
-                    process_photo(photoset, lookup_path + index + 1, ci);
-                    set_stbuf(stbuf, S_IFREG | PERMISSIONS, uid, gid, ci->size, ci->time, 1);
-                    retval = SUCCESS;
-                }
-                free(photoset);
-            }
+
+        if(split_path(path, photoset, &photo))
+            return -ENOENT;
+
+        /* If there is no photoset in the path, we are looking at a photo without a photoset or a photoset. */
+        if(photoset[0] == '\0' && (ci = photoset_lookup(photo))) {  /* See if path is to a photoset (i.e. a directory ) */
+            set_stbuf_ci(stbuf, S_IFDIR | PERMISSIONS, ci);
+            retval = SUCCESS;
+        }
+        else if((ci = photo_lookup(photoset, photo))) {     /* See if path is to a photo (i.e. a file ) */
+            process_photo(photoset, photo, ci);
+            set_stbuf_ci(stbuf, S_IFREG | PERMISSIONS, ci);
+            retval = SUCCESS;
         }
         if(ci)
             free_cached_info(ci);
@@ -281,53 +815,267 @@ static int fms_getattr(const char *path, struct stat *stbuf) {
     return retval;
 }
 
-/* Read directory */
-static int fms_readdir(const char *path, void *buf,
-  fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-    unsigned int num_names, i;
-    char **names;
-    (void)offset;
-    (void)fi;
+/* Search results link to the photos they found. */
+static int fms_readlink(const char *path, char *buf, size_t size) {
+    char query[strlen(path) + 1];
+    const char *name;
+    search_results *results;
+    const search_entry *se;
+    int retval = -ENOENT;
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
+    if(split_search_path(path, query, &name) != 2)
+        return -EINVAL;
 
-    if(!strcmp(path, "/")) {                      /* Path is to mounted directory */
-        num_names = get_photoset_names(&names);   /* Report photoset names */
-        for(i = 0; i < num_names; i++) {
-            filler(buf, names[i], NULL, 0);
-            free(names[i]);
-        }
-        if(num_names > 0)
-            free(names);
+    if(!(results = search_photos(query)))
+        return -ENOENT;
+
+    if((se = search_results_lookup(results, name))) {
+        strncpy(buf, se->target, size - 1);
+        buf[size - 1] = '\0';
+        retval = SUCCESS;
+    }
+
+    release_search_results(results);
+    return retval;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Holds on to the sorted photo listing for as long as the directory is open.
+ * The root also holds on to the sorted photoset names, so reading it in
+ * several calls doesn't copy and sort every name again for each.
+ */
+static int fms_opendir(const char *path, struct fuse_file_info *fi) {
+    char query[strlen(path) + 1];
+    const char *photo;
+    root_dir *root;
+    int depth;
+
+    fi->fh = 0;
+    if(!strcmp(path, "/")) {
+        if(!(root = (root_dir *)malloc(sizeof(root_dir))))
+            return -ENOMEM;
+
+        root->num_names = get_photoset_names(&root->names);
+        if(root->num_names > 0)
+            qsort(root->names, root->num_names, sizeof(char *), compare_names);
+        root->listing = get_photo_listing("");
+        fi->fh = (uint64_t)(uintptr_t)root;
+    }
+    else if((depth = split_date_path(path, query, &photo)) != FAIL) {
+        if(depth == 2)
+            fi->fh = (uint64_t)(uintptr_t)get_date_listing(query);
+    }
+    else if((depth = split_search_path(path, query, &photo)) != FAIL) {
+        if(depth == 1)  /* Or the results of the search */
+            fi->fh = (uint64_t)(uintptr_t)search_photos(query);
+    }
+    else if(split_stats_path(path, &photo) == FAIL)
+        fi->fh = (uint64_t)(uintptr_t)get_photo_listing(path + 1);
+    return SUCCESS;
+}
+
+static int fms_releasedir(const char *path, struct fuse_file_info *fi) {
+    char query[strlen(path) + 1];
+    const char *name;
+    root_dir *root;
+    unsigned int i;
 
-        num_names = get_photo_names("", &names);  /* Get all photo names with no photoset attached */
+    if(!strcmp(path, "/")) {
+        root = (root_dir *)(uintptr_t)fi->fh;
+        for(i = 0; i < root->num_names; i++)
+            free(root->names[i]);
+        if(root->num_names > 0)
+            free(root->names);
+        release_photo_listing(root->listing);
+        free(root);
     }
+    else if(split_search_path(path, query, &name) == 1)
+        release_search_results((search_results *)(uintptr_t)fi->fh);
     else
-        num_names = get_photo_names(path + 1, &names); /* Get the names of photos in the photoset */
+        release_photo_listing((photo_listing *)(uintptr_t)fi->fh);
+    return SUCCESS;
+}
 
-    if(num_names > 0)
-        prime_photo_size_cache(path + 1, names, num_names);
+/*
+ * Fills in the photos of a listing, numbered from pos + 1, skipping those
+ * before offset. Photos are primed a batch at a time so only the part of
+ * the listing the kernel has room for is stat'd. Returns non-zero once the
+ * buffer is full.
+ */
+static int fill_listing(void *buf, fuse_fill_dir_t filler, const photo_listing *listing,
+  const char *photoset, off_t pos, off_t offset, int plus) {
+    const char *batch[READDIR_BATCH];
+    struct stat stats[READDIR_BATCH];
+    unsigned int i, j, n;
+
+    for(i = (offset > pos) ? (unsigned int)(offset - pos) : 0; i < listing->count; i += n) {
+        n = listing->count - i;
+        if(n > READDIR_BATCH)
+            n = READDIR_BATCH;
+
+        for(j = 0; j < n; j++)
+            batch[j] = listing->entries[i + j].name;
+
+        memset(stats, 0, n * sizeof(struct stat));
+        prime_photo_size_cache(photoset, batch, n, plus ? stats : NULL);
+
+        for(j = 0; j < n; j++) {
+            off_t next = pos + i + j + 1;
+            int full;
+
+            if(plus && stats[j].st_mode)
+                full = filler(buf, batch[j], &stats[j], next, FUSE_FILL_DIR_PLUS);
+            else
+                full = filler(buf, batch[j], NULL, next, 0);
+
+            if(full)
+                return 1;
+        }
+    }
 
-    for(i = 0; i < num_names; i++) {
-        filler(buf, names[i], NULL, 0);
+    return 0;
+}
+
+/* Lists the years, or the months of a year, in the date tree. */
+static int fill_date_names(void *buf, fuse_fill_dir_t filler, const char *prefix,
+  off_t pos, off_t offset) {
+    char **names;
+    unsigned int num_names, i;
+    int full = 0;
+
+    num_names = get_date_names(prefix, &names);
+    for(i = 0; i < num_names; i++, pos++) {
+        if(!full && pos >= offset)
+            full = filler(buf, names[i], NULL, pos + 1, 0);
         free(names[i]);
     }
-    free(names);
+    if(num_names > 0)
+        free(names);
+
+    return full;
+}
+
+/*
+ * Read directory. Entries are numbered ".", "..", the stats directory,
+ * the date and search trees and the photosets (only in the root) and then
+ * the photos in listing order.
+ * offset is the number of entries already returned, so a directory read
+ * in several calls is streamed from the listing, and in the root the
+ * photoset names, kept open in fi->fh instead of being rebuilt. When the
+ * kernel asks for readdirplus, the attributes of every entry are returned
+ * along with the names so listing a directory does not need a getattr for
+ * each entry.
+ */
+static int fms_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+  off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+    photo_listing *listing = (photo_listing *)(uintptr_t)fi->fh;
+    char shard[DATE_SHARD_SIZE];
+    char query[strlen(path) + 1];
+    const char *photo;
+    unsigned int i;
+    int plus = flags & FUSE_READDIR_PLUS;
+    int full = 0;
+    int depth;
+    off_t pos = 2;  /* Entries before the photosets */
+
+    if(offset < 1 && filler(buf, ".", NULL, 1, 0))
+        return SUCCESS;
+    if(offset < 2 && filler(buf, "..", NULL, 2, 0))
+        return SUCCESS;
+
+    if((depth = split_date_path(path, shard, &photo)) != FAIL) {
+        if(depth == 0)
+            fill_date_names(buf, filler, "", pos, offset);
+        else if(depth == 1)
+            fill_date_names(buf, filler, shard, pos, offset);
+        else if(listing)
+            fill_listing(buf, filler, listing, "", pos, offset, plus);
+        return SUCCESS;
+    }
+
+    if(split_search_path(path, query, &photo) == 1 && fi->fh) {
+        search_results *results = (search_results *)(uintptr_t)fi->fh;
+
+        for(i = (offset > pos) ? (unsigned int)(offset - pos) : 0; i < results->count; i++)
+            if(filler(buf, results->entries[i].name, NULL, pos + i + 1, 0))
+                break;
+        return SUCCESS;
+    }
+
+    if(split_stats_path(path, &photo) != FAIL) {
+        if(pos >= offset && filler(buf, STATS_FILE, NULL, pos + 1, 0))
+            return SUCCESS;
+        if(pos + 1 >= offset)
+            filler(buf, LATENCY_FILE, NULL, pos + 2, 0);
+        return SUCCESS;
+    }
+
+    if(!strcmp(path, "/")) {                      /* Path is to mounted directory */
+        root_dir *root = (root_dir *)(uintptr_t)fi->fh;
+
+        listing = root->listing;
+        if(pos >= offset && filler(buf, STATS_DIR, NULL, pos + 1, 0))
+            return SUCCESS;
+        pos++;
+
+        if(options.by_date) {
+            if(pos >= offset && filler(buf, BY_DATE_DIR, NULL, pos + 1, 0))
+                return SUCCESS;
+            pos++;
+        }
+        if(options.search) {
+            if(pos >= offset && filler(buf, SEARCH_DIR, NULL, pos + 1, 0))
+                return SUCCESS;
+            pos++;
+        }
+
+        /* Report photoset names, from the first one the kernel doesn't have yet */
+        for(i = (offset > pos) ? (unsigned int)(offset - pos) : 0; i < root->num_names; i++) {
+            cached_information *ci;
+            struct stat st;
+
+            if(plus && (ci = photoset_lookup(root->names[i]))) {
+                memset(&st, 0, sizeof(struct stat));
+                set_stbuf_ci(&st, S_IFDIR | PERMISSIONS, ci);
+                full = filler(buf, root->names[i], &st, pos + i + 1, FUSE_FILL_DIR_PLUS);
+                free_cached_info(ci);
+            }
+            else
+                full = filler(buf, root->names[i], NULL, pos + i + 1, 0);
+
+            if(full)
+                return SUCCESS;
+        }
+        pos += root->num_names;
+    }
+
+    /* Photos without a photoset are in the root listing */
+    if(listing)
+        fill_listing(buf, filler, listing, path + 1, pos, offset, plus);
 
     return SUCCESS;
 }
 
-static int fms_rename(const char *old_path, const char *new_path) {
-    char *old_photo;
-    char *old_photoset;
-    char *new_photo;
-    char *new_photoset;
+static int fms_rename(const char *old_path, const char *new_path, unsigned int flags) {
+    const char *old_photo;
+    const char *new_photo;
+    char old_photoset[strlen(old_path) + 1];
+    char new_photoset[strlen(new_path) + 1];
 
-    if(get_photoset_photo_from_path(old_path, &old_photoset, &old_photo))
+    if(flags)   /* RENAME_EXCHANGE and RENAME_NOREPLACE are not supported */
+        return -EINVAL;
+
+    if(is_virtual_path(old_path) || is_virtual_path(new_path))
+        return -EROFS;
+
+    if(split_path(old_path, old_photoset, &old_photo))
         return FAIL;
 
-    if(get_photoset_photo_from_path(new_path, &new_photoset, &new_photo))
+    if(split_path(new_path, new_photoset, &new_photo))
         return FAIL;
 
     if(strcmp(old_photo, new_photo)) {
@@ -335,20 +1083,14 @@ static int fms_rename(const char *old_path, const char *new_path) {
             if(set_photoset_name(old_path + 1, new_path + 1))
                 return FAIL;
         }
-        else {
-            free(old_photo);
-            old_photo = strdup(new_photo);
-        }
+        else
+            old_photo = new_photo;
     }
 
     if(strcmp(old_photoset, new_photoset))
         if(set_photo_photoset(old_photoset, old_photo, new_photoset))
             return FAIL;
 
-    free(old_photo);
-    free(old_photoset);
-    free(new_photo);
-    free(new_photoset);
     return SUCCESS;
 }
 
@@ -359,35 +1101,129 @@ static inline void set_photoset_tmp_dir(char *dir_path, const char *tmp_path,
     strcat(dir_path, photoset);
 }
 
+/*
+ * Downloads the photo into the directory keyed by Flickr id and hardlinks it
+ * into place at path. A photo that belongs to several photosets is then only
+ * downloaded and stored once. A photo opened for writing gets a copy of its
+ * own instead, so the other photosets keep theirs.
+ */
+static int fetch_photo(const char *photoset, const char *photo, const char *uri,
+  const char *path, int writable) {
+    cached_information *ci;
+    char *id_path;
+    int retval = FAIL;
+
+    if(!(ci = photo_lookup(photoset, photo)) || !strcmp(ci->id, "")) {
+        free_cached_info(ci);
+        return backend_fetch(uri, path);
+    }
+
+    id_path = (char *)malloc(strlen(tmp_path) + strlen(ID_DIR_NAME) + strlen(ci->id) + 3);
+    if(id_path) {
+        strcpy(id_path, tmp_path);
+        strcat(id_path, "/");
+        strcat(id_path, ID_DIR_NAME);
+        mkdir(id_path, PERMISSIONS);        /* Create id temp directory if it doesn't exist */
+
+        strcat(id_path, "/");
+        strcat(id_path, ci->id);
+
+        if(!access(id_path, F_OK) || backend_fetch(uri, id_path) == SUCCESS)
+            retval = writable ? copy_file(id_path, path) : link(id_path, path);
+
+        free(id_path);
+    }
+
+    free_cached_info(ci);
+    return retval;
+}
+
 static int fms_open(const char *path, struct fuse_file_info *fi) {
-    char *photo;
-    char *photoset;
+    const char *photo;
+    char photoset[strlen(path) + 1];
+    char shard[DATE_SHARD_SIZE];
+    char root_path[strlen(path) + 1];
     char *uri;
     char *wget_path;
-    int fd;
+    file_handle *fh;
+    int fd, depth;
+    int writable = (fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC);
     struct stat st_buf;
+    uint64_t start;
+
+    #define RET(ret) free(wget_path); free(uri); return ret;
 
-    #define RET(ret) free(wget_path); free(uri); free(photo); free(photoset); return ret;
+    if((depth = split_stats_path(path, &photo)) != FAIL) {
+        if(depth == 0 || !is_stats_file(photo))
+            return -ENOENT;
+        if((fi->flags & O_ACCMODE) != O_RDONLY)
+            return -EACCES;
 
-    if(get_photoset_photo_from_path(path, &photoset, &photo))
+        if((fd = open_stats(photo)) < 0)
+            return fd;
+        if(!(fh = new_file_handle(fd, "", photo, CLEAN))) {
+            close(fd);
+            return -ENOMEM;
+        }
+        fi->direct_io = 1;      /* getattr can't know the size */
+        fi->fh = (uint64_t)(uintptr_t)fh;
+        return SUCCESS;
+    }
+
+    /* A photo in the date tree is the photo without a photoset */
+    if(split_date_path(path, shard, &photo) == 3) {
+        if((fi->flags & O_ACCMODE) != O_RDONLY)
+            return -EROFS;  /* The date tree can't be written through */
+        root_path[0] = '/';
+        strcpy(root_path + 1, photo);
+        path = root_path;
+    }
+
+    if(split_path(path, photoset, &photo))
         return FAIL;
 
-    wget_path = (char *)malloc(strlen(tmp_path) + strlen(path) + 1);
-    set_photoset_tmp_dir(wget_path, tmp_path, photoset);
+    if(!(wget_path = (char *)malloc(strlen(tmp_path) + strlen(path) + 1)))
+        return -ENOMEM;
+    strcpy(wget_path, tmp_path);
+    strcat(wget_path, path);
 
     uri = get_photo_uri(photoset, photo);
+
+    /* A photo read lately is served from memory, unless it is due for a refresh */
+    if((fi->flags & O_ACCMODE) == O_RDONLY && (fd = memtier_open(wget_path)) >= 0) {
+        if(!fstat(fd, &st_buf) && (!uri || (time(NULL) - st_buf.st_mtime) <= PHOTO_TIMEOUT)) {
+            if(!(fh = new_file_handle(fd, photoset, photo, CLEAN))) {
+                close(fd);
+                RET(-ENOMEM)
+            }
+            set_photo_size(photoset, photo, (unsigned int)st_buf.st_size);
+            fi->keep_cache = uri ? 1 : 0;
+            fi->fh = (uint64_t)(uintptr_t)fh;
+            RET(SUCCESS)
+        }
+        close(fd);
+        memtier_drop(wget_path);
+    }
+    else if((fi->flags & O_ACCMODE) != O_RDONLY)
+        memtier_drop(wget_path);
+
     if(uri) {
+        set_photoset_tmp_dir(wget_path, tmp_path, photoset);
         mkdir(wget_path, PERMISSIONS);      /* Create photoset temp directory if it doesn't exist */
 
         strcpy(wget_path, tmp_path);
         strcat(wget_path, path);
 
         if(access(wget_path, F_OK)) {
+            stat_inc(STAT_DISK_MISS);
+
             /* Get the image from flickr and put it into the temp dir if it doesn't already exist. */
-            if(wget(uri, wget_path) < 0) {
-                RET(FAIL)
+            if(fetch_photo(photoset, photo, uri, wget_path, writable) < 0) {
+                RET(backend_available() ? FAIL : -EIO)
             }
         }
+        else
+            stat_inc(STAT_DISK_HIT);
     }
     else
     {
@@ -396,48 +1232,99 @@ static int fms_open(const char *path, struct fuse_file_info *fi) {
         strcat(wget_path, path);
     }
 
+    start = latency_now();
     if(stat(wget_path, &st_buf)) {
         RET(FAIL)
     }
+    disk_time(start);
+
+    /* The kernel may keep the pages it cached from an earlier open of a
+     * photo from Flickr, unless it is downloaded again. A photo that can't
+     * be downloaded again is served from the copy already on disk. */
+    fi->keep_cache = uri ? 1 : 0;
 
-    if((time(NULL) - st_buf.st_mtime) > PHOTO_TIMEOUT) {
-        if(uri && wget(uri, wget_path) < 0) {
+    if((time(NULL) - st_buf.st_mtime) > PHOTO_TIMEOUT && uri &&
+      backend_fetch(uri, wget_path) == SUCCESS) {
+        if(stat(wget_path, &st_buf)) {
             RET(FAIL)
         }
+        fi->keep_cache = 0;
+    }
+
+    /* An earlier read may have linked it to the copy the other photosets share */
+    if(writable && unshare_file(wget_path)) {
+        RET(-EIO)
     }
 
+    start = latency_now();
     fd = open(wget_path, fi->flags);
+    disk_time(start);
     if(fd < 0) {
         RET(-errno)
     }
 
-    fi->fh = (uint64_t)fd;
     set_photo_size(photoset, photo, (unsigned int)st_buf.st_size);
 
+    if(!(fh = new_file_handle(fd, photoset, photo, CLEAN))) {
+        close(fd);
+        RET(-ENOMEM)
+    }
+    fi->fh = (uint64_t)(uintptr_t)fh;
+
+    if((fi->flags & O_ACCMODE) == O_RDONLY)
+        memtier_load(wget_path);
+
     RET(SUCCESS)
 }
 
 static int fms_read(const char *path, char *buf, size_t size,
   off_t offset, struct fuse_file_info *fi) {
     (void)path;
-    ssize_t ret = pread((int)fi->fh, buf, size, offset);
+    uint64_t start = latency_now();
+    ssize_t ret = pread(get_file_handle(fi)->fd, buf, size, offset);
+
+    disk_time(start);
     return (ret < 0) ? -errno : (int)ret;
 }
 
+/*
+ * Hands FUSE the cached file itself instead of a copy of its contents, so
+ * the data can be spliced from the page cache straight to the kernel.
+ */
+static int fms_read_buf(const char *path, struct fuse_bufvec **bufp,
+  size_t size, off_t offset, struct fuse_file_info *fi) {
+    (void)path;
+    struct fuse_bufvec *bufv = (struct fuse_bufvec *)malloc(sizeof(struct fuse_bufvec));
+
+    if(!bufv)
+        return -ENOMEM;
+
+    *bufv = FUSE_BUFVEC_INIT(size);
+    bufv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    bufv->buf[0].fd = get_file_handle(fi)->fd;
+    bufv->buf[0].pos = offset;
+
+    *bufp = bufv;
+    return SUCCESS;
+}
+
 static int fms_write(const char *path, const char *buf, size_t size,
   off_t offset, struct fuse_file_info *fi) {
     (void)path;
-    char *photoset, *photo;
+    file_handle *fh = get_file_handle(fi);
+    uint64_t start = latency_now();
     ssize_t ret;
 
-    if(get_photoset_photo_from_path(path, &photoset, &photo))
-        return FAIL;
-
-    set_photo_dirty(photoset, photo, DIRTY);
+    if(fh->dirty == CLEAN) {    /* The copy in memory, if any, is out of date */
+        char *cached_path = get_cached_path(fh->photoset, fh->photo);
 
-    free(photoset);
-    free(photo);
-    ret = pwrite((int)fi->fh, buf, size, offset);
+        if(cached_path)
+            memtier_drop(cached_path);
+        free(cached_path);
+        fh->dirty = DIRTY;
+    }
+    ret = pwrite(fh->fd, buf, size, offset);
+    disk_time(start);
 
     return (ret < 0) ? -errno : (int)ret;
 }
@@ -449,81 +1336,89 @@ static int fms_flush(const char *path, struct fuse_file_info *fi) {
 }
 
 static int fms_release(const char *path, struct fuse_file_info *fi) {
-    (void)fi;
-    char *photoset, *photo;
-    char *temp_scratch_path;  
-
-    if(get_photoset_photo_from_path(path, &photoset, &photo))
-        return FAIL;
-
-    temp_scratch_path = (char *)malloc(strlen(tmp_path) + strlen(path) + 1);
-    strcpy(temp_scratch_path, tmp_path);
-    strcat(temp_scratch_path, path);
+    (void)path;
+    file_handle *fh = get_file_handle(fi);
+    char *temp_scratch_path;
+    int retval = SUCCESS;
 
-    if(get_photo_dirty(photoset, photo) == DIRTY) {
-        MagickWand *mw = NewMagickWand();
+    /* Only a handle that was written to needs to touch the cache. */
+    if(fh->dirty == DIRTY) {
+        set_photo_dirty(fh->photoset, fh->photo, DIRTY);
 
-        if(!mw)
-            return FAIL;
+        /* The handle knows the photo, even if it was opened through the date tree. */
+        temp_scratch_path = get_cached_path(fh->photoset, fh->photo);
 
-        if(MagickPingImage(mw, temp_scratch_path))
-            upload_photo(photoset, photo, temp_scratch_path);
+        /* Lock files and the like that file browsers write are not uploaded */
+        if(temp_scratch_path && sniff_file(temp_scratch_path)) {
+            /* The photo stays dirty, so the next release that wrote to it uploads it again */
+            if(upload_photo(fh->photoset, fh->photo, temp_scratch_path))
+                retval = backend_available() ? -EIO : -EAGAIN;
+        }
 
-        DestroyMagickWand(mw);
+        /* Written photos are likely to be read back */
+        if(temp_scratch_path) {
+            memtier_drop(temp_scratch_path);
+            memtier_load(temp_scratch_path);
+        }
+        free(temp_scratch_path);
     }
 
-    free(temp_scratch_path);
-    free(photoset);
-    free(photo);
-
-    int ret = close((int)fi->fh);
-    return (ret < 0) ? -errno : SUCCESS;
+    if(close(fh->fd) < 0 && retval == SUCCESS)
+        retval = -errno;
+    free_file_handle(fh);
+    return retval;
 }
 
 static int fms_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
     int fd;
-    char *photoset, *photo;
+    char photoset[strlen(path) + 1];
+    const char *photo;
     char *temp_scratch_path;
+    file_handle *fh;
 
-    if(get_photoset_photo_from_path(path, &photoset, &photo))
-        return FAIL;
+    if(is_virtual_path(path))
+        return -EROFS;
 
-    int retval = create_empty_photo(photoset, photo);
-    
-    free(photoset);
-    free(photo);
+    if(split_path(path, photoset, &photo))
+        return FAIL;
 
-    if(retval)
+    if(create_empty_photo(photoset, photo))
         return FAIL;
 
     temp_scratch_path = (char *)malloc(strlen(tmp_path) + strlen(path) + 1);
     strcpy(temp_scratch_path, tmp_path);
     strcat(temp_scratch_path, path);
 
+    /* Truncating a file still linked to a shared copy would empty every photoset's copy */
+    memtier_drop(temp_scratch_path);
+    unlink(temp_scratch_path);
     fd = creat(temp_scratch_path, mode);
-    fi->fh = (uint64_t)fd;
-
     free(temp_scratch_path);
-    return (fd < 0) ? -errno : SUCCESS;
-}
 
-/* Only called after create. For new files. */
-static int fms_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
-    (void)path;
-    int ret = fstat((int)fi->fh, stbuf);
-    return (ret < 0) ? -errno : SUCCESS;
+    if(fd < 0)
+        return -errno;
+
+    /* A new file is uploaded on release even if nothing was written. */
+    if(!(fh = new_file_handle(fd, photoset, photo, DIRTY))) {
+        close(fd);
+        return -ENOMEM;
+    }
+    fi->fh = (uint64_t)(uintptr_t)fh;
+
+    return SUCCESS;
 }
 
 static int fms_mkdir(const char *path, mode_t mode) {
     (void)mode;
     char *temp_scratch_path;
     const char *photoset = path + 1;
-    unsigned short found;
 
-    get_slash_index(photoset, &found);
-    if(found)                           // Can only mkdir on first level
+    if(strchr(photoset, '/'))           // Can only mkdir on first level
         return FAIL;
 
+    if(is_virtual_path(path))
+        return -EROFS;
+
     if(create_empty_photoset(photoset))
         return FAIL;
 
@@ -543,10 +1438,14 @@ int fms_statfs(const char *path, struct statvfs* stbuf) {
     return statvfs(tmp_path, stbuf);
 }
 
-int fms_chmod(const char *path, mode_t mode) {
+int fms_chmod(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    (void)fi;
     char *temp_scratch_path;
     int retval = FAIL;
 
+    if(is_virtual_path(path))
+        return -EROFS;
+
     temp_scratch_path = (char *)malloc(strlen(tmp_path) + strlen(path) + 1);
     strcpy(temp_scratch_path, tmp_path);
     strcat(temp_scratch_path, path);
@@ -558,10 +1457,14 @@ int fms_chmod(const char *path, mode_t mode) {
     return retval;
 }
 
-int fms_chown(const char *path, uid_t uid, gid_t gid) {
+int fms_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi) {
+    (void)fi;
     char *temp_scratch_path;
     int retval = FAIL;
 
+    if(is_virtual_path(path))
+        return -EROFS;
+
     temp_scratch_path = (char *)malloc(strlen(tmp_path) + strlen(path) + 1);
     strcpy(temp_scratch_path, tmp_path);
     strcat(temp_scratch_path, path);
@@ -574,78 +1477,361 @@ int fms_chown(const char *path, uid_t uid, gid_t gid) {
 }
 
 int fms_unlink(const char *path) {
-    char *photoset, *photo;
+    char photoset[strlen(path) + 1];
+    const char *photo;
     char *temp_scratch_path;
     int retval = FAIL;
 
-    if(get_photoset_photo_from_path(path, &photoset, &photo))
+    if(is_virtual_path(path))
+        return -EROFS;
+
+    if(split_path(path, photoset, &photo))
         return FAIL;
 
-    if(remove_photo_from_cache(photoset, photo)) {
-        free(photoset);
-        free(photo);
+    if(remove_photo_from_cache(photoset, photo))
         return FAIL;
-    }
 
     temp_scratch_path = (char *)malloc(strlen(tmp_path) + strlen(path) + 1);
     strcpy(temp_scratch_path, tmp_path);
     strcat(temp_scratch_path, path);
 
+    memtier_drop(temp_scratch_path);
     retval = unlink(temp_scratch_path);
 
     free(temp_scratch_path);
-    free(photoset);
-    free(photo);
 
     return retval;
 }
 
 
+
+/**
+ * Warm-up. With -o warm every photoset is loaded in the background once
+ * mounted, so the first visit to a directory doesn't wait for its photos.
+**/
+
+/* A photoset the warm-up loads on the pool. */
+typedef struct {
+    pool_group *group;
+    const char *photoset;
+} warm_task;
+
+/* Loads the photos of the photoset and, with warm_sizes, their sizes. */
+static void warm_photoset(void *arg) {
+    warm_task *wt = (warm_task *)arg;
+    const char *batch[READDIR_BATCH];
+    photo_listing *listing;
+    unsigned int i, j, n;
+
+    if(load_photoset(wt->photoset)) {
+        if(!backend_available())
+            pool_cancel(wt->group);
+        return;
+    }
+    stat_inc(STAT_WARM_PHOTOSETS);
+
+    if(!options.warm_sizes || !(listing = get_photo_listing(wt->photoset)))
+        return;
+
+    for(i = 0; i < listing->count && !pool_cancelled(wt->group); i += n) {
+        n = listing->count - i;
+        if(n > READDIR_BATCH)
+            n = READDIR_BATCH;
+
+        for(j = 0; j < n; j++)
+            batch[j] = listing->entries[i + j].name;
+        prime_photo_size_cache(wt->photoset, batch, n, NULL);
+        stat_add(STAT_WARM_SIZES, n);
+    }
+    release_photo_listing(listing);
+}
+
+/*
+ * Waits while calls someone is waiting on are running or queued, or the
+ * backend is down. Returns 0 once the warm-up is stopped or the listing
+ * budget is used up. Assumes warm_lock is held.
+ */
+static int warm_may_go_on() {
+    struct timespec ts;
+
+    while(warm_running && (sched_busy(SCHED_PREFETCH) || !backend_available())) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += WARM_POLL_MS * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&warm_cond, &warm_lock, &ts);
+    }
+
+    return warm_running &&
+      (!options.listing_budget || get_cache_memory() < (size_t)options.listing_budget * 1024 * 1024 / WARM_SHARE);
+}
+
+/* Loads the photos not in a photoset, then every photoset, WARM_PARALLEL at a time. */
+static void *warm_thread_run(void *arg) {
+    warm_task tasks[WARM_PARALLEL];
+    char **names;
+    unsigned int num_names, left, i, j, n;
+    (void)arg;
+
+    sched_set_thread_class(SCHED_PREFETCH);
+    num_names = get_photoset_names(&names);
+
+    left = num_names + 1;
+    stat_add(STAT_WARM_LEFT, left);
+
+    for(i = 0; i < num_names + 1; i += n) {
+        pool_group group = { 0 };
+
+        pthread_mutex_lock(&warm_lock);
+        if(!warm_may_go_on()) {
+            pthread_mutex_unlock(&warm_lock);
+            break;
+        }
+        warm_group = &group;
+        pthread_mutex_unlock(&warm_lock);
+
+        n = num_names + 1 - i;
+        if(n > WARM_PARALLEL)
+            n = WARM_PARALLEL;
+
+        for(j = 0; j < n; j++) {
+            tasks[j].group = &group;
+            tasks[j].photoset = (i + j) ? names[i + j - 1] : "";
+            pool_submit(&group, SCHED_PREFETCH, warm_photoset, &tasks[j]);
+        }
+        pool_wait(&group);
+
+        pthread_mutex_lock(&warm_lock);
+        warm_group = NULL;
+        pthread_mutex_unlock(&warm_lock);
+
+        left -= n;
+        stat_add(STAT_WARM_LEFT, -(int64_t)n);
+    }
+    stat_add(STAT_WARM_LEFT, -(int64_t)left);
+
+    for(i = 0; i < num_names; i++)
+        free(names[i]);
+    if(num_names > 0)
+        free(names);
+    return NULL;
+}
+
+static void start_warm() {
+    if(!options.warm)
+        return;
+
+    warm_running = 1;
+    if(pthread_create(&warm_thread, NULL, warm_thread_run, NULL))
+        warm_running = 0;
+}
+
+/* Drops the photosets not loading yet and waits for the rest. */
+static void stop_warm() {
+    if(!warm_running)
+        return;
+
+    pthread_mutex_lock(&warm_lock);
+    warm_running = 0;
+    if(warm_group)
+        pool_cancel(warm_group);
+    pthread_cond_signal(&warm_cond);
+    pthread_mutex_unlock(&warm_lock);
+    pthread_join(warm_thread, NULL);
+}
+
+
+/**
+ * Mounting
+**/
+
+/* Let the kernel splice file data read from our buffers. */
+static void *fms_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+    conn->want |= FUSE_CAP_SPLICE_READ;
+    cfg->use_ino = 1;   /* Inodes come from the Flickr ids. See cache.c */
+
+    start_invalidations(fuse_get_context()->fuse);
+    start_dumps();
+    pool_start(POOL_THREADS);
+    start_warm();
+    return NULL;
+}
+
+static void fms_destroy(void *private_data) {
+    (void)private_data;
+    stop_warm();
+    pool_stop();
+    stop_dumps();
+    stop_invalidations();
+}
+
+
+/**
+ * Timed callbacks. Each one times the fms_ callback of the same name for
+ * the latency histograms and the slow operation log and, with -o trace,
+ * writes it to the trace along with the arguments a replay needs.
+**/
+
+#define TIMED(name, op, params, args, path2, arg0, arg1) \
+static int timed_##name params { \
+    int ret; \
+    latency_begin(op, path); \
+    ret = latency_end(fms_##name args); \
+    if(tracing) \
+        trace_record_op(op, path, path2, arg0, arg1, 0, ret); \
+    return ret; \
+}
+
+#define FI_FLAGS(fi) ((fi) ? (fi)->flags : 0)
+
+TIMED(getattr, LAT_GETATTR, (const char *path, struct stat *stbuf, struct fuse_file_info *fi),
+  (path, stbuf, fi), NULL, fi != NULL, 0)
+TIMED(readlink, LAT_READLINK, (const char *path, char *buf, size_t size), (path, buf, size), NULL, 0, 0)
+TIMED(opendir, LAT_OPENDIR, (const char *path, struct fuse_file_info *fi), (path, fi), NULL, 0, 0)
+TIMED(releasedir, LAT_RELEASEDIR, (const char *path, struct fuse_file_info *fi), (path, fi), NULL, 0, 0)
+TIMED(open, LAT_OPEN, (const char *path, struct fuse_file_info *fi), (path, fi), NULL, FI_FLAGS(fi), 0)
+TIMED(read, LAT_READ, (const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi),
+  (path, buf, size, offset, fi), NULL, offset, (int64_t)size)
+TIMED(read_buf, LAT_READ_BUF, (const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+  struct fuse_file_info *fi), (path, bufp, size, offset, fi), NULL, offset, (int64_t)size)
+TIMED(write, LAT_WRITE, (const char *path, const char *buf, size_t size, off_t offset,
+  struct fuse_file_info *fi), (path, buf, size, offset, fi), NULL, offset, (int64_t)size)
+TIMED(flush, LAT_FLUSH, (const char *path, struct fuse_file_info *fi), (path, fi), NULL, 0, 0)
+TIMED(release, LAT_RELEASE, (const char *path, struct fuse_file_info *fi), (path, fi), NULL, 0, 0)
+TIMED(rename, LAT_RENAME, (const char *path, const char *new_path, unsigned int flags),
+  (path, new_path, flags), new_path, flags, 0)
+TIMED(create, LAT_CREATE, (const char *path, mode_t mode, struct fuse_file_info *fi),
+  (path, mode, fi), NULL, mode, FI_FLAGS(fi))
+TIMED(mkdir, LAT_MKDIR, (const char *path, mode_t mode), (path, mode), NULL, mode, 0)
+TIMED(statfs, LAT_STATFS, (const char *path, struct statvfs *stbuf), (path, stbuf), NULL, 0, 0)
+TIMED(chmod, LAT_CHMOD, (const char *path, mode_t mode, struct fuse_file_info *fi),
+  (path, mode, fi), NULL, mode, 0)
+TIMED(chown, LAT_CHOWN, (const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi),
+  (path, uid, gid, fi), NULL, uid, gid)
+TIMED(unlink, LAT_UNLINK, (const char *path), (path), NULL, 0, 0)
+
+/* Passes entries on to the kernel's filler, counting them for the trace. */
+typedef struct {
+    void *buf;
+    fuse_fill_dir_t filler;
+    int64_t entries;
+} counted_fill;
+
+static int count_filler(void *buf, const char *name, const struct stat *stbuf, off_t off,
+  enum fuse_fill_dir_flags flags) {
+    counted_fill *cf = buf;
+    int full = cf->filler(cf->buf, name, stbuf, off, flags);
+
+    if(!full)
+        cf->entries++;
+    return full;
+}
+
+/* Like TIMED, and records how many entries the kernel took so a replay stops at the same place. */
+static int timed_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+  struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+    counted_fill cf = { buf, filler, 0 };
+    int ret;
+
+    latency_begin(LAT_READDIR, path);
+    if(!tracing)
+        return latency_end(fms_readdir(path, buf, filler, offset, fi, flags));
+
+    ret = latency_end(fms_readdir(path, &cf, count_filler, offset, fi, flags));
+    trace_record_op(LAT_READDIR, path, NULL, offset, flags, cf.entries, ret);
+    return ret;
+}
+
+
 /**
  * Main function
 **/
 
 
 static struct fuse_operations flickrms_oper = {
-    .getattr = fms_getattr,
-    .readdir = fms_readdir,
-    .open = fms_open,
-    .read = fms_read,
-    .write = fms_write,
-    .flush = fms_flush,
-    .release = fms_release,
-    .rename = fms_rename,
-    .create = fms_create,
-    .fgetattr = fms_fgetattr,
-    .mkdir = fms_mkdir,
-    .statfs = fms_statfs,
-    .chmod = fms_chmod,
-    .chown = fms_chown,
-    .unlink = fms_unlink
+    .getattr = timed_getattr,
+    .readlink = timed_readlink,
+    .opendir = timed_opendir,
+    .readdir = timed_readdir,
+    .releasedir = timed_releasedir,
+    .open = timed_open,
+    .read = timed_read,
+    .read_buf = timed_read_buf,
+    .write = timed_write,
+    .flush = timed_flush,
+    .release = timed_release,
+    .rename = timed_rename,
+    .create = timed_create,
+    .mkdir = timed_mkdir,
+    .statfs = timed_statfs,
+    .chmod = timed_chmod,
+    .chown = timed_chown,
+    .unlink = timed_unlink,
+    .init = fms_init,
+    .destroy = fms_destroy
 };
 
 int main(int argc, char *argv[]) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
     int ret;
 
+    options.timeouts = backend_timeout;
+    if(fuse_opt_parse(&args, &options, option_spec, NULL) == -1)
+        return FAIL;
+    backend_timeout = options.timeouts;
+
+    /* Ahead of the user's options so those can override it. */
+    if(fuse_opt_insert_arg(&args, 1, KERNEL_CACHE_TIMEOUT_OPT) == -1)
+        return FAIL;
+
     if((ret = set_user_variables()))
         return ret;
     if((ret = set_tmp_path()) == FAIL)
         return ret;
-    if((ret = flickr_cache_init()))
+    if((ret = backend_init(options.backend ? options.backend : "flickr"))) {
+        fprintf(stderr, "flickrms: could not start backend %s\n", options.backend ? options.backend : "flickr");
         return ret;
-    if((ret = wget_init()))
+    }
+    if((ret = flickr_cache_init()))
         return ret;
 
-    imagemagick_init();
+    openlog("flickrms", LOG_PID, LOG_USER);
+    latency_set_slow(options.slow_ms);
+    if(options.api_quota >= 0)
+        sched_set_quota((unsigned int)options.api_quota);
+    set_listing_budget((size_t)options.listing_budget * 1024 * 1024);
+    memtier_set_budget((size_t)options.memory_budget * 1024 * 1024);
+    if(options.by_date)
+        enable_date_index();
+    if(options.search)
+        enable_search_index();
+    if(options.no_read_buf)
+        flickrms_oper.read_buf = NULL;
+
+    if(options.trace && trace_open(options.trace)) {
+        fprintf(stderr, "flickrms: could not write trace %s\n", options.trace);
+        return FAIL;
+    }
 
-    ret = fuse_main(argc, argv, &flickrms_oper, NULL);
+    if(options.replay) {
+        pool_start(POOL_THREADS);
+        ret = replay_run(options.replay, &flickrms_oper, options.replay_fast);
+        pool_stop();
+        latency_print(stdout);
+    }
+    else
+        ret = fuse_main(args.argc, args.argv, &flickrms_oper, NULL);
+    fuse_opt_free_args(&args);
+    trace_close();
 
+    memtier_clear();
     flickr_cache_kill();
-    wget_destroy();
-    imagemagick_destroy();
+    backend_kill();
 
     if(CLEAN_TMP_DIR_UMOUNT)
         remove_tmp_path();
 
+    closelog();
+
     return ret;
 }
@@ -0,0 +1,368 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "htable.h"
+
+
+#define CTRL_EMPTY      0x80
+#define CTRL_DELETED    0xFE
+
+#define INITIAL_CAPACITY    HTABLE_GROUP
+
+/* Hash bits used to pick the first group and the 7 bit fingerprint. */
+#define H1(hash)        ((size_t)(hash))
+#define H2(hash)        ((uint8_t)((hash) >> 25))
+
+
+/* Keep the table at most 7/8 full. */
+static inline size_t max_load(size_t capacity) {
+    return capacity - capacity / 8;
+}
+
+/**
+ * ===Group Methods===
+ * Each returns a bitmask with bit i set if slot i of the group matches.
+**/
+
+#ifdef __SSE2__
+static inline unsigned int group_match(const uint8_t *ctrl, uint8_t h2) {
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)h2)));
+}
+
+/* EMPTY and DELETED are the only control bytes with the high bit set. */
+static inline unsigned int group_match_free(const uint8_t *ctrl) {
+    return (unsigned int)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+}
+#else
+static inline unsigned int group_match(const uint8_t *ctrl, uint8_t h2) {
+    unsigned int i, mask = 0;
+
+    for(i = 0; i < HTABLE_GROUP; i++)
+        if(ctrl[i] == h2)
+            mask |= 1u << i;
+    return mask;
+}
+
+static inline unsigned int group_match_free(const uint8_t *ctrl) {
+    unsigned int i, mask = 0;
+
+    for(i = 0; i < HTABLE_GROUP; i++)
+        if(ctrl[i] & 0x80)
+            mask |= 1u << i;
+    return mask;
+}
+#endif
+
+static inline unsigned int group_match_empty(const uint8_t *ctrl) {
+    return group_match(ctrl, CTRL_EMPTY);
+}
+
+static inline unsigned int lowest_bit(unsigned int mask) {
+    return (unsigned int)__builtin_ctz(mask);
+}
+
+
+/*
+ * Hashes the key eight bytes at a time. The keys are photo and photoset
+ * names and ids, so most of them are hashed in two or three rounds.
+ */
+uint32_t htable_hash(const char *key) {
+    size_t len = strlen(key);
+    uint64_t h = 0x9E3779B97F4A7C15ULL ^ len;
+    uint64_t word;
+
+    for(; len >= 8; len -= 8, key += 8) {
+        memcpy(&word, key, 8);
+        h = (h ^ word) * 0xBF58476D1CE4E5B9ULL;
+        h ^= h >> 31;
+    }
+
+    word = 0;
+    memcpy(&word, key, len);
+    h = (h ^ word) * 0x94D049BB133111EBULL;
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ULL;
+    h ^= h >> 32;
+
+    return (uint32_t)h;
+}
+
+static int alloc_table(htable *ht, size_t capacity) {
+    if(!(ht->ctrl = (uint8_t *)malloc(capacity)))
+        return FAIL;
+    if(!(ht->slots = (htable_slot *)malloc(capacity * sizeof(htable_slot)))) {
+        free(ht->ctrl);
+        return FAIL;
+    }
+    memset(ht->ctrl, CTRL_EMPTY, capacity);
+    ht->capacity = capacity;
+    ht->growth_left = max_load(capacity) - ht->size;
+    return SUCCESS;
+}
+
+htable *htable_new() {
+    htable *ht = (htable *)calloc(1, sizeof(htable));
+
+    if(!ht)
+        return NULL;
+
+    if(alloc_table(ht, INITIAL_CAPACITY)) {
+        free(ht);
+        return NULL;
+    }
+    return ht;
+}
+
+void htable_destroy(htable *ht) {
+    if(ht) {
+        free(ht->ctrl);
+        free(ht->slots);
+        free(ht);
+    }
+}
+
+/*
+ * Returns the index of the slot holding key or capacity if not found.
+ * Groups are probed triangularly, which visits every group of a power
+ * of two table exactly once.
+ */
+static size_t find_slot(const htable *ht, const char *key, uint32_t hash) {
+    size_t group_mask = ht->capacity / HTABLE_GROUP - 1;
+    size_t group = H1(hash) & group_mask;
+    uint8_t h2 = H2(hash);
+    size_t stride;
+
+    for(stride = 1; stride <= group_mask + 1; stride++) {
+        const uint8_t *ctrl = ht->ctrl + group * HTABLE_GROUP;
+        unsigned int mask = group_match(ctrl, h2);
+
+        while(mask) {
+            size_t i = group * HTABLE_GROUP + lowest_bit(mask);
+            if(ht->slots[i].hash == hash && !strcmp(ht->slots[i].key, key))
+                return i;
+            mask &= mask - 1;
+        }
+
+        if(group_match_empty(ctrl))
+            break;
+
+        group = (group + stride) & group_mask;
+    }
+
+    return ht->capacity;
+}
+
+/* Returns the first EMPTY or DELETED slot on the probe sequence of hash. */
+static size_t find_free_slot(const htable *ht, uint32_t hash) {
+    size_t group_mask = ht->capacity / HTABLE_GROUP - 1;
+    size_t group = H1(hash) & group_mask;
+    size_t stride;
+
+    for(stride = 1; ; stride++) {
+        unsigned int mask = group_match_free(ht->ctrl + group * HTABLE_GROUP);
+
+        if(mask)
+            return group * HTABLE_GROUP + lowest_bit(mask);
+
+        group = (group + stride) & group_mask;
+    }
+}
+
+/*
+ * Puts every live slot back where an insert would put it now, so the
+ * tombstones can be reused without a new table. Live slots are first
+ * marked DELETED and tombstones EMPTY. Each live slot then either stays, if
+ * its new slot is in the same group, moves to an EMPTY slot, or swaps with
+ * a live slot not placed yet, which is placed next.
+ */
+static void rehash_in_place(htable *ht) {
+    htable_slot swap;
+    size_t i, j;
+
+    for(i = 0; i < ht->capacity; i++)
+        ht->ctrl[i] = (ht->ctrl[i] & 0x80) ? CTRL_EMPTY : CTRL_DELETED;
+
+    for(i = 0; i < ht->capacity; i++) {
+        while(ht->ctrl[i] == CTRL_DELETED) {
+            j = find_free_slot(ht, ht->slots[i].hash);
+
+            if(j / HTABLE_GROUP == i / HTABLE_GROUP)
+                ht->ctrl[i] = H2(ht->slots[i].hash);
+            else if(ht->ctrl[j] == CTRL_EMPTY) {
+                ht->ctrl[j] = H2(ht->slots[i].hash);
+                ht->slots[j] = ht->slots[i];
+                ht->ctrl[i] = CTRL_EMPTY;
+            }
+            else {                  /* The slot swapped in is placed next */
+                ht->ctrl[j] = H2(ht->slots[i].hash);
+                swap = ht->slots[j];
+                ht->slots[j] = ht->slots[i];
+                ht->slots[i] = swap;
+            }
+        }
+    }
+
+    ht->growth_left = max_load(ht->capacity) - ht->size;
+}
+
+/*
+ * Moves every live slot into a table sized for twice the live entries. A
+ * table that is already that size, as most of its free slots are
+ * tombstones, is rehashed in place instead.
+ */
+static int resize(htable *ht) {
+    htable old = *ht;
+    size_t capacity = INITIAL_CAPACITY;
+    size_t i;
+
+    while(max_load(capacity) < ht->size * 2)
+        capacity *= 2;
+
+    if(capacity == ht->capacity) {
+        rehash_in_place(ht);
+        return SUCCESS;
+    }
+
+    if(alloc_table(ht, capacity)) {
+        *ht = old;
+        return FAIL;
+    }
+
+    for(i = 0; i < old.capacity; i++) {
+        if(!(old.ctrl[i] & 0x80)) {
+            size_t j = find_free_slot(ht, old.slots[i].hash);
+            ht->ctrl[j] = old.ctrl[i];
+            ht->slots[j] = old.slots[i];
+        }
+    }
+
+    free(old.ctrl);
+    free(old.slots);
+    return SUCCESS;
+}
+
+void *htable_lookup(const htable *ht, const char *key) {
+    size_t i = find_slot(ht, key, htable_hash(key));
+
+    return (i == ht->capacity) ? NULL : ht->slots[i].value;
+}
+
+int htable_lookup_extended(const htable *ht, const char *key, char **orig_key, void **value) {
+    size_t i = find_slot(ht, key, htable_hash(key));
+
+    if(i == ht->capacity)
+        return 0;
+
+    if(orig_key)
+        *orig_key = ht->slots[i].key;
+    if(value)
+        *value = ht->slots[i].value;
+    return 1;
+}
+
+/*
+ * Inserts the key/value pair. If the key already exists only the value is
+ * replaced and the original key is kept.
+ */
+int htable_insert(htable *ht, char *key, void *value) {
+    uint32_t hash = htable_hash(key);
+    size_t i = find_slot(ht, key, hash);
+
+    if(i != ht->capacity) {
+        ht->slots[i].value = value;
+        return SUCCESS;
+    }
+
+    i = find_free_slot(ht, hash);
+    if(ht->ctrl[i] == CTRL_EMPTY && ht->growth_left == 0) {
+        if(resize(ht))
+            return FAIL;
+        i = find_free_slot(ht, hash);
+    }
+
+    if(ht->ctrl[i] == CTRL_EMPTY)
+        ht->growth_left--;
+
+    ht->ctrl[i] = H2(hash);
+    ht->slots[i].hash = hash;
+    ht->slots[i].key = key;
+    ht->slots[i].value = value;
+    ht->size++;
+
+    return SUCCESS;
+}
+
+/*
+ * A slot can go straight back to EMPTY if its group still has an EMPTY
+ * slot, as no probe sequence can have continued past this group.
+ */
+static void erase_slot(htable *ht, size_t i) {
+    const uint8_t *group = ht->ctrl + (i & ~(size_t)(HTABLE_GROUP - 1));
+
+    if(group_match_empty(group)) {
+        ht->ctrl[i] = CTRL_EMPTY;
+        ht->growth_left++;
+    }
+    else
+        ht->ctrl[i] = CTRL_DELETED;
+    ht->size--;
+}
+
+/* Removes the key and returns its value. The key itself is not freed. */
+void *htable_remove(htable *ht, const char *key) {
+    size_t i = find_slot(ht, key, htable_hash(key));
+
+    if(i == ht->capacity)
+        return NULL;
+
+    erase_slot(ht, i);
+    return ht->slots[i].value;
+}
+
+/* Calls func on every entry, removing those for which it returns non-zero. */
+unsigned int htable_foreach_remove(htable *ht, htable_remove_func func, void *user_data) {
+    unsigned int removed = 0;
+    size_t i;
+
+    for(i = 0; i < ht->capacity; i++) {
+        if(!(ht->ctrl[i] & 0x80) && func(ht->slots[i].key, ht->slots[i].value, user_data)) {
+            erase_slot(ht, i);
+            removed++;
+        }
+    }
+    return removed;
+}
+
+unsigned int htable_size(const htable *ht) {
+    return (unsigned int)ht->size;
+}
+
+/* Bytes used by the table itself, not counting keys or values. */
+size_t htable_memory(const htable *ht) {
+    return sizeof(htable) + ht->capacity * (1 + sizeof(htable_slot));
+}
+
+void htable_iter_init(htable_iter *iter, const htable *ht) {
+    iter->ht = ht;
+    iter->pos = 0;
+}
+
+int htable_iter_next(htable_iter *iter, char **key, void **value) {
+    const htable *ht = iter->ht;
+
+    for(; iter->pos < ht->capacity; iter->pos++) {
+        if(!(ht->ctrl[iter->pos] & 0x80)) {
+            if(key)
+                *key = ht->slots[iter->pos].key;
+            if(value)
+                *value = ht->slots[iter->pos].value;
+            iter->pos++;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,55 @@
+#ifndef HTABLE_H
+#define HTABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+/* Slots are probed in groups of this many control bytes at a time. */
+#define HTABLE_GROUP    16
+
+typedef struct {
+    uint32_t hash;          /* Stored so probing and resizing never rehash a key */
+    char *key;
+    void *value;
+} htable_slot;
+
+/*
+ * Open addressing string table. Every slot has a one byte control entry
+ * holding either EMPTY, DELETED or the top 7 bits of the key hash. A lookup
+ * compares a whole group of control bytes against that fingerprint at once
+ * and only touches the slots (and the key strings) that match.
+ *
+ * Like the GHashTable it replaces, the table does not own its keys or values.
+ */
+typedef struct {
+    uint8_t *ctrl;
+    htable_slot *slots;
+    size_t capacity;        /* Number of slots. Power of two, multiple of HTABLE_GROUP */
+    size_t size;            /* Number of live entries */
+    size_t growth_left;     /* Inserts into EMPTY slots left before a resize */
+} htable;
+
+typedef struct {
+    const htable *ht;
+    size_t pos;
+} htable_iter;
+
+/* Return non-zero to remove the entry from the table. */
+typedef int (*htable_remove_func)(char *key, void *value, void *user_data);
+
+htable *htable_new();
+void htable_destroy(htable *ht);
+uint32_t htable_hash(const char *key);
+void *htable_lookup(const htable *ht, const char *key);
+int htable_lookup_extended(const htable *ht, const char *key, char **orig_key, void **value);
+int htable_insert(htable *ht, char *key, void *value);
+void *htable_remove(htable *ht, const char *key);
+unsigned int htable_foreach_remove(htable *ht, htable_remove_func func, void *user_data);
+unsigned int htable_size(const htable *ht);
+size_t htable_memory(const htable *ht);
+void htable_iter_init(htable_iter *iter, const htable *ht);
+int htable_iter_next(htable_iter *iter, char **key, void **value);
+
+#endif
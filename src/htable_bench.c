@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include <glib.h>
+
+#include "htable.h"
+
+
+/*
+ * Compares htable with the GHashTable the cache used before it: insert
+ * time, lookups per second for keys that are there and keys that are not,
+ * and the bytes the table itself takes, not counting its keys. Both tables
+ * are given the same keys, named like photos. Each result is printed as a
+ * JSON line.
+ *
+ *   htable_bench [entries[,entries...]]
+ */
+
+#define DEFAULT_COUNTS      "1000,100000,1000000"
+#define MIN_LOOKUPS         4000000     /* Small tables are looked up more than once per key */
+#define KEY_SIZE            32
+
+typedef struct {
+    const char *name;
+    void *(*create)();
+    void (*destroy)(void *table);
+    void (*insert)(void *table, char *key, void *value);
+    int (*lookup)(void *table, const char *key);
+} bench_table;
+
+
+static void *ht_create() { return htable_new(); }
+static void ht_destroy(void *table) { htable_destroy((htable *)table); }
+static void ht_insert(void *table, char *key, void *value) { htable_insert((htable *)table, key, value); }
+static int ht_lookup(void *table, const char *key) { return htable_lookup((htable *)table, key) != NULL; }
+
+static void *gh_create() { return g_hash_table_new(g_str_hash, g_str_equal); }
+static void gh_destroy(void *table) { g_hash_table_destroy((GHashTable *)table); }
+static void gh_insert(void *table, char *key, void *value) { g_hash_table_insert((GHashTable *)table, key, value); }
+static int gh_lookup(void *table, const char *key) { return g_hash_table_lookup((GHashTable *)table, key) != NULL; }
+
+static const bench_table tables[] = {
+    { "htable", ht_create, ht_destroy, ht_insert, ht_lookup },
+    { "ghashtable", gh_create, gh_destroy, gh_insert, gh_lookup }
+};
+
+
+static double now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static size_t heap_bytes() {
+    struct mallinfo2 mi = mallinfo2();
+
+    return mi.uordblks + mi.hblkhd;   /* Large arrays are mapped apart from the heap */
+}
+
+/* Keys in a random order, so lookups don't walk the table in insert order. */
+static char **make_keys(unsigned int count, const char *format) {
+    char **keys = (char **)malloc(count * sizeof(char *));
+    unsigned int i, j;
+    char *swap;
+
+    if(!keys)
+        return NULL;
+
+    for(i = 0; i < count; i++) {
+        keys[i] = (char *)malloc(KEY_SIZE);
+        snprintf(keys[i], KEY_SIZE, format, i);
+    }
+    for(i = count - 1; i > 0; i--) {
+        j = (unsigned int)rand() % (i + 1);
+        swap = keys[i];
+        keys[i] = keys[j];
+        keys[j] = swap;
+    }
+    return keys;
+}
+
+static void free_keys(char **keys, unsigned int count) {
+    unsigned int i;
+
+    for(i = 0; i < count; i++)
+        free(keys[i]);
+    free(keys);
+}
+
+/* Returns lookups per second over count keys, looked up lookups times in all. */
+static double time_lookups(const bench_table *bt, void *table, char **keys, unsigned int count,
+  unsigned long lookups, unsigned long *found) {
+    unsigned long i;
+    double start = now();
+
+    for(i = 0; i < lookups; i++)
+        *found += (unsigned long)bt->lookup(table, keys[i % count]);
+    return (double)lookups / (now() - start);
+}
+
+static void bench(const bench_table *bt, unsigned int count) {
+    char **keys = make_keys(count, "IMG_%07u.jpg");
+    char **missing = make_keys(count, "DSC_%07u.jpg");
+    unsigned long lookups = (count < MIN_LOOKUPS) ? MIN_LOOKUPS : count;
+    unsigned long found = 0;
+    double start, insert, hits, misses;
+    size_t before, bytes;
+    unsigned int i;
+    void *table;
+
+    before = heap_bytes();
+    start = now();
+    table = bt->create();
+    for(i = 0; i < count; i++)
+        bt->insert(table, keys[i], &keys[i]);  /* Not the key itself, which GHashTable stores as a set */
+    insert = now() - start;
+    bytes = heap_bytes() - before;
+
+    hits = time_lookups(bt, table, keys, count, lookups, &found);
+    misses = time_lookups(bt, table, missing, count, lookups, &found);
+
+    printf("{\"table\": \"%s\", \"entries\": %u, \"insert_ns\": %.1f, \"hit_mops\": %.2f, "
+      "\"miss_mops\": %.2f, \"bytes_per_entry\": %.1f, \"found\": %lu}\n", bt->name, count,
+      insert * 1e9 / count, hits / 1e6, misses / 1e6, (double)bytes / count, found);
+    fflush(stdout);
+
+    bt->destroy(table);
+    free_keys(keys, count);
+    free_keys(missing, count);
+}
+
+int main(int argc, char *argv[]) {
+    char *counts = strdup((argc > 1) ? argv[1] : DEFAULT_COUNTS);
+    char *count, *save;
+    unsigned int i;
+
+    srand(1);
+    for(count = strtok_r(counts, ",", &save); count; count = strtok_r(NULL, ",", &save))
+        for(i = 0; i < sizeof(tables) / sizeof(tables[0]); i++)
+            bench(&tables[i], (unsigned int)strtoul(count, NULL, 10));
+
+    free(counts);
+    return 0;
+}
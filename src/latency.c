@@ -0,0 +1,262 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/syscall.h>
+
+#include "latency.h"
+
+
+/*
+ * Histograms are log-linear over microseconds: one bucket per microsecond
+ * below LINEAR_BUCKETS, then SUB_BUCKETS buckets for every power of two,
+ * so a bucket is never more than 1/8th wider than the values it holds.
+ */
+#define LINEAR_BITS     4
+#define LINEAR_BUCKETS  (1 << LINEAR_BITS)
+#define SUB_BITS        3
+#define SUB_BUCKETS     (1 << SUB_BITS)
+#define MAX_BITS        40              /* 2^40us is about 12 days */
+#define HIST_BUCKETS    (LINEAR_BUCKETS + (MAX_BITS - LINEAR_BITS) * SUB_BUCKETS)
+
+typedef struct {
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;                       /* In us */
+    uint64_t max;                       /* In us */
+} histogram;
+
+/* The filesystem callback the thread is in. */
+typedef struct {
+    latency_op op;
+    const char *path;
+    uint64_t start;
+    uint64_t duration;                  /* In ns, set by latency_end */
+    uint64_t phases[PHASE_COUNT];       /* In ns */
+    unsigned short active;
+} operation;
+
+static histogram histograms[LAT_COUNT];
+static __thread operation current;
+static __thread uint64_t *sink;         /* Where phases go on a thread outside any callback */
+static uint64_t slow_ns;                /* 0 disables the slow operation log */
+
+static const char *latency_names[LAT_COUNT] = {
+    "getattr",
+    "readlink",
+    "opendir",
+    "readdir",
+    "releasedir",
+    "open",
+    "read",
+    "read_buf",
+    "write",
+    "flush",
+    "release",
+    "rename",
+    "create",
+    "mkdir",
+    "statfs",
+    "chmod",
+    "chown",
+    "unlink",
+
+    "api_get_photosets",
+    "api_get_photos",
+    "api_fetch",
+    "api_content_length",
+    "api_upload",
+    "api_set_photo_title",
+    "api_set_photoset_title",
+    "api_create_photoset",
+    "api_add_photo",
+    "api_remove_photo",
+    "api_delete_photo",
+
+    "wget",
+    "head",
+    "first_byte"
+};
+
+static const char *phase_names[PHASE_COUNT] = { "lock", "queue", "api", "head", "download", "disk" };
+
+
+/* Monotonic time in ns. */
+uint64_t latency_now() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static inline unsigned int bucket_of(uint64_t us) {
+    unsigned int bits;
+
+    if(us < LINEAR_BUCKETS)
+        return (unsigned int)us;
+
+    bits = 63 - (unsigned int)__builtin_clzll(us);     /* The top bit */
+    if(bits >= MAX_BITS)
+        return HIST_BUCKETS - 1;
+
+    return LINEAR_BUCKETS + (bits - LINEAR_BITS) * SUB_BUCKETS +
+      (unsigned int)((us >> (bits - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/* The first value past the bucket, in us. */
+static inline uint64_t bucket_end(unsigned int b) {
+    unsigned int bits, sub;
+
+    if(b < LINEAR_BUCKETS)
+        return b + 1;
+
+    bits = LINEAR_BITS + (b - LINEAR_BUCKETS) / SUB_BUCKETS;
+    sub = (b - LINEAR_BUCKETS) % SUB_BUCKETS;
+    return (uint64_t)(SUB_BUCKETS + sub + 1) << (bits - SUB_BITS);
+}
+
+/* Adds a timing to the histogram of op. Lock free, any thread may call it. */
+void latency_record(latency_op op, uint64_t ns) {
+    histogram *h = &histograms[op];
+    uint64_t us = ns / 1000;
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&h->buckets[bucket_of(us)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, us, __ATOMIC_RELAXED);
+    while(us > max && !__atomic_compare_exchange_n(&h->max, &max, us, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* Starts timing a filesystem callback on path, which must outlive it. */
+void latency_begin(latency_op op, const char *path) {
+    current.op = op;
+    current.path = path;
+    memset(current.phases, 0, sizeof(current.phases));
+    current.active = 1;
+    current.start = latency_now();
+}
+
+/* Finishes the callback started by latency_begin, logging it if it was slow. Returns ret. */
+int latency_end(int ret) {
+    uint64_t ns = latency_now() - current.start;
+    char phases[PHASE_COUNT * 32];
+    size_t len = 0;
+    unsigned int i;
+
+    latency_record(current.op, ns);
+    current.duration = ns;
+    current.active = 0;
+
+    if(!slow_ns || ns < slow_ns)
+        return ret;
+
+    for(i = 0; i < PHASE_COUNT; i++)
+        len += (size_t)snprintf(phases + len, sizeof(phases) - len, " %s=%.1fms",
+          phase_names[i], (double)current.phases[i] / 1e6);
+
+    syslog(LOG_WARNING, "slow %s %s: %.1fms%s thread=%ld ret=%d", latency_names[current.op],
+      current.path ? current.path : "", (double)ns / 1e6, phases, (long)syscall(SYS_gettid), ret);
+    return ret;
+}
+
+/* When the last callback of the thread started and how long it took, in ns. */
+void latency_last(uint64_t *start, uint64_t *ns) {
+    *start = current.start;
+    *ns = current.duration;
+}
+
+/*
+ * Counts time spent in phase against the callback the thread is in, or
+ * else against the phases set with latency_set_sink, if any.
+ */
+void latency_phase_add(latency_phase phase, uint64_t ns) {
+    if(current.active)
+        current.phases[phase] += ns;
+    else if(sink)
+        __atomic_fetch_add(&sink[phase], ns, __ATOMIC_RELAXED);
+}
+
+/*
+ * Phases of a thread working for a callback on another thread are added
+ * to phases, which holds PHASE_COUNT entries and may be shared between
+ * threads. Returns the previous ones. NULL drops them again.
+ */
+uint64_t *latency_set_sink(uint64_t *phases) {
+    uint64_t *previous = sink;
+
+    sink = phases;
+    return previous;
+}
+
+void latency_set_slow(unsigned int ms) {
+    slow_ns = (uint64_t)ms * 1000000;
+}
+
+/* The value, in ms, below which fraction of the timings fall. */
+static double percentile(const histogram *h, uint64_t count, double fraction) {
+    uint64_t rank = (uint64_t)((double)count * fraction), seen = 0;
+    unsigned int b;
+
+    for(b = 0; b < HIST_BUCKETS; b++) {
+        seen += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        if(seen > rank)
+            return (double)bucket_end(b) / 1e3;
+    }
+    return (double)__atomic_load_n(&h->max, __ATOMIC_RELAXED) / 1e3;
+}
+
+/*
+ * The value, in ns, below which fraction of the timings of op fall, or 0
+ * while there are fewer than min_count timings to tell.
+ */
+uint64_t latency_percentile(latency_op op, double fraction, uint64_t min_count) {
+    const histogram *h = &histograms[op];
+    uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+
+    if(count < min_count)
+        return 0;
+    return (uint64_t)(percentile(h, count, fraction) * 1e6);
+}
+
+/* Writes a line for every operation timed so far: count, mean, p50, p90, p99 and max in ms. */
+void latency_print(FILE *out) {
+    unsigned int i;
+
+    fprintf(out, "%-24s %10s %10s %10s %10s %10s %10s\n", "op", "count", "mean", "p50", "p90", "p99", "max");
+    for(i = 0; i < LAT_COUNT; i++) {
+        const histogram *h = &histograms[i];
+        uint64_t count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+
+        if(!count)
+            continue;
+
+        fprintf(out, "%-24s %10llu %10.3f %10.3f %10.3f %10.3f %10.3f\n", latency_names[i],
+          (unsigned long long)count, (double)__atomic_load_n(&h->sum, __ATOMIC_RELAXED) / 1e3 / (double)count,
+          percentile(h, count, 0.5), percentile(h, count, 0.9), percentile(h, count, 0.99),
+          (double)__atomic_load_n(&h->max, __ATOMIC_RELAXED) / 1e3);
+    }
+}
+
+/* Sends latency_print to syslog, a line at a time. */
+void latency_log() {
+    char *text = NULL, *line, *next;
+    size_t size;
+    FILE *out;
+
+    if(!(out = open_memstream(&text, &size)))
+        return;
+    latency_print(out);
+    fclose(out);
+
+    for(line = text; line && *line; line = next) {
+        if((next = strchr(line, '\n')))
+            *next++ = '\0';
+        syslog(LOG_INFO, "%s", line);
+    }
+    free(text);
+}
@@ -0,0 +1,73 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "common.h"
+
+/* Timed operations. Keep latency_names in latency.c in the same order. */
+typedef enum {
+    LAT_GETATTR,                /* Filesystem callbacks */
+    LAT_READLINK,
+    LAT_OPENDIR,
+    LAT_READDIR,
+    LAT_RELEASEDIR,
+    LAT_OPEN,
+    LAT_READ,
+    LAT_READ_BUF,
+    LAT_WRITE,
+    LAT_FLUSH,
+    LAT_RELEASE,
+    LAT_RENAME,
+    LAT_CREATE,
+    LAT_MKDIR,
+    LAT_STATFS,
+    LAT_CHMOD,
+    LAT_CHOWN,
+    LAT_UNLINK,
+
+    LAT_API_GET_PHOTOSETS,      /* Backend calls */
+    LAT_API_GET_PHOTOS,
+    LAT_API_FETCH,
+    LAT_API_CONTENT_LENGTH,
+    LAT_API_UPLOAD,
+    LAT_API_SET_PHOTO_TITLE,
+    LAT_API_SET_PHOTOSET_TITLE,
+    LAT_API_CREATE_PHOTOSET,
+    LAT_API_ADD_PHOTO,
+    LAT_API_REMOVE_PHOTO,
+    LAT_API_DELETE_PHOTO,
+
+    LAT_WGET,                   /* HTTP requests of wget.c */
+    LAT_HEAD,
+    LAT_FIRST_BYTE,             /* Until a download's first byte came */
+
+    LAT_COUNT
+} latency_op;
+
+/* Where the time of a filesystem callback went, for the slow operation log. */
+typedef enum {
+    PHASE_LOCK,                 /* Waiting for the cache lock */
+    PHASE_QUEUE,                /* Waiting for a turn of sched.c */
+    PHASE_API,
+    PHASE_HEAD,
+    PHASE_DOWNLOAD,
+    PHASE_DISK,                 /* Reading and writing the tmp directory */
+
+    PHASE_COUNT
+} latency_phase;
+
+uint64_t latency_now();
+void latency_record(latency_op op, uint64_t ns);
+uint64_t latency_percentile(latency_op op, double fraction, uint64_t min_count);
+void latency_begin(latency_op op, const char *path);
+int latency_end(int ret);
+void latency_last(uint64_t *start, uint64_t *ns);
+void latency_phase_add(latency_phase phase, uint64_t ns);
+uint64_t *latency_set_sink(uint64_t *phases);
+void latency_set_slow(unsigned int ms);
+void latency_print(FILE *out);
+void latency_log();
+
+#endif
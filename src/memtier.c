@@ -0,0 +1,263 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "memtier.h"
+#include "htable.h"
+#include "pool.h"
+#include "stats.h"
+
+
+#define LARGEST_SHARE   4       /* A photo larger than 1/4 of the budget stays on disk */
+
+/* A photo held in a memfd. Entries are kept in order of use, newest first. */
+typedef struct memtier_entry {
+    char *path;
+    int fd;
+    size_t size;
+    struct memtier_entry *newer;
+    struct memtier_entry *older;
+} memtier_entry;
+
+/* A photo being copied in on the pool. */
+typedef struct {
+    char *path;
+    int dropped;                /* The photo changed while it was copied, so the copy may be stale */
+} memtier_load_req;
+
+static pthread_mutex_t tier_lock = PTHREAD_MUTEX_INITIALIZER;
+static htable *entries;
+static htable *loading;         /* Of memtier_load_req, by path */
+static memtier_entry *newest;
+static memtier_entry *oldest;
+static size_t budget;
+static size_t used;
+
+
+/**
+ * Entries, all assuming tier_lock is held
+**/
+
+static void unlink_entry(memtier_entry *e) {
+    if(e->newer)
+        e->newer->older = e->older;
+    else
+        newest = e->older;
+
+    if(e->older)
+        e->older->newer = e->newer;
+    else
+        oldest = e->newer;
+}
+
+static void link_newest(memtier_entry *e) {
+    e->newer = NULL;
+    e->older = newest;
+    if(newest)
+        newest->newer = e;
+    else
+        oldest = e;
+    newest = e;
+}
+
+static void free_entry(memtier_entry *e) {
+    htable_remove(entries, e->path);
+    unlink_entry(e);
+    used -= e->size;
+    stat_add(STAT_MEMORY_BYTES, -(int64_t)e->size);
+
+    close(e->fd);
+    free(e->path);
+    free(e);
+}
+
+/* Drops the least recently used photos until size more bytes fit. */
+static void make_room(size_t size) {
+    while(oldest && used + size > budget)
+        free_entry(oldest);
+}
+
+
+/**
+ * Copying photos in
+**/
+
+/* Copies the file at path into a new memfd, with its mode and times. */
+static int copy_in(const char *path, size_t *size) {
+    struct timespec times[2];
+    struct stat st;
+    off_t offset = 0;
+    ssize_t n;
+    int src, fd = -1;
+
+    if((src = open(path, O_RDONLY)) < 0)
+        return -1;
+
+    if(fstat(src, &st) || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+      (size_t)st.st_size > budget / LARGEST_SHARE)
+        goto fail;
+
+    if((fd = memfd_create("flickrms", MFD_CLOEXEC)) < 0)
+        goto fail;
+
+    while(offset < st.st_size)
+        if((n = sendfile(fd, src, &offset, (size_t)(st.st_size - offset))) <= 0) {
+            close(fd);
+            fd = -1;
+            goto fail;
+        }
+
+    /* fstat of an open photo should tell what it would on disk */
+    times[0] = st.st_atim;
+    times[1] = st.st_mtim;
+    fchmod(fd, st.st_mode & 07777);
+    futimens(fd, times);
+    *size = (size_t)st.st_size;
+
+fail: close(src);
+    return fd;
+}
+
+static void load_task(void *arg) {
+    memtier_load_req *load = (memtier_load_req *)arg;
+    memtier_entry *e = NULL;
+    size_t size = 0;
+    int fd = copy_in(load->path, &size);
+
+    pthread_mutex_lock(&tier_lock);
+    if(loading)
+        htable_remove(loading, load->path);
+    if(fd >= 0 && entries && !load->dropped && !htable_lookup(entries, load->path) &&
+      (e = (memtier_entry *)malloc(sizeof(memtier_entry)))) {
+        e->path = load->path;
+        e->fd = fd;
+        e->size = size;
+        make_room(size);
+        if(htable_insert(entries, e->path, e)) {
+            free(e);
+            e = NULL;
+        }
+        else {
+            link_newest(e);
+            used += size;
+            stat_add(STAT_MEMORY_BYTES, (int64_t)size);
+        }
+    }
+    pthread_mutex_unlock(&tier_lock);
+
+    if(!e) {
+        if(fd >= 0)
+            close(fd);
+        free(load->path);
+    }
+    free(load);
+}
+
+
+/**
+ * The tier
+**/
+
+/* Sets the bytes of photos held in memory. 0 turns the tier off. */
+void memtier_set_budget(size_t bytes) {
+    pthread_mutex_lock(&tier_lock);
+    budget = bytes;
+    if(!entries)
+        entries = htable_new();
+    if(!loading)
+        loading = htable_new();
+    make_room(0);
+    pthread_mutex_unlock(&tier_lock);
+}
+
+/*
+ * Returns a descriptor for the copy of the photo at path held in memory,
+ * or -1 if there is none. The copy stays readable through it after it is
+ * dropped.
+ */
+int memtier_open(const char *path) {
+    memtier_entry *e;
+    int fd = -1;
+
+    if(!budget)
+        return -1;
+
+    pthread_mutex_lock(&tier_lock);
+    if(entries && (e = (memtier_entry *)htable_lookup(entries, path))) {
+        if((fd = dup(e->fd)) >= 0) {
+            unlink_entry(e);
+            link_newest(e);
+        }
+    }
+    pthread_mutex_unlock(&tier_lock);
+
+    stat_inc(fd >= 0 ? STAT_MEMORY_HIT : STAT_MEMORY_MISS);
+    return fd;
+}
+
+/*
+ * Copies the photo at path into memory, unless it is there already or
+ * being copied. The copy is made on the pool, as the lowest class, so the
+ * caller doesn't wait for it.
+ */
+void memtier_load(const char *path) {
+    memtier_load_req *load = NULL;
+
+    if(!budget)
+        return;
+
+    pthread_mutex_lock(&tier_lock);
+    if(entries && loading && !htable_lookup(entries, path) && !htable_lookup(loading, path) &&
+      (load = (memtier_load_req *)malloc(sizeof(memtier_load_req)))) {
+        load->dropped = 0;
+        if(!(load->path = strdup(path)) || htable_insert(loading, load->path, load)) {
+            free(load->path);
+            free(load);
+            load = NULL;
+        }
+    }
+    pthread_mutex_unlock(&tier_lock);
+
+    if(load)
+        pool_submit(NULL, SCHED_PREFETCH, load_task, load);
+}
+
+/*
+ * Forgets the copy of the photo at path, which changed or is gone on disk.
+ * A copy of it being made is thrown away once done.
+ */
+void memtier_drop(const char *path) {
+    memtier_load_req *load;
+    memtier_entry *e;
+
+    if(!budget)
+        return;
+
+    pthread_mutex_lock(&tier_lock);
+    if(entries && (e = (memtier_entry *)htable_lookup(entries, path)))
+        free_entry(e);
+    if(loading && (load = (memtier_load_req *)htable_lookup(loading, path)))
+        load->dropped = 1;
+    pthread_mutex_unlock(&tier_lock);
+}
+
+/* Frees every copy. Nothing may be loading. */
+void memtier_clear() {
+    pthread_mutex_lock(&tier_lock);
+    while(oldest)
+        free_entry(oldest);
+    if(entries)
+        htable_destroy(entries);
+    if(loading)
+        htable_destroy(loading);
+    entries = NULL;
+    loading = NULL;
+    pthread_mutex_unlock(&tier_lock);
+}
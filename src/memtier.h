@@ -0,0 +1,19 @@
+#ifndef MEMTIER_H
+#define MEMTIER_H
+
+#include <stddef.h>
+
+#include "common.h"
+
+/*
+ * Copies of photos in the tmp directory held in memory, by path. The
+ * directory always keeps its own copy, so a photo dropped from memory is
+ * read from disk again.
+ */
+void memtier_set_budget(size_t bytes);
+int memtier_open(const char *path);
+void memtier_load(const char *path);
+void memtier_drop(const char *path);
+void memtier_clear();
+
+#endif
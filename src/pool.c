@@ -0,0 +1,401 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pool.h"
+#include "stats.h"
+
+
+#define MAX_THREADS     64
+#define DEQUE_MIN       64      /* Tasks a deque has room for at first */
+#define PREFETCH_SHARE  2       /* At most 1/2 of the threads run prefetch tasks */
+
+typedef struct {
+    pool_func func;
+    void *arg;
+    pool_group *group;
+    sched_class sched;
+} task;
+
+/* A ring of tasks. The owner takes from the back, thieves from the front. */
+typedef struct {
+    task *tasks;
+    unsigned int front;
+    unsigned int count;
+    unsigned int size;
+} deque;
+
+typedef struct {
+    pthread_mutex_t lock;
+    deque deques[SCHED_CLASSES];
+    pthread_t thread;
+} worker;
+
+static worker workers[MAX_THREADS];
+static unsigned int num_workers;
+static unsigned int next_worker;        /* Where tasks from outside the pool go next */
+static __thread worker *self;           /* The worker of this thread, if it is one */
+
+/*
+ * Sleeping workers and waiters of groups wait on pool_cond for any change.
+ * pool_lock may be taken while a worker lock is held, never the other way.
+ */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int queued[SCHED_CLASSES];
+static unsigned int prefetch_running;
+static unsigned int prefetch_limit;
+static int stopping;
+
+
+/**
+ * Deques, each locked by the lock of its worker
+**/
+
+static int push(deque *d, const task *t) {
+    if(d->count == d->size) {
+        unsigned int size = d->size ? d->size * 2 : DEQUE_MIN, i;
+        task *tasks;
+
+        if(!(tasks = (task *)malloc(size * sizeof(task))))
+            return FAIL;
+
+        for(i = 0; i < d->count; i++)
+            tasks[i] = d->tasks[(d->front + i) % d->size];
+
+        free(d->tasks);
+        d->tasks = tasks;
+        d->front = 0;
+        d->size = size;
+    }
+
+    d->tasks[(d->front + d->count++) % d->size] = *t;
+    return SUCCESS;
+}
+
+static int pop_back(deque *d, task *t) {
+    if(!d->count)
+        return FAIL;
+
+    *t = d->tasks[(d->front + --d->count) % d->size];
+    return SUCCESS;
+}
+
+static int pop_front(deque *d, task *t) {
+    if(!d->count)
+        return FAIL;
+
+    *t = d->tasks[d->front];
+    d->front = (d->front + 1) % d->size;
+    d->count--;
+    return SUCCESS;
+}
+
+/* Takes the first task of the group out of the deque, wherever it is. */
+static int pop_group(deque *d, const pool_group *group, task *t) {
+    unsigned int i;
+
+    for(i = 0; i < d->count; i++)
+        if(d->tasks[(d->front + i) % d->size].group == group)
+            break;
+    if(i == d->count)
+        return FAIL;
+
+    *t = d->tasks[(d->front + i) % d->size];
+    for(d->count--; i < d->count; i++)
+        d->tasks[(d->front + i) % d->size] = d->tasks[(d->front + i + 1) % d->size];
+    return SUCCESS;
+}
+
+
+/**
+ * Workers
+**/
+
+/*
+ * Whether a task of the class may be started. Prefetches are kept to a
+ * share of the threads, as they may sit in sched.c for long. Assumes
+ * pool_lock is held.
+ */
+static inline int may_start(sched_class sched) {
+    return queued[sched] && (sched != SCHED_PREFETCH || prefetch_running < prefetch_limit || stopping);
+}
+
+static int any_to_start() {
+    unsigned int i;
+
+    for(i = 0; i < SCHED_CLASSES; i++)
+        if(may_start((sched_class)i))
+            return 1;
+    return 0;
+}
+
+/* Counts a task taken out of a deque. */
+static void took(const task *t) {
+    pthread_mutex_lock(&pool_lock);
+    queued[t->sched]--;
+    if(t->sched == SCHED_PREFETCH)
+        prefetch_running++;
+    pthread_mutex_unlock(&pool_lock);
+    stat_dec(STAT_TASKS_QUEUED);
+}
+
+/*
+ * Takes the task of the highest class there is: from the back of the
+ * deque of this thread, else from the front of another worker's.
+ */
+static int take(task *t) {
+    unsigned int i, j, start;
+
+    for(i = 0; i < SCHED_CLASSES; i++) {
+        pthread_mutex_lock(&pool_lock);
+        if(!may_start((sched_class)i)) {
+            pthread_mutex_unlock(&pool_lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pool_lock);
+
+        if(self) {
+            pthread_mutex_lock(&self->lock);
+            if(!pop_back(&self->deques[i], t)) {
+                pthread_mutex_unlock(&self->lock);
+                goto taken;
+            }
+            pthread_mutex_unlock(&self->lock);
+        }
+
+        start = self ? (unsigned int)(self - workers) + 1 : 0;
+        for(j = 0; j < num_workers; j++) {
+            worker *w = &workers[(start + j) % num_workers];
+
+            if(w == self)
+                continue;
+
+            pthread_mutex_lock(&w->lock);
+            if(!pop_front(&w->deques[i], t)) {
+                pthread_mutex_unlock(&w->lock);
+                if(self)
+                    stat_inc(STAT_TASKS_STOLEN);
+                goto taken;
+            }
+            pthread_mutex_unlock(&w->lock);
+        }
+    }
+    return FAIL;
+
+taken:
+    took(t);
+    return SUCCESS;
+}
+
+/* Takes a queued task of the group, of any class, from any worker. */
+static int take_group(const pool_group *group, task *t) {
+    unsigned int i, j;
+
+    for(i = 0; i < SCHED_CLASSES; i++)
+        for(j = 0; j < num_workers; j++) {
+            pthread_mutex_lock(&workers[j].lock);
+            if(!pop_group(&workers[j].deques[i], group, t)) {
+                pthread_mutex_unlock(&workers[j].lock);
+                took(t);
+                return SUCCESS;
+            }
+            pthread_mutex_unlock(&workers[j].lock);
+        }
+    return FAIL;
+}
+
+/*
+ * Runs the task, unless its group was cancelled, and counts it done. The
+ * phases it spends outside a callback go to its group.
+ */
+static void run(const task *t) {
+    sched_class previous;
+    uint64_t *sink;
+
+    if(!t->group || !__atomic_load_n(&t->group->cancelled, __ATOMIC_RELAXED)) {
+        previous = sched_set_thread_class(t->sched);
+        sink = latency_set_sink(t->group ? t->group->phases : NULL);
+        t->func(t->arg);
+        latency_set_sink(sink);
+        sched_set_thread_class(previous);
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    if(t->sched == SCHED_PREFETCH)
+        prefetch_running--;
+    if(t->group)
+        t->group->pending--;    /* The group may be gone once pool_lock is let go */
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/* Runs a task that was never queued, on the thread submitting it. */
+static void run_here(const task *t) {
+    if(t->sched == SCHED_PREFETCH) {
+        pthread_mutex_lock(&pool_lock);
+        prefetch_running++;
+        pthread_mutex_unlock(&pool_lock);
+    }
+    run(t);
+}
+
+static void *worker_run(void *arg) {
+    task t;
+
+    self = (worker *)arg;
+    for(;;) {
+        if(!take(&t)) {
+            run(&t);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool_lock);
+        if(stopping && !any_to_start()) {
+            pthread_mutex_unlock(&pool_lock);
+            break;
+        }
+        if(!any_to_start())
+            pthread_cond_wait(&pool_cond, &pool_lock);
+        pthread_mutex_unlock(&pool_lock);
+    }
+    return NULL;
+}
+
+
+/**
+ * The pool
+**/
+
+/*
+ * Starts the threads of the pool. Until it is started, and after it is
+ * stopped, tasks run on the thread submitting them.
+ */
+int pool_start(unsigned int threads) {
+    unsigned int i;
+
+    if(threads > MAX_THREADS)
+        threads = MAX_THREADS;
+
+    stopping = 0;
+    prefetch_limit = threads;
+
+    for(i = 0; i < threads; i++) {
+        memset(&workers[i], 0, sizeof(worker));
+        pthread_mutex_init(&workers[i].lock, NULL);
+    }
+
+    for(i = 0; i < threads; i++) {
+        if(pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]))
+            break;
+        num_workers++;
+    }
+
+    if(!num_workers)
+        return FAIL;
+
+    pthread_mutex_lock(&pool_lock);
+    prefetch_limit = (num_workers + PREFETCH_SHARE - 1) / PREFETCH_SHARE;
+    pthread_mutex_unlock(&pool_lock);
+    return SUCCESS;
+}
+
+/* Runs the tasks still queued, then ends the threads. */
+void pool_stop() {
+    unsigned int i, j, count = num_workers;
+
+    if(!count)
+        return;
+
+    pthread_mutex_lock(&pool_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+
+    for(i = 0; i < count; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    num_workers = 0;
+    for(i = 0; i < count; i++) {
+        for(j = 0; j < SCHED_CLASSES; j++)
+            free(workers[i].deques[j].tasks);
+        pthread_mutex_destroy(&workers[i].lock);
+    }
+}
+
+/*
+ * Queues func(arg) as a task of the class, on the deque of this thread if
+ * it is a worker. Its backend calls are kept at the class or below, and
+ * never above the class of the thread submitting it. The task runs right
+ * away on this thread if it can't be queued.
+ */
+void pool_submit(pool_group *group, sched_class sched, pool_func func, void *arg) {
+    task t = { func, arg, group, sched };
+    worker *w = self;
+    int pushed;
+
+    if(t.sched < sched_thread_class())
+        t.sched = sched = sched_thread_class();
+
+    if(group) {
+        pthread_mutex_lock(&pool_lock);
+        group->pending++;
+        pthread_mutex_unlock(&pool_lock);
+    }
+
+    if(!num_workers || stopping) {
+        run_here(&t);
+        return;
+    }
+
+    if(!w)
+        w = &workers[__atomic_fetch_add(&next_worker, 1, __ATOMIC_RELAXED) % num_workers];
+
+    /* Counted before the worker lock is let go, so no thread can take it and count it out first */
+    pthread_mutex_lock(&w->lock);
+    if(!(pushed = push(&w->deques[sched], &t))) {
+        stat_inc(STAT_TASKS_QUEUED);
+        pthread_mutex_lock(&pool_lock);
+        queued[sched]++;
+        pthread_cond_broadcast(&pool_cond);
+        pthread_mutex_unlock(&pool_lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    if(pushed)
+        run_here(&t);
+}
+
+/*
+ * Waits until every task of the group ran or was dropped, running those
+ * still queued itself. The waiter may hold a lock every worker is stuck
+ * on, such as the cache lock, so it can't count on them. The phases of
+ * the tasks are then added to the waiter's.
+ */
+void pool_wait(pool_group *group) {
+    unsigned int i;
+    task t;
+
+    while(!take_group(group, &t))
+        run(&t);
+
+    pthread_mutex_lock(&pool_lock);
+    while(group->pending)
+        pthread_cond_wait(&pool_cond, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+
+    for(i = 0; i < PHASE_COUNT; i++) {
+        if(group->phases[i])
+            latency_phase_add((latency_phase)i, group->phases[i]);
+        group->phases[i] = 0;
+    }
+}
+
+/* Drops the tasks of the group that did not start yet. */
+void pool_cancel(pool_group *group) {
+    __atomic_store_n(&group->cancelled, 1, __ATOMIC_RELAXED);
+}
+
+int pool_cancelled(pool_group *group) {
+    return __atomic_load_n(&group->cancelled, __ATOMIC_RELAXED);
+}
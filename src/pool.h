@@ -0,0 +1,32 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdint.h>
+
+#include "common.h"
+#include "latency.h"
+#include "sched.h"
+
+typedef void (*pool_func)(void *arg);
+
+/*
+ * Tasks submitted together, to be waited for or cancelled together. Zero
+ * it before the first task. Tasks of a cancelled group that did not start
+ * yet are dropped, and those running can check pool_cancelled. The time
+ * its tasks spend in each latency phase is counted against the callback
+ * that waits for it.
+ */
+typedef struct {
+    unsigned int pending;       /* Tasks not yet run or dropped */
+    int cancelled;
+    uint64_t phases[PHASE_COUNT];   /* In ns, summed over the tasks until pool_wait */
+} pool_group;
+
+int pool_start(unsigned int threads);
+void pool_stop();
+void pool_submit(pool_group *group, sched_class sched, pool_func func, void *arg);
+void pool_wait(pool_group *group);
+void pool_cancel(pool_group *group);
+int pool_cancelled(pool_group *group);
+
+#endif
@@ -0,0 +1,382 @@
+#define FUSE_USE_VERSION 31
+#define _GNU_SOURCE
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "replay.h"
+#include "trace.h"
+
+
+#define REPLAY_THREADS      64      /* Recorded threads past this many share a replay thread */
+#define REPLAY_HANDLES      64      /* Files and directories a replay thread keeps open */
+
+/* A trace_record read back, with its paths. */
+typedef struct {
+    trace_record rec;
+    char *path;
+    char *path2;
+} replay_op;
+
+/* A file or directory opened by a replay thread. */
+typedef struct {
+    char *path;
+    struct fuse_file_info fi;
+    unsigned short dir;
+} replay_handle;
+
+/*
+ * Replays the operations of some of the recorded threads. Handles are kept
+ * per replay thread, so a read recorded on another thread than its open
+ * opens the file again instead of sharing the handle.
+ */
+typedef struct {
+    pthread_t thread;
+    replay_op **ops;
+    unsigned int count;
+    unsigned int capacity;
+    replay_handle handles[REPLAY_HANDLES];
+    unsigned int num_handles;
+} replay_thread;
+
+typedef struct {
+    void *buf;
+    int64_t left;                   /* Entries the kernel took in the recording */
+} replay_fill;
+
+static const struct fuse_operations *replay_ops;
+static uint64_t replay_start;
+static int replay_fast;
+
+
+static char *read_path(FILE *in, uint16_t len) {
+    char *path = (char *)malloc((size_t)len + 1);
+
+    if(!path)
+        return NULL;
+    if(len && fread(path, 1, len, in) != len) {
+        free(path);
+        return NULL;
+    }
+    path[len] = '\0';
+    return path;
+}
+
+/* Reads every record of the trace. Returns the number read or -1. */
+static long read_trace(const char *path, replay_op **ops) {
+    trace_header header;
+    size_t count = 0, capacity = 1024;
+    FILE *in;
+
+    if(!(in = fopen(path, "rb")))
+        return -1;
+
+    if(fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) ||
+      header.version != TRACE_VERSION || header.record_size != sizeof(trace_record))
+        goto fail;
+
+    if(!(*ops = (replay_op *)malloc(capacity * sizeof(replay_op))))
+        goto fail;
+
+    for(;;) {
+        replay_op *op;
+
+        if(count == capacity) {
+            replay_op *more = (replay_op *)realloc(*ops, capacity * 2 * sizeof(replay_op));
+
+            if(!more)
+                break;
+            *ops = more;
+            capacity *= 2;
+        }
+
+        op = &(*ops)[count];
+        if(fread(&op->rec, sizeof(trace_record), 1, in) != 1)
+            break;
+        if(op->rec.op >= LAT_COUNT || !(op->path = read_path(in, op->rec.path_len)))
+            break;
+        if(!(op->path2 = op->rec.path2_len ? read_path(in, op->rec.path2_len) : NULL) && op->rec.path2_len) {
+            free(op->path);
+            break;
+        }
+        count++;
+    }
+
+    fclose(in);
+    return (long)count;
+
+fail:
+    fclose(in);
+    return -1;
+}
+
+static int compare_ops(const void *a, const void *b) {
+    uint64_t ta = (*(replay_op * const *)a)->rec.time;
+    uint64_t tb = (*(replay_op * const *)b)->rec.time;
+
+    return (ta > tb) - (ta < tb);
+}
+
+static replay_handle *find_handle(replay_thread *rt, const char *path, unsigned short dir) {
+    unsigned int i;
+
+    for(i = rt->num_handles; i-- > 0;)
+        if(rt->handles[i].dir == dir && !strcmp(rt->handles[i].path, path))
+            return &rt->handles[i];
+    return NULL;
+}
+
+static void close_handle(replay_thread *rt, replay_handle *h) {
+    if(h->dir)
+        replay_ops->releasedir(h->path, &h->fi);
+    else
+        replay_ops->release(h->path, &h->fi);
+
+    free(h->path);
+    *h = rt->handles[--rt->num_handles];
+}
+
+/* Opens path like the recorded open or opendir did. Returns NULL if that failed. */
+static replay_handle *open_handle(replay_thread *rt, const char *path, unsigned short dir, int flags,
+  mode_t mode, int create) {
+    replay_handle *h;
+    int ret;
+
+    if(rt->num_handles == REPLAY_HANDLES)
+        close_handle(rt, &rt->handles[0]);
+
+    h = &rt->handles[rt->num_handles];
+    memset(h, 0, sizeof(replay_handle));
+    h->fi.flags = flags;
+    h->dir = dir;
+
+    if(dir)
+        ret = replay_ops->opendir(path, &h->fi);
+    else if(create)
+        ret = replay_ops->create(path, mode, &h->fi);
+    else
+        ret = replay_ops->open(path, &h->fi);
+
+    if(ret || !(h->path = strdup(path)))
+        return NULL;
+
+    rt->num_handles++;
+    return h;
+}
+
+static replay_handle *get_handle(replay_thread *rt, const char *path, unsigned short dir, int flags) {
+    replay_handle *h = find_handle(rt, path, dir);
+
+    return h ? h : open_handle(rt, path, dir, flags, 0, 0);
+}
+
+/* Takes as many entries as the kernel did when the trace was recorded. */
+static int replay_filler(void *buf, const char *name, const struct stat *stbuf, off_t off,
+  enum fuse_fill_dir_flags flags) {
+    replay_fill *rf = buf;
+    (void)name;
+    (void)stbuf;
+    (void)off;
+    (void)flags;
+
+    return rf->left-- <= 0;
+}
+
+static void replay_one(replay_thread *rt, const replay_op *op) {
+    const trace_record *rec = &op->rec;
+    replay_handle *h;
+    struct stat st;
+    struct statvfs sv;
+    replay_fill rf;
+    char link[PATH_MAX];
+    char *buf;
+
+    switch((latency_op)rec->op) {
+    case LAT_GETATTR:
+        h = rec->args[0] ? find_handle(rt, op->path, 0) : NULL;
+        replay_ops->getattr(op->path, &st, h ? &h->fi : NULL);
+        break;
+    case LAT_READLINK:
+        replay_ops->readlink(op->path, link, sizeof(link));
+        break;
+    case LAT_OPENDIR:
+        open_handle(rt, op->path, 1, 0, 0, 0);
+        break;
+    case LAT_READDIR:
+        if((h = get_handle(rt, op->path, 1, 0))) {
+            rf.buf = NULL;
+            rf.left = rec->args[2];
+            replay_ops->readdir(op->path, &rf, replay_filler, (off_t)rec->args[0], &h->fi,
+              (enum fuse_readdir_flags)rec->args[1]);
+        }
+        break;
+    case LAT_RELEASEDIR:
+        if((h = find_handle(rt, op->path, 1)))
+            close_handle(rt, h);
+        break;
+    case LAT_OPEN:
+        if(!rec->ret)
+            open_handle(rt, op->path, 0, (int)rec->args[0], 0, 0);
+        break;
+    case LAT_READ:
+    case LAT_READ_BUF:
+        if((h = get_handle(rt, op->path, 0, O_RDONLY)) && (buf = (char *)malloc((size_t)rec->args[1]))) {
+            replay_ops->read(op->path, buf, (size_t)rec->args[1], (off_t)rec->args[0], &h->fi);
+            free(buf);
+        }
+        break;
+    case LAT_WRITE:
+        if((h = get_handle(rt, op->path, 0, O_WRONLY)) && (buf = (char *)calloc(1, (size_t)rec->args[1]))) {
+            replay_ops->write(op->path, buf, (size_t)rec->args[1], (off_t)rec->args[0], &h->fi);
+            free(buf);
+        }
+        break;
+    case LAT_FLUSH:
+        if((h = find_handle(rt, op->path, 0)))
+            replay_ops->flush(op->path, &h->fi);
+        break;
+    case LAT_RELEASE:
+        if((h = find_handle(rt, op->path, 0)))
+            close_handle(rt, h);
+        break;
+    case LAT_RENAME:
+        replay_ops->rename(op->path, op->path2 ? op->path2 : "", (unsigned int)rec->args[0]);
+        break;
+    case LAT_CREATE:
+        if(!rec->ret)
+            open_handle(rt, op->path, 0, (int)rec->args[1], (mode_t)rec->args[0], 1);
+        break;
+    case LAT_MKDIR:
+        replay_ops->mkdir(op->path, (mode_t)rec->args[0]);
+        break;
+    case LAT_STATFS:
+        replay_ops->statfs(op->path, &sv);
+        break;
+    case LAT_CHMOD:
+        replay_ops->chmod(op->path, (mode_t)rec->args[0], NULL);
+        break;
+    case LAT_CHOWN:
+        replay_ops->chown(op->path, (uid_t)rec->args[0], (gid_t)rec->args[1], NULL);
+        break;
+    case LAT_UNLINK:
+        replay_ops->unlink(op->path);
+        break;
+    default:                        /* Only filesystem callbacks are traced */
+        break;
+    }
+}
+
+static void *replay_thread_run(void *arg) {
+    replay_thread *rt = arg;
+    struct timespec ts;
+    unsigned int i;
+
+    for(i = 0; i < rt->count; i++) {
+        if(!replay_fast) {
+            uint64_t at = replay_start + rt->ops[i]->rec.time;
+
+            ts.tv_sec = (time_t)(at / 1000000000);
+            ts.tv_nsec = (long)(at % 1000000000);
+            while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+        }
+        replay_one(rt, rt->ops[i]);
+    }
+
+    while(rt->num_handles)
+        close_handle(rt, &rt->handles[rt->num_handles - 1]);
+    return NULL;
+}
+
+static int add_op(replay_thread *rt, replay_op *op) {
+    if(rt->count == rt->capacity) {
+        unsigned int capacity = rt->capacity ? rt->capacity * 2 : 256;
+        replay_op **more = (replay_op **)realloc(rt->ops, capacity * sizeof(replay_op *));
+
+        if(!more)
+            return FAIL;
+        rt->ops = more;
+        rt->capacity = capacity;
+    }
+    rt->ops[rt->count++] = op;
+    return SUCCESS;
+}
+
+/*
+ * Runs the filesystem callbacks recorded in the trace at path through ops,
+ * one replay thread per recorded thread. Each callback is started as long
+ * after the replay started as it was after the trace started, or right
+ * away if fast is set. Nothing is mounted; the callbacks drive the cache
+ * and the backend directly.
+ */
+int replay_run(const char *path, const struct fuse_operations *ops, int fast) {
+    replay_thread *threads;
+    replay_op *all = NULL;
+    uint32_t recorded[REPLAY_THREADS];
+    unsigned int num_threads = 0, i, t;
+    long count, n;
+    uint64_t elapsed;
+    int retval = FAIL;
+
+    if((count = read_trace(path, &all)) < 0) {
+        fprintf(stderr, "flickrms: could not read trace %s\n", path);
+        return FAIL;
+    }
+
+    if(!(threads = (replay_thread *)calloc(REPLAY_THREADS, sizeof(replay_thread)))) {
+        free(all);
+        return FAIL;
+    }
+
+    /* Recorded threads get replay threads in the order they first appear */
+    for(n = 0; n < count; n++) {
+        for(t = 0; t < num_threads && recorded[t] != all[n].rec.thread; t++);
+        if(t == num_threads) {
+            if(num_threads < REPLAY_THREADS)
+                recorded[num_threads++] = all[n].rec.thread;
+            else
+                t = all[n].rec.thread % REPLAY_THREADS;
+        }
+        if(add_op(&threads[t], &all[n]))
+            goto fail;
+    }
+
+    /* Records are written as callbacks finish, so put each thread's back in start order */
+    for(t = 0; t < num_threads; t++)
+        qsort(threads[t].ops, threads[t].count, sizeof(replay_op *), compare_ops);
+
+    replay_ops = ops;
+    replay_fast = fast;
+    replay_start = latency_now();
+
+    for(t = 0, i = 0; t < num_threads; t++)
+        if(!pthread_create(&threads[t].thread, NULL, replay_thread_run, &threads[t]))
+            i++;
+        else
+            threads[t].count = 0;
+
+    for(t = 0; t < num_threads; t++)
+        if(threads[t].count)
+            pthread_join(threads[t].thread, NULL);
+
+    elapsed = latency_now() - replay_start;
+    printf("replayed %ld operations on %u threads in %.3fs\n", count, i, (double)elapsed / 1e9);
+    retval = SUCCESS;
+
+fail:
+    for(t = 0; t < REPLAY_THREADS; t++)
+        free(threads[t].ops);
+    free(threads);
+    for(n = 0; n < count; n++) {
+        free(all[n].path);
+        free(all[n].path2);
+    }
+    free(all);
+    return retval;
+}
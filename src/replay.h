@@ -0,0 +1,10 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "common.h"
+
+struct fuse_operations;
+
+int replay_run(const char *path, const struct fuse_operations *ops, int fast);
+
+#endif
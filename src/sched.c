@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#include "sched.h"
+#include "stats.h"
+#include "latency.h"
+
+
+#define MAX_RUNNING     16              /* Backend calls in flight, over every class */
+#define BURST_SECONDS   60              /* The bucket holds this many seconds of the quota */
+#define RESERVE         4               /* 1/4 of the bucket is left to interactive calls */
+#define BACKOFF_MIN_NS  1000000000ULL
+#define BACKOFF_MAX_NS  60000000000ULL  /* A FUSE callback may be waiting, so keep it short */
+#define WAIT_FOREVER    UINT64_MAX
+
+#define HEDGE_PERCENTILE    0.95    /* Requests slower than this many of theirs get a duplicate */
+#define HEDGE_MIN_COUNT     20      /* Timings needed before the percentile is trusted */
+#define HEDGE_MIN_NS        10000000ULL
+#define HEDGE_PERCENT       5       /* Duplicates allowed per 100 requests that may be hedged */
+#define HEDGE_BURST         10      /* Duplicates allowed in a row */
+
+static const char *class_names[SCHED_CLASSES] = { "interactive", "listing", "probe", "prefetch" };
+static const unsigned int class_limits[SCHED_CLASSES] = { 8, 4, 8, 2 };
+
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER;
+
+static unsigned int running[SCHED_CLASSES];
+static unsigned int total_running;
+static unsigned int waiting[SCHED_CLASSES][2];     /* By whether the call needs a token */
+
+/* Token bucket of API calls. A zero rate means the backend has no quota. */
+static double tokens;
+static double capacity;
+static double rate;                     /* Tokens per ns */
+static uint64_t refilled;
+
+static unsigned int hedge_credit;       /* In hundredths of a duplicate */
+
+static uint64_t backoff_until;
+static uint64_t backoff_ns;             /* Doubles with every rate limited call in a row */
+
+/* The class the calls of this thread are kept to at best, and the call it is in. */
+static __thread sched_class thread_class;
+static __thread sched_class call_class;
+
+
+/* Sets the hourly API quota. 0 lifts it. */
+void sched_set_quota(unsigned int calls_per_hour) {
+    pthread_mutex_lock(&sched_lock);
+    rate = calls_per_hour / 3600e9;
+    capacity = calls_per_hour * (double)BURST_SECONDS / 3600;
+    if(calls_per_hour && capacity < 1)
+        capacity = 1;
+    tokens = capacity;
+    refilled = latency_now();
+    pthread_cond_broadcast(&sched_cond);
+    pthread_mutex_unlock(&sched_lock);
+}
+
+/*
+ * Keeps every later backend call of the calling thread at sched or below,
+ * so bulk work can't take an interactive turn. Returns the previous class.
+ */
+sched_class sched_set_thread_class(sched_class sched) {
+    sched_class previous = thread_class;
+
+    thread_class = sched;
+    return previous;
+}
+
+sched_class sched_thread_class() {
+    return thread_class;
+}
+
+static inline void refill(uint64_t now) {
+    tokens += (double)(now - refilled) * rate;
+    if(tokens > capacity)
+        tokens = capacity;
+    refilled = now;
+}
+
+/*
+ * Returns how long, in ns, a call of the class has to wait before it may
+ * start, 0 if it may start now or WAIT_FOREVER if it has to wait for
+ * another call to end. Assumes sched_lock is held.
+ */
+static uint64_t must_wait(sched_class sched, int api, uint64_t now) {
+    double need = 1;
+    unsigned int i;
+
+    if(running[sched] >= class_limits[sched] || total_running >= MAX_RUNNING)
+        return WAIT_FOREVER;
+
+    /* Higher classes go first, unless they wait for a token this call doesn't need */
+    for(i = 0; i < sched; i++)
+        if(running[i] < class_limits[i] && (waiting[i][0] || (api && waiting[i][1])))
+            return WAIT_FOREVER;
+
+    if(now < backoff_until)
+        return backoff_until - now;
+
+    if(!api || rate == 0)
+        return 0;
+
+    refill(now);
+    if(sched != SCHED_INTERACTIVE)
+        need += capacity / RESERVE;
+    if(need > capacity)
+        need = capacity;
+
+    return (tokens >= need) ? 0 : (uint64_t)((need - tokens) / rate) + 1;
+}
+
+static void timed_wait(uint64_t ns) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ns += (uint64_t)ts.tv_nsec;
+    ts.tv_sec += (time_t)(ns / 1000000000);
+    ts.tv_nsec = (long)(ns % 1000000000);
+    pthread_cond_timedwait(&sched_cond, &sched_lock, &ts);
+}
+
+/*
+ * Waits until a call of the class may start. Calls that count against the
+ * API quota (api) also wait for a token. The time waited is counted as the
+ * queue phase of the current operation.
+ */
+void sched_begin(sched_class sched, int api) {
+    uint64_t start = latency_now(), now = start, wait;
+
+    if(sched < thread_class)
+        sched = thread_class;
+    api = api ? 1 : 0;
+
+    pthread_mutex_lock(&sched_lock);
+    waiting[sched][api]++;
+    while((wait = must_wait(sched, api, now))) {
+        if(wait == WAIT_FOREVER)
+            pthread_cond_wait(&sched_cond, &sched_lock);
+        else
+            timed_wait(wait);
+        now = latency_now();
+    }
+    waiting[sched][api]--;
+    running[sched]++;
+    total_running++;
+    if(api && rate > 0)
+        tokens -= 1;
+
+    /* Lower classes may have been waiting behind this call */
+    if(now != start)
+        pthread_cond_broadcast(&sched_cond);
+    pthread_mutex_unlock(&sched_lock);
+
+    call_class = sched;
+    if(now != start) {
+        stat_inc(STAT_SCHED_WAITS);
+        latency_phase_add(PHASE_QUEUE, now - start);
+    }
+}
+
+/*
+ * Ends the call started by sched_begin on this thread. A call ending after
+ * the backoff got through, so the next backoff starts short again. The
+ * backend may have seen the rate limit on another thread, so this goes by
+ * time rather than by whether sched_rate_limited was called.
+ */
+void sched_end() {
+    uint64_t now = latency_now();
+
+    pthread_mutex_lock(&sched_lock);
+    running[call_class]--;
+    total_running--;
+    if(now >= backoff_until)
+        backoff_ns = 0;
+    pthread_cond_broadcast(&sched_cond);
+    pthread_mutex_unlock(&sched_lock);
+}
+
+/*
+ * Called by a backend when the service turned the current call down for
+ * going too fast. Every call then waits, twice as long as the last time
+ * if no call got through since, and the bucket is emptied.
+ */
+void sched_rate_limited() {
+    uint64_t now = latency_now();
+
+    stat_inc(STAT_RATE_LIMITED);
+
+    pthread_mutex_lock(&sched_lock);
+    if(now >= backoff_until) {  /* Calls in flight when the first was turned down count once */
+        backoff_ns = backoff_ns ? backoff_ns * 2 : BACKOFF_MIN_NS;
+        if(backoff_ns > BACKOFF_MAX_NS)
+            backoff_ns = BACKOFF_MAX_NS;
+        backoff_until = now + backoff_ns;
+        tokens = 0;
+        refilled = now;
+        syslog(LOG_WARNING, "rate limited, backing off for %.0fs", (double)backoff_ns / 1e9);
+    }
+    pthread_mutex_unlock(&sched_lock);
+}
+
+/*
+ * Returns how long a request timed as op may go unanswered before a
+ * duplicate of it is sent, or 0 if it may not be hedged yet. Every request
+ * asking adds to the budget of duplicates.
+ */
+uint64_t sched_hedge_delay(latency_op op) {
+    uint64_t delay;
+
+    pthread_mutex_lock(&sched_lock);
+    if((hedge_credit += HEDGE_PERCENT) > HEDGE_BURST * 100)
+        hedge_credit = HEDGE_BURST * 100;
+    pthread_mutex_unlock(&sched_lock);
+
+    if(!(delay = latency_percentile(op, HEDGE_PERCENTILE, HEDGE_MIN_COUNT)))
+        return 0;
+    return (delay < HEDGE_MIN_NS) ? HEDGE_MIN_NS : delay;
+}
+
+/*
+ * Takes a duplicate out of the budget, and a token if it counts against
+ * the API quota (api). Returns 0 if there is none left or the backend is
+ * being rate limited, when a duplicate would only make it worse. A
+ * duplicate never takes a token kept for interactive calls.
+ */
+int sched_hedge(int api) {
+    uint64_t now = latency_now();
+    int ok = 0;
+
+    pthread_mutex_lock(&sched_lock);
+    if(hedge_credit >= 100 && now >= backoff_until) {
+        ok = 1;
+        if(api && rate > 0) {
+            refill(now);
+            if((ok = tokens >= 1 + capacity / RESERVE))
+                tokens -= 1;
+        }
+        if(ok)
+            hedge_credit -= 100;
+    }
+    pthread_mutex_unlock(&sched_lock);
+
+    if(ok)
+        stat_inc(STAT_HEDGES);
+    return ok;
+}
+
+/*
+ * Whether calls of a class higher than sched are running or waiting, so
+ * work of the class that can wait should leave the backend to them.
+ */
+int sched_busy(sched_class sched) {
+    unsigned int i;
+    int busy = 0;
+
+    pthread_mutex_lock(&sched_lock);
+    for(i = 0; i < sched; i++)
+        if(running[i] || waiting[i][0] || waiting[i][1])
+            busy = 1;
+    pthread_mutex_unlock(&sched_lock);
+    return busy;
+}
+
+/* Writes the state of the scheduler as "name value" lines. */
+void sched_print(FILE *out) {
+    uint64_t now = latency_now();
+    unsigned int i;
+
+    pthread_mutex_lock(&sched_lock);
+    if(rate > 0) {
+        refill(now);
+        fprintf(out, "api_tokens %.1f\n", tokens);
+    }
+    fprintf(out, "backoff_ms %llu\n",
+      (unsigned long long)(now < backoff_until ? (backoff_until - now) / 1000000 : 0));
+    for(i = 0; i < SCHED_CLASSES; i++) {
+        fprintf(out, "%s_running %u\n", class_names[i], running[i]);
+        fprintf(out, "%s_waiting %u\n", class_names[i], waiting[i][0] + waiting[i][1]);
+    }
+    pthread_mutex_unlock(&sched_lock);
+}
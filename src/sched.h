@@ -0,0 +1,35 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdio.h>
+
+#include "common.h"
+#include "latency.h"
+
+/*
+ * Every backend call waits for its turn in one of these classes, highest
+ * priority first. A call only goes ahead of a waiting call of a higher
+ * class when that one is held back by the limit of its own class.
+ * Keep class_names and class_limits in sched.c in the same order.
+ */
+typedef enum {
+    SCHED_INTERACTIVE,          /* Opens, uploads and edits someone is waiting on */
+    SCHED_LISTING,              /* Photoset and photo listings */
+    SCHED_PROBE,                /* HEADs for photo sizes */
+    SCHED_PREFETCH,             /* Work no one is waiting on yet */
+
+    SCHED_CLASSES
+} sched_class;
+
+void sched_set_quota(unsigned int calls_per_hour);
+sched_class sched_set_thread_class(sched_class sched);
+sched_class sched_thread_class();
+void sched_begin(sched_class sched, int api);
+void sched_end();
+void sched_rate_limited();
+uint64_t sched_hedge_delay(latency_op op);
+int sched_hedge(int api);
+int sched_busy(sched_class sched);
+void sched_print(FILE *out);
+
+#endif
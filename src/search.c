@@ -0,0 +1,292 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "search.h"
+
+
+#define INITIAL_POSTING     4       /* Keys a new word has room for */
+#define SEARCH_QUERY_MAX    16      /* Words of a query past this are ignored */
+
+/* The keys of the documents containing a word. */
+typedef struct {
+    char **keys;
+    unsigned int count;
+    unsigned int capacity;
+    unsigned short sorted;          /* keys are in address order */
+} search_posting;
+
+/* A document. The postings point to its key. */
+typedef struct {
+    uint64_t id;
+    char key[];
+} search_doc;
+
+typedef struct {
+    search_index *idx;
+    const char *key;
+} search_removal;
+
+
+static inline int is_word_byte(unsigned char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+static inline char lower_byte(unsigned char c) {
+    return (char)((c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c);
+}
+
+/*
+ * Copies the next word of the text at *pos into token, which must hold
+ * SEARCH_TOKEN_MAX + 1 bytes, and moves *pos past it. Returns 0 once there
+ * are no words left.
+ */
+static int next_token(const char **pos, char *token) {
+    const unsigned char *p = (const unsigned char *)*pos;
+    size_t len = 0;
+
+    while(*p && !is_word_byte(*p))
+        p++;
+
+    for(; is_word_byte(*p); p++)
+        if(len < SEARCH_TOKEN_MAX)
+            token[len++] = lower_byte(*p);
+
+    token[len] = '\0';
+    *pos = (const char *)p;
+    return len > 0;
+}
+
+static int compare_keys(const void *a, const void *b) {
+    uintptr_t ka = (uintptr_t)*(char * const *)a;
+    uintptr_t kb = (uintptr_t)*(char * const *)b;
+
+    return (ka > kb) - (ka < kb);
+}
+
+static void free_posting(search_posting *sp) {
+    free(sp->keys);
+    free(sp);
+}
+
+static int free_token_ht(char *word, void *value, void *user_data) {
+    (void)user_data;
+    free(word);
+    free_posting(value);
+    return 1;
+}
+
+static int free_doc_ht(char *key, void *value, void *user_data) {
+    (void)key;
+    (void)user_data;
+    free(value);
+    return 1;
+}
+
+search_index *search_index_new() {
+    search_index *idx = (search_index *)calloc(1, sizeof(search_index));
+
+    if(!idx)
+        return NULL;
+
+    if(!(idx->token_ht = htable_new())) {
+        free(idx);
+        return NULL;
+    }
+    if(!(idx->doc_ht = htable_new())) {
+        htable_destroy(idx->token_ht);
+        free(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+void search_index_destroy(search_index *idx) {
+    if(idx) {
+        htable_foreach_remove(idx->token_ht, free_token_ht, NULL);
+        htable_destroy(idx->token_ht);
+        htable_foreach_remove(idx->doc_ht, free_doc_ht, NULL);
+        htable_destroy(idx->doc_ht);
+        free(idx);
+    }
+}
+
+/*
+ * Adds the words of text to the document key, with the id. Every piece of
+ * text of a document has to be added before the next document is, as a
+ * word seen twice is only recognized by the document being the last one
+ * it holds. A document keeps the id it was first added with.
+ */
+int search_index_add(search_index *idx, const char *key, uint64_t id, const char *text) {
+    char token[SEARCH_TOKEN_MAX + 1];
+    search_posting *sp;
+    search_doc *doc;
+    size_t len;
+
+    if(!text)
+        return SUCCESS;
+
+    if(!(doc = htable_lookup(idx->doc_ht, key))) {
+        len = strlen(key) + 1;
+        if(!(doc = (search_doc *)malloc(sizeof(search_doc) + len)))
+            return FAIL;
+
+        doc->id = id;
+        memcpy(doc->key, key, len);
+        if(htable_insert(idx->doc_ht, doc->key, doc)) {
+            free(doc);
+            return FAIL;
+        }
+        idx->bytes += sizeof(search_doc) + len;
+    }
+
+    while(next_token(&text, token)) {
+        if(!(sp = htable_lookup(idx->token_ht, token))) {
+            char *word;
+
+            if(!(sp = (search_posting *)calloc(1, sizeof(search_posting))))
+                return FAIL;
+            if(!(word = strdup(token)) || htable_insert(idx->token_ht, word, sp)) {
+                free(word);
+                free(sp);
+                return FAIL;
+            }
+            idx->bytes += sizeof(search_posting) + strlen(word) + 1;
+        }
+
+        if(sp->count > 0 && sp->keys[sp->count - 1] == doc->key)
+            continue;
+
+        if(sp->count == sp->capacity) {
+            unsigned int capacity = sp->capacity ? sp->capacity * 2 : INITIAL_POSTING;
+            char **keys = (char **)realloc(sp->keys, capacity * sizeof(char *));
+
+            if(!keys)
+                return FAIL;
+
+            idx->bytes += (capacity - sp->capacity) * sizeof(char *);
+            sp->keys = keys;
+            sp->capacity = capacity;
+        }
+
+        if(sp->count == 0)
+            sp->sorted = 1;
+        else if((uintptr_t)sp->keys[sp->count - 1] > (uintptr_t)key)
+            sp->sorted = 0;
+
+        sp->keys[sp->count++] = doc->key;
+    }
+
+    return SUCCESS;
+}
+
+static int remove_key(char *word, void *value, void *user_data) {
+    search_removal *sr = user_data;
+    search_posting *sp = value;
+    unsigned int i;
+
+    for(i = 0; i < sp->count; i++) {
+        if(sp->keys[i] == sr->key) {
+            memmove(&sp->keys[i], &sp->keys[i + 1], (sp->count - i - 1) * sizeof(char *));
+            sp->count--;
+            break;
+        }
+    }
+
+    if(sp->count > 0)
+        return 0;
+
+    sr->idx->bytes -= sizeof(search_posting) + strlen(word) + 1 + sp->capacity * sizeof(char *);
+    free(word);
+    free_posting(sp);
+    return 1;
+}
+
+/*
+ * Removes the document key. The words of the document are not needed, as
+ * every word is looked at. Documents are rarely removed one at a time, a
+ * whole index is usually destroyed instead.
+ */
+void search_index_remove(search_index *idx, const char *key) {
+    search_removal sr = { idx, NULL };
+    search_doc *doc;
+
+    if(!(doc = htable_remove(idx->doc_ht, key)))
+        return;
+
+    sr.key = doc->key;
+    htable_foreach_remove(idx->token_ht, remove_key, &sr);
+
+    idx->bytes -= sizeof(search_doc) + strlen(doc->key) + 1;
+    free(doc);
+}
+
+/*
+ * Returns the keys of the documents containing every word of the query.
+ * The words are matched whole. The keys are still owned by the index.
+ *
+ * IMPORTANT: Make sure you free(keys) after you are done!
+ */
+unsigned int search_index_query(search_index *idx, const char *query, char ***keys) {
+    search_posting *postings[SEARCH_QUERY_MAX];
+    search_posting *sp, *smallest = NULL;
+    char token[SEARCH_TOKEN_MAX + 1];
+    unsigned int num_postings = 0;
+    unsigned int count = 0;
+    unsigned int i, j;
+
+    while(next_token(&query, token)) {
+        if(!(sp = htable_lookup(idx->token_ht, token)))
+            return 0;
+
+        if(num_postings == SEARCH_QUERY_MAX)
+            continue;
+
+        for(j = 0; j < num_postings && postings[j] != sp; j++);
+        if(j < num_postings)
+            continue;   /* Word given twice */
+
+        /* Postings are sorted on their first use so they can be searched. */
+        if(!sp->sorted) {
+            qsort(sp->keys, sp->count, sizeof(char *), compare_keys);
+            sp->sorted = 1;
+        }
+
+        if(!smallest || sp->count < smallest->count)
+            smallest = sp;
+        postings[num_postings++] = sp;
+    }
+
+    if(!smallest)
+        return 0;
+
+    if(!(*keys = (char **)malloc(smallest->count * sizeof(char *))))
+        return 0;
+
+    for(i = 0; i < smallest->count; i++) {
+        for(j = 0; j < num_postings; j++) {
+            if(postings[j] != smallest && !bsearch(&smallest->keys[i], postings[j]->keys,
+              postings[j]->count, sizeof(char *), compare_keys))
+                break;
+        }
+
+        if(j == num_postings)
+            (*keys)[count++] = smallest->keys[i];
+    }
+
+    if(count == 0)
+        free(*keys);
+    return count;
+}
+
+/* The id the document key was added with, or 0 if it is not in the index. */
+uint64_t search_index_id(const search_index *idx, const char *key) {
+    const search_doc *doc = htable_lookup(idx->doc_ht, key);
+
+    return doc ? doc->id : 0;
+}
+
+/* Bytes used by the index. */
+size_t search_index_memory(const search_index *idx) {
+    return sizeof(search_index) + htable_memory(idx->token_ht) + htable_memory(idx->doc_ht) + idx->bytes;
+}
@@ -0,0 +1,34 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "htable.h"
+
+#define SEARCH_TOKEN_MAX    64      /* Longer words are cut to this many bytes */
+
+/*
+ * Inverted index from the words of a text to the keys of the documents
+ * containing them. Words are runs of ASCII letters and digits, lower cased,
+ * with every non ASCII byte counted as a letter so UTF-8 words stay whole.
+ *
+ * The index keeps its own copy of each document key, along with an id the
+ * caller gives it, so it can outlive the documents it was built from.
+ */
+typedef struct {
+    htable *token_ht;       /* Word to search_posting */
+    htable *doc_ht;         /* Key to search_doc */
+    size_t bytes;           /* Memory held by the words, postings and keys */
+} search_index;
+
+search_index *search_index_new();
+void search_index_destroy(search_index *idx);
+int search_index_add(search_index *idx, const char *key, uint64_t id, const char *text);
+void search_index_remove(search_index *idx, const char *key);
+unsigned int search_index_query(search_index *idx, const char *query, char ***keys);
+uint64_t search_index_id(const search_index *idx, const char *key);
+size_t search_index_memory(const search_index *idx);
+
+#endif
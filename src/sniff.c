@@ -0,0 +1,238 @@
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "sniff.h"
+
+
+#define TS_PACKET       188     /* MPEG transport stream packets */
+#define M2TS_PACKET     192     /* The same with a 4 byte timecode in front */
+#define TS_SYNC         0x47
+
+/* Formats told apart by a fixed string at a fixed offset. */
+typedef struct {
+    const char *name;
+    size_t offset;
+    const char *magic;
+    size_t len;
+} magic;
+
+static const magic magics[] = {
+    { "raf",  0, "FUJIFILMCCD-RAW", 15 },
+    { "orf",  0, "IIRO", 4 },
+    { "orf",  0, "IIRS", 4 },
+    { "orf",  0, "MMOR", 4 },
+    { "rw2",  0, "IIU\0", 4 },
+    { "x3f",  0, "FOVb", 4 },
+    { "mrw",  0, "\0MRM", 4 },
+    { "wmv",  0, "\x30\x26\xb2\x75\x8e\x66\xcf\x11", 8 },
+    { "mkv",  0, "\x1a\x45\xdf\xa3", 4 },     /* WebM too */
+    { "ogg",  0, "OggS", 4 },
+    { "flv",  0, "FLV\x01", 4 },
+    { "mpeg", 0, "\0\0\x01\xba", 4 },         /* Program stream */
+    { "mpeg", 0, "\0\0\x01\xb3", 4 },         /* Video elementary stream */
+};
+
+/* ISO base media brands of still images. Any other brand is a video. */
+static const char *image_brands[] = { "heic", "heix", "heim", "heis", "hevc", "hevx", "avif", "avis" };
+
+
+static inline unsigned int le16(const unsigned char *p) {
+    return (unsigned int)p[1] << 8 | p[0];
+}
+
+static inline unsigned long be32(const unsigned char *p) {
+    return (unsigned long)p[0] << 24 | (unsigned long)p[1] << 16 | (unsigned long)p[2] << 8 | p[3];
+}
+
+static inline unsigned long le32(const unsigned char *p) {
+    return (unsigned long)p[3] << 24 | (unsigned long)p[2] << 16 | (unsigned long)p[1] << 8 | p[0];
+}
+
+static inline int has(const unsigned char *head, size_t len, size_t offset, const char *str, size_t n) {
+    return len >= offset + n && !memcmp(head + offset, str, n);
+}
+
+
+/**
+ * Formats that need more than their magic bytes
+**/
+
+/* The SOI marker, then the marker of the first segment. */
+static const char *sniff_jpeg(const unsigned char *head, size_t len) {
+    return (len >= 4 && head[0] == 0xff && head[1] == 0xd8 && head[2] == 0xff && head[3] >= 0xc0) ? "jpeg" : NULL;
+}
+
+/* The signature, then an IHDR chunk with a size. */
+static const char *sniff_png(const unsigned char *head, size_t len) {
+    if(!has(head, len, 0, "\x89PNG\r\n\x1a\n", 8) || !has(head, len, 12, "IHDR", 4) || len < 24)
+        return NULL;
+    return (be32(head + 8) == 13 && be32(head + 16) && be32(head + 20)) ? "png" : NULL;
+}
+
+static const char *sniff_gif(const unsigned char *head, size_t len) {
+    if(!has(head, len, 0, "GIF87a", 6) && !has(head, len, 0, "GIF89a", 6))
+        return NULL;
+    return (len >= 10 && le16(head + 6) && le16(head + 8)) ? "gif" : NULL;
+}
+
+/* One of the DIB header sizes Windows ever wrote. */
+static const char *sniff_bmp(const unsigned char *head, size_t len) {
+    unsigned long size;
+
+    if(!has(head, len, 0, "BM", 2) || len < 18)
+        return NULL;
+    size = le32(head + 14);
+    return (size == 12 || size == 40 || size == 52 || size == 56 || size == 64 || size == 108 || size == 124) ?
+      "bmp" : NULL;
+}
+
+/*
+ * TIFF and the raw formats built on it, which are told apart by their
+ * tags. Only Canon marks its own in the header.
+ */
+static const char *sniff_tiff(const unsigned char *head, size_t len) {
+    unsigned long ifd;
+
+    if(len < 8)
+        return NULL;
+
+    if(has(head, len, 0, "II*\0", 4))
+        ifd = le32(head + 4);
+    else if(has(head, len, 0, "MM\0*", 4))
+        ifd = be32(head + 4);
+    else if(has(head, len, 0, "II+\0", 4) || has(head, len, 0, "MM\0+", 4))
+        return "bigtiff";
+    else
+        return NULL;
+
+    if(ifd < 8)
+        return NULL;
+    return has(head, len, 8, "CR", 2) ? "cr2" : "tiff";
+}
+
+static const char *sniff_riff(const unsigned char *head, size_t len) {
+    if(!has(head, len, 0, "RIFF", 4))
+        return NULL;
+
+    if(has(head, len, 8, "WEBP", 4) &&
+      (has(head, len, 12, "VP8 ", 4) || has(head, len, 12, "VP8L", 4) || has(head, len, 12, "VP8X", 4)))
+        return "webp";
+    if(has(head, len, 8, "AVI ", 4))
+        return "avi";
+    return NULL;
+}
+
+static const char *brand_format(const unsigned char *brand) {
+    unsigned int i;
+
+    for(i = 0; i < sizeof(image_brands) / sizeof(image_brands[0]); i++)
+        if(!memcmp(brand, image_brands[i], 4))
+            return (brand[0] == 'a') ? "avif" : "heic";
+
+    if(!memcmp(brand, "crx ", 4))
+        return "cr3";
+    if(!memcmp(brand, "qt  ", 4))
+        return "mov";
+    if(!memcmp(brand, "3gp", 3) || !memcmp(brand, "3g2", 3))
+        return "3gp";
+    return NULL;
+}
+
+/*
+ * ISO base media files: HEIF images, Canon CR3, MP4, QuickTime and 3GP.
+ * A generic major brand, such as mif1 or isom, leaves it to the
+ * compatible brands. QuickTime files may start without an ftyp box.
+ */
+static const char *sniff_isobmff(const unsigned char *head, size_t len) {
+    const char *format;
+    unsigned long size;
+    size_t i;
+
+    if(len < 12)
+        return NULL;
+
+    size = be32(head);
+    if(!has(head, len, 4, "ftyp", 4)) {
+        if(size >= 8 && (has(head, len, 4, "moov", 4) || has(head, len, 4, "mdat", 4) ||
+          has(head, len, 4, "wide", 4) || has(head, len, 4, "pnot", 4)))
+            return "mov";
+        return NULL;
+    }
+
+    if(size < 16)
+        return NULL;
+
+    if((format = brand_format(head + 8)))
+        return format;
+
+    for(i = 16; i + 4 <= size && i + 4 <= len; i += 4)
+        if((format = brand_format(head + i)))
+            return format;
+
+    /* Image collections with no HEVC or AV1 brand are still images */
+    if(!memcmp(head + 8, "mif1", 4) || !memcmp(head + 8, "msf1", 4))
+        return "heif";
+    return "mp4";
+}
+
+/* Three packets in a row start with the sync byte. */
+static const char *sniff_ts(const unsigned char *head, size_t len) {
+    if(len > 2 * TS_PACKET && head[0] == TS_SYNC && head[TS_PACKET] == TS_SYNC && head[2 * TS_PACKET] == TS_SYNC)
+        return "mpegts";
+    if(len > 4 + 2 * M2TS_PACKET && head[4] == TS_SYNC && head[4 + M2TS_PACKET] == TS_SYNC &&
+      head[4 + 2 * M2TS_PACKET] == TS_SYNC)
+        return "m2ts";
+    return NULL;
+}
+
+static const char *(*const sniffers[])(const unsigned char *head, size_t len) = {
+    sniff_jpeg,
+    sniff_png,
+    sniff_gif,
+    sniff_tiff,
+    sniff_riff,
+    sniff_isobmff,
+    sniff_bmp,
+    sniff_ts
+};
+
+
+/**
+ * Sniffing
+**/
+
+/*
+ * Returns the name of the image or video format the file starting with
+ * head is in, or NULL if it is in none Flickr might take. At most
+ * SNIFF_HEAD bytes are looked at.
+ */
+const char *sniff_format(const unsigned char *head, size_t len) {
+    const char *format;
+    unsigned int i;
+
+    for(i = 0; i < sizeof(magics) / sizeof(magics[0]); i++)
+        if(has(head, len, magics[i].offset, magics[i].magic, magics[i].len))
+            return magics[i].name;
+
+    for(i = 0; i < sizeof(sniffers) / sizeof(sniffers[0]); i++)
+        if((format = sniffers[i](head, len)))
+            return format;
+
+    return NULL;
+}
+
+/* Sniffs the file at path. Returns NULL if it can't be read either. */
+const char *sniff_file(const char *path) {
+    unsigned char head[SNIFF_HEAD];
+    ssize_t len;
+    int fd;
+
+    if((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+
+    len = pread(fd, head, sizeof(head), 0);
+    close(fd);
+
+    return (len > 0) ? sniff_format(head, (size_t)len) : NULL;
+}
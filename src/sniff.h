@@ -0,0 +1,13 @@
+#ifndef SNIFF_H
+#define SNIFF_H
+
+#include <stddef.h>
+
+#include "common.h"
+
+#define SNIFF_HEAD  4096    /* Bytes of a file sniff_format needs at most */
+
+const char *sniff_format(const unsigned char *head, size_t len);
+const char *sniff_file(const char *path);
+
+#endif
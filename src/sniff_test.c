@@ -0,0 +1,57 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+
+#include "sniff.h"
+
+
+/*
+ * Runs sniff_file on every file of a corpus directory and checks the
+ * format it finds against the file name. A file named "png-rgb" must sniff
+ * as png; one named "none-text" must not sniff as anything.
+ *
+ *   sniff_test [corpus directory]
+ */
+
+#define DEFAULT_CORPUS  "../test/sniff"
+#define REJECTED        "none"
+#define PATH_SIZE       4096
+
+int main(int argc, char *argv[]) {
+    const char *corpus = (argc > 1) ? argv[1] : DEFAULT_CORPUS;
+    char path[PATH_SIZE];
+    char expected[PATH_SIZE];
+    const char *format;
+    struct dirent *de;
+    unsigned int checked = 0, failed = 0;
+    size_t len;
+    DIR *dir;
+
+    if(!(dir = opendir(corpus))) {
+        perror(corpus);
+        return 1;
+    }
+
+    while((de = readdir(dir))) {
+        if(de->d_name[0] == '.')
+            continue;
+
+        len = strcspn(de->d_name, "-");
+        memcpy(expected, de->d_name, len);
+        expected[len] = '\0';
+
+        snprintf(path, sizeof(path), "%s/%s", corpus, de->d_name);
+        format = sniff_file(path);
+        checked++;
+
+        if(!strcmp(expected, REJECTED) ? format != NULL : (!format || strcmp(format, expected))) {
+            fprintf(stderr, "%s: sniffed as %s\n", de->d_name, format ? format : "nothing");
+            failed++;
+        }
+    }
+    closedir(dir);
+
+    printf("%u of %u files sniffed as expected\n", checked - failed, checked);
+    return (failed || !checked) ? 1 : 0;
+}
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "stats.h"
+
+
+stats_shard stats_shards[STATS_SHARDS];
+__thread stats_shard *stats_mine;
+
+/* Threads holding each shard. A thread's shard is handed back when it exits. */
+static pthread_mutex_t shard_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t shard_once = PTHREAD_ONCE_INIT;
+static pthread_key_t shard_key;
+static unsigned int shard_users[STATS_SHARDS];
+static unsigned int next_shard;
+
+static const char *stat_names[STAT_COUNT] = {
+    "photoset_ht_hits",
+    "photoset_ht_misses",
+    "photo_ht_hits",
+    "photo_ht_misses",
+    "photoset_loads",
+    "disk_hits",
+    "disk_misses",
+    "memory_hits",
+    "memory_misses",
+    "memory_tier_bytes",
+
+    "api_get_photosets",
+    "api_get_photos",
+    "api_fetch",
+    "api_content_length",
+    "api_upload",
+    "api_set_photo_title",
+    "api_set_photoset_title",
+    "api_create_photoset",
+    "api_add_photo",
+    "api_remove_photo",
+    "api_delete_photo",
+    "api_errors",
+
+    "bytes_downloaded",
+    "bytes_uploaded",
+    "connections",
+    "downloads_in_flight",
+    "uploads_queued",
+    "sched_waits",
+    "rate_limited",
+    "timeouts",
+    "breaker_trips",
+    "backend_down",
+    "hedges",
+    "hedge_wins",
+    "tasks_queued",
+    "tasks_stolen",
+    "warm_left",
+    "warm_photosets",
+    "warm_sizes"
+};
+
+
+/* Its counts stay in the shard, for the next thread to add to. */
+static void release_shard(void *shard) {
+    pthread_mutex_lock(&shard_lock);
+    shard_users[(stats_shard *)shard - stats_shards]--;
+    pthread_mutex_unlock(&shard_lock);
+}
+
+static void create_shard_key() {
+    pthread_key_create(&shard_key, release_shard);
+}
+
+/*
+ * Hands the calling thread the shard the fewest threads hold, looking
+ * round robin from after the last one handed out. FUSE starts and ends
+ * threads as the load changes, so shards are only shared while more than
+ * STATS_SHARDS threads are alive at once.
+ */
+stats_shard *stats_thread_shard() {
+    unsigned int i, j, best;
+
+    pthread_once(&shard_once, create_shard_key);
+
+    pthread_mutex_lock(&shard_lock);
+    best = next_shard;
+    for(i = 0; i < STATS_SHARDS && shard_users[best]; i++) {
+        j = (next_shard + i) % STATS_SHARDS;
+        if(shard_users[j] < shard_users[best])
+            best = j;
+    }
+    shard_users[best]++;
+    next_shard = (best + 1) % STATS_SHARDS;
+    pthread_mutex_unlock(&shard_lock);
+
+    pthread_setspecific(shard_key, &stats_shards[best]);
+    return stats_mine = &stats_shards[best];
+}
+
+/* Sums the counter over every shard. Other threads may be adding to it meanwhile. */
+int64_t stats_get(stat_counter counter) {
+    int64_t sum = 0;
+    unsigned int i;
+
+    for(i = 0; i < STATS_SHARDS; i++)
+        sum += __atomic_load_n(&stats_shards[i].counters[counter], __ATOMIC_RELAXED);
+    return sum;
+}
+
+/* Writes every counter as a "name value" line. */
+void stats_print(FILE *out) {
+    unsigned int i;
+
+    for(i = 0; i < STAT_COUNT; i++)
+        fprintf(out, "%s %lld\n", stat_names[i], (long long)stats_get((stat_counter)i));
+}
@@ -0,0 +1,89 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "common.h"
+
+#define STATS_SHARDS    64      /* Threads alive past this many share shards */
+
+/*
+ * Counters are only ever added to, so the ones that go up and down, such
+ * as STAT_DOWNLOADS, may be counted up in one shard and down in another.
+ * Keep stat_names in stats.c in the same order.
+ */
+typedef enum {
+    STAT_PHOTOSET_HIT,          /* photoset_ht lookups */
+    STAT_PHOTOSET_MISS,
+    STAT_PHOTO_HIT,             /* photo_ht lookups */
+    STAT_PHOTO_MISS,
+    STAT_PHOTOSET_LOAD,         /* Photosets whose photos were not loaded yet */
+    STAT_DISK_HIT,              /* Opened photos already in the tmp directory */
+    STAT_DISK_MISS,
+    STAT_MEMORY_HIT,            /* Opened photos held in memory by memtier.c */
+    STAT_MEMORY_MISS,
+    STAT_MEMORY_BYTES,          /* Bytes of photos held in memory */
+
+    STAT_API_GET_PHOTOSETS,     /* Backend calls, by method */
+    STAT_API_GET_PHOTOS,
+    STAT_API_FETCH,
+    STAT_API_CONTENT_LENGTH,
+    STAT_API_UPLOAD,
+    STAT_API_SET_PHOTO_TITLE,
+    STAT_API_SET_PHOTOSET_TITLE,
+    STAT_API_CREATE_PHOTOSET,
+    STAT_API_ADD_PHOTO,
+    STAT_API_REMOVE_PHOTO,
+    STAT_API_DELETE_PHOTO,
+    STAT_API_ERRORS,
+
+    STAT_BYTES_DOWNLOADED,
+    STAT_BYTES_UPLOADED,
+    STAT_CONNECTIONS,           /* Open HTTP connections of wget.c */
+    STAT_DOWNLOADS,             /* Downloads in flight */
+    STAT_UPLOADS,               /* Uploads waiting or in flight */
+    STAT_SCHED_WAITS,           /* Backend calls that had to wait for their turn */
+    STAT_RATE_LIMITED,          /* Backend calls turned down for going too fast */
+    STAT_TIMEOUTS,              /* Backend calls given up on */
+    STAT_BREAKER_TRIPS,
+    STAT_BACKEND_DOWN,          /* 1 while the breaker is tripped */
+    STAT_HEDGES,                /* Duplicates sent of requests slow to answer */
+    STAT_HEDGE_WINS,            /* Duplicates answered first */
+    STAT_TASKS_QUEUED,          /* Tasks waiting for a thread of pool.c */
+    STAT_TASKS_STOLEN,          /* Tasks a worker took from another's deque */
+    STAT_WARM_LEFT,             /* Photosets the warm-up has yet to load */
+    STAT_WARM_PHOTOSETS,        /* Photosets the warm-up found loaded or loaded */
+    STAT_WARM_SIZES,            /* Photo sizes the warm-up looked up */
+
+    STAT_COUNT
+} stat_counter;
+
+/* Each thread adds to its own cache line, so counting never contends. */
+typedef struct {
+    int64_t counters[STAT_COUNT];
+} __attribute__((aligned(64))) stats_shard;
+
+extern stats_shard stats_shards[STATS_SHARDS];
+extern __thread stats_shard *stats_mine;
+
+stats_shard *stats_thread_shard();
+int64_t stats_get(stat_counter counter);
+void stats_print(FILE *out);
+
+static inline void stat_add(stat_counter counter, int64_t n) {
+    stats_shard *shard = stats_mine ? stats_mine : stats_thread_shard();
+
+    /* Relaxed, as the line is only shared while more than STATS_SHARDS threads are alive */
+    __atomic_fetch_add(&shard->counters[counter], n, __ATOMIC_RELAXED);
+}
+
+static inline void stat_inc(stat_counter counter) {
+    stat_add(counter, 1);
+}
+
+static inline void stat_dec(stat_counter counter) {
+    stat_add(counter, -1);
+}
+
+#endif
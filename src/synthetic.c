@@ -0,0 +1,595 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "backend.h"
+
+
+#define DEFAULT_SETS        10
+#define DEFAULT_PHOTOS      100             /* In each photoset */
+#define DEFAULT_LOOSE       100             /* Photos without a photoset */
+#define DEFAULT_SIZE        (256 * 1024)    /* Bytes in each photo */
+
+#define PHOTO_ID_BASE       1000000000UL    /* Photo ids are this plus the photo index */
+#define SET_ID_BASE         2000000000UL    /* Photoset ids are this plus the photoset index */
+#define ID_SIZE             24
+#define URI_PREFIX          "synthetic://"
+#define CHUNK_SIZE          (64 * 1024)     /* Written between bandwidth checks */
+#define FIRST_TAKEN         1262304000      /* 2010-01-01, the first date taken */
+
+typedef struct {
+    char *title;
+    time_t taken;
+    unsigned int size;
+    unsigned int sets;                      /* Number of photosets holding the photo */
+    unsigned short deleted;
+} synth_photo;
+
+typedef struct {
+    char *title;
+    unsigned int *photos;                   /* Indexes into photos */
+    unsigned int count;
+    unsigned int capacity;
+} synth_set;
+
+/*
+ * Settings, given as "synthetic:key=value:key=value". Everything the
+ * backend returns follows from these, so two runs see the same account.
+ */
+static struct {
+    unsigned int sets;
+    unsigned int photos;
+    unsigned int loose;
+    unsigned int size;
+    unsigned int latency;                   /* In ms, added to every call */
+    unsigned int bandwidth;                 /* In KB/s for fetches. 0 is unlimited */
+} params;
+
+static synth_photo *photos;
+static unsigned int num_photos, photos_capacity;
+static synth_set *sets;
+static unsigned int num_sets, sets_capacity;
+static pthread_mutex_t synth_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Titles are made of these so searches have something to find. */
+static const char *words[] = {
+    "beach", "city", "dog", "sunset", "mountain", "river", "party", "snow",
+    "forest", "car", "bridge", "garden", "market", "harbor", "festival", "desert"
+};
+#define NUM_WORDS (sizeof(words) / sizeof(words[0]))
+
+
+static void sleep_ms(unsigned long ms) {
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)(ms / 1000);
+    ts.tv_nsec = (long)(ms % 1000) * 1000000;
+    while(nanosleep(&ts, &ts));
+}
+
+/* Every call pays the configured round trip. */
+static inline void round_trip() {
+    if(params.latency)
+        sleep_ms(params.latency);
+}
+
+static inline unsigned int mix(unsigned int x) {
+    x ^= x >> 16;
+    x *= 0x7FEB352D;
+    x ^= x >> 15;
+    x *= 0x846CA68B;
+    x ^= x >> 16;
+    return x;
+}
+
+/* Returns the index of the new photo or -1. Assumes synth_lock is held. */
+static long add_synth_photo(const char *title, time_t taken, unsigned int size) {
+    if(num_photos == photos_capacity) {
+        unsigned int capacity = photos_capacity ? photos_capacity * 2 : 64;
+        synth_photo *more = (synth_photo *)realloc(photos, capacity * sizeof(synth_photo));
+
+        if(!more)
+            return -1;
+        photos = more;
+        photos_capacity = capacity;
+    }
+
+    photos[num_photos].title = strdup(title);
+    photos[num_photos].taken = taken;
+    photos[num_photos].size = size;
+    photos[num_photos].sets = 0;
+    photos[num_photos].deleted = 0;
+    return num_photos++;
+}
+
+/* Returns the index of the new photoset or -1. Assumes synth_lock is held. */
+static long add_synth_set(const char *title) {
+    if(num_sets == sets_capacity) {
+        unsigned int capacity = sets_capacity ? sets_capacity * 2 : 16;
+        synth_set *more = (synth_set *)realloc(sets, capacity * sizeof(synth_set));
+
+        if(!more)
+            return -1;
+        sets = more;
+        sets_capacity = capacity;
+    }
+
+    memset(&sets[num_sets], 0, sizeof(synth_set));
+    sets[num_sets].title = strdup(title);
+    return num_sets++;
+}
+
+/* Assumes synth_lock is held. */
+static int add_to_set(synth_set *set, unsigned int photo) {
+    unsigned int i;
+
+    for(i = 0; i < set->count; i++)
+        if(set->photos[i] == photo)
+            return SUCCESS;
+
+    if(set->count == set->capacity) {
+        unsigned int capacity = set->capacity ? set->capacity * 2 : 16;
+        unsigned int *more = (unsigned int *)realloc(set->photos, capacity * sizeof(unsigned int));
+
+        if(!more)
+            return FAIL;
+        set->photos = more;
+        set->capacity = capacity;
+    }
+
+    set->photos[set->count++] = photo;
+    photos[photo].sets++;
+    return SUCCESS;
+}
+
+/* Assumes synth_lock is held. */
+static void remove_from_set(synth_set *set, unsigned int photo) {
+    unsigned int i;
+
+    for(i = 0; i < set->count; i++) {
+        if(set->photos[i] == photo) {
+            memmove(&set->photos[i], &set->photos[i + 1], (set->count - i - 1) * sizeof(unsigned int));
+            set->count--;
+            photos[photo].sets--;
+            return;
+        }
+    }
+}
+
+/* Looks up a photo or photoset by id. Returns -1 if there is none. */
+static long id_index(const char *id, unsigned long base, unsigned int count) {
+    char *end;
+    unsigned long n = strtoul(id, &end, 10);
+
+    if(*end != '\0' || n < base || n - base >= count)
+        return -1;
+    return (long)(n - base);
+}
+
+static inline long photo_index(const char *id) {
+    long i = id_index(id, PHOTO_ID_BASE, num_photos);
+
+    return (i >= 0 && !photos[i].deleted) ? i : -1;
+}
+
+static inline long set_index(const char *id) {
+    return id_index(id, SET_ID_BASE, num_sets);
+}
+
+/* Reads "key=value:key=value" into params. */
+static int parse_args(const char *args) {
+    char key[32];
+    unsigned int value;
+    int len;
+
+    params.sets = DEFAULT_SETS;
+    params.photos = DEFAULT_PHOTOS;
+    params.loose = DEFAULT_LOOSE;
+    params.size = DEFAULT_SIZE;
+    params.latency = 0;
+    params.bandwidth = 0;
+
+    while(*args) {
+        if(sscanf(args, "%31[^=]=%u%n", key, &value, &len) != 2)
+            return FAIL;
+
+        if(!strcmp(key, "sets"))
+            params.sets = value;
+        else if(!strcmp(key, "photos"))
+            params.photos = value;
+        else if(!strcmp(key, "loose"))
+            params.loose = value;
+        else if(!strcmp(key, "size"))
+            params.size = value;
+        else if(!strcmp(key, "latency"))
+            params.latency = value;
+        else if(!strcmp(key, "bandwidth"))
+            params.bandwidth = value;
+        else
+            return FAIL;
+
+        args += len;
+        if(*args == ':')
+            args++;
+        else if(*args)
+            return FAIL;
+    }
+    return SUCCESS;
+}
+
+/*
+ * Builds the account: params.sets photosets of params.photos photos each,
+ * then params.loose photos without a photoset. Photos are taken an hour
+ * and a half apart and the titles are picked from words.
+ */
+static int synthetic_init(const char *args) {
+    char title[64];
+    unsigned int i, j, n = 0;
+    long set, photo;
+
+    if(parse_args(args))
+        return FAIL;
+
+    pthread_mutex_lock(&synth_lock);
+    for(i = 0; i <= params.sets; i++) {
+        unsigned int count = (i < params.sets) ? params.photos : params.loose;
+
+        set = -1;
+        if(i < params.sets) {
+            snprintf(title, sizeof(title), "%s %u", words[mix(i) % NUM_WORDS], i);
+            if((set = add_synth_set(title)) < 0)
+                goto fail;
+        }
+
+        for(j = 0; j < count; j++, n++) {
+            snprintf(title, sizeof(title), "%s %s %u", words[mix(n) % NUM_WORDS],
+              words[mix(n + 1) % NUM_WORDS], n);
+            if((photo = add_synth_photo(title, FIRST_TAKEN + (time_t)n * 5400, params.size)) < 0)
+                goto fail;
+            if(set >= 0 && add_to_set(&sets[set], (unsigned int)photo))
+                goto fail;
+        }
+    }
+    pthread_mutex_unlock(&synth_lock);
+    return SUCCESS;
+
+fail: pthread_mutex_unlock(&synth_lock);
+    return FAIL;
+}
+
+/* The synthetic account is always there. */
+static int synthetic_ping() {
+    return SUCCESS;
+}
+
+static void synthetic_kill() {
+    unsigned int i;
+
+    pthread_mutex_lock(&synth_lock);
+    for(i = 0; i < num_photos; i++)
+        free(photos[i].title);
+    for(i = 0; i < num_sets; i++) {
+        free(sets[i].title);
+        free(sets[i].photos);
+    }
+    free(photos);
+    free(sets);
+    photos = NULL;
+    sets = NULL;
+    num_photos = photos_capacity = 0;
+    num_sets = sets_capacity = 0;
+    pthread_mutex_unlock(&synth_lock);
+}
+
+static char *format_id(unsigned long base, unsigned int index) {
+    char id[ID_SIZE];
+
+    snprintf(id, sizeof(id), "%lu", base + index);
+    return strdup(id);
+}
+
+static backend_photoset **synthetic_get_photosets() {
+    backend_photoset **list;
+    unsigned int i;
+
+    round_trip();
+
+    pthread_mutex_lock(&synth_lock);
+    if(!(list = (backend_photoset **)calloc(num_sets + 1, sizeof(backend_photoset *))))
+        goto fail;
+
+    for(i = 0; i < num_sets; i++) {
+        if(!(list[i] = (backend_photoset *)malloc(sizeof(backend_photoset)))) {
+            backend_free_photosets(list);
+            list = NULL;
+            goto fail;
+        }
+        list[i]->id = format_id(SET_ID_BASE, i);
+        list[i]->title = strdup(sets[i].title);
+        list[i]->photos_count = sets[i].count;
+    }
+
+fail: pthread_mutex_unlock(&synth_lock);
+    return list;
+}
+
+static backend_photo *new_backend_photo(unsigned int index) {
+    backend_photo *bp = (backend_photo *)malloc(sizeof(backend_photo));
+    char uri[ID_SIZE + sizeof(URI_PREFIX)];
+    char date[32];
+    struct tm tm;
+
+    if(!bp)
+        return NULL;
+
+    gmtime_r(&photos[index].taken, &tm);
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+    snprintf(uri, sizeof(uri), URI_PREFIX "%lu", PHOTO_ID_BASE + index);
+
+    bp->id = format_id(PHOTO_ID_BASE, index);
+    bp->title = strdup(photos[index].title);
+    bp->uri = strdup(uri);
+    bp->date_taken = strdup(date);
+    bp->tags = strdup(words[mix(index + 2) % NUM_WORDS]);
+    bp->description = NULL;
+    return bp;
+}
+
+static backend_photo **synthetic_get_photos(const char *photoset_id, int page, int per_page) {
+    backend_photo **list = NULL;
+    unsigned int skip, n = 0, i;
+    unsigned int *members = NULL;
+    unsigned int count;
+    long set = -1;
+
+    round_trip();
+
+    if(page < 1)
+        page = 1;
+    if(per_page < 1)
+        return NULL;
+    skip = (unsigned int)(page - 1) * (unsigned int)per_page;
+
+    pthread_mutex_lock(&synth_lock);
+    if(strcmp(photoset_id, "")) {
+        if((set = set_index(photoset_id)) < 0)
+            goto fail;
+        members = sets[set].photos;
+        count = sets[set].count;
+    }
+    else
+        count = num_photos;
+
+    if(!(list = (backend_photo **)calloc((size_t)per_page + 1, sizeof(backend_photo *))))
+        goto fail;
+
+    for(i = 0; i < count && n < (unsigned int)per_page; i++) {
+        unsigned int index = members ? members[i] : i;
+
+        /* Without a photoset, only the photos in none count */
+        if(!members && (photos[index].sets > 0 || photos[index].deleted))
+            continue;
+        if(skip > 0) {
+            skip--;
+            continue;
+        }
+
+        if(!(list[n++] = new_backend_photo(index))) {
+            backend_free_photos(list);
+            list = NULL;
+            goto fail;
+        }
+    }
+
+fail: pthread_mutex_unlock(&synth_lock);
+    return list;
+}
+
+/*
+ * Writes the photo's bytes to path, no faster than the bandwidth allows.
+ * The bytes follow from the photo id, so a photo reads the same every time.
+ */
+static int synthetic_fetch(const char *uri, const char *path) {
+    unsigned char chunk[CHUNK_SIZE];
+    struct timespec start, now;
+    unsigned int size, written = 0, seed;
+    long index;
+    size_t i, len;
+    int fd;
+
+    round_trip();
+
+    if(strncmp(uri, URI_PREFIX, strlen(URI_PREFIX)))
+        return FAIL;
+
+    pthread_mutex_lock(&synth_lock);
+    index = photo_index(uri + strlen(URI_PREFIX));
+    size = (index >= 0) ? photos[index].size : 0;
+    pthread_mutex_unlock(&synth_lock);
+
+    if(index < 0) {
+        backend_refused();
+        return FAIL;
+    }
+
+    if((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+        return FAIL;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    seed = mix((unsigned int)index);
+
+    while(written < size) {
+        len = (size - written < CHUNK_SIZE) ? size - written : CHUNK_SIZE;
+        for(i = 0; i < len; i++)
+            chunk[i] = (unsigned char)(mix(seed + written + (unsigned int)i) & 0xFF);
+
+        if(write(fd, chunk, len) != (ssize_t)len) {
+            close(fd);
+            return FAIL;
+        }
+        written += (unsigned int)len;
+
+        if(params.bandwidth) {
+            unsigned long due = (unsigned long)written * 1000 / (params.bandwidth * 1024UL);
+            unsigned long elapsed;
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            elapsed = (unsigned long)((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000);
+            if(due > elapsed)
+                sleep_ms(due - elapsed);
+        }
+    }
+
+    close(fd);
+    return SUCCESS;
+}
+
+static int synthetic_content_length(const char *uri) {
+    long index;
+    int size = FAIL;
+
+    round_trip();
+
+    if(strncmp(uri, URI_PREFIX, strlen(URI_PREFIX)))
+        return FAIL;
+
+    pthread_mutex_lock(&synth_lock);
+    if((index = photo_index(uri + strlen(URI_PREFIX))) >= 0)
+        size = (int)photos[index].size;
+    pthread_mutex_unlock(&synth_lock);
+
+    if(index < 0)
+        backend_refused();
+    return size;
+}
+
+/* Only the size of an upload is kept. Fetching it returns generated bytes. */
+static char *synthetic_upload(const char *path, const char *title) {
+    struct stat st;
+    long index;
+
+    round_trip();
+
+    if(stat(path, &st))
+        return NULL;
+
+    pthread_mutex_lock(&synth_lock);
+    index = add_synth_photo(title, time(NULL), (unsigned int)st.st_size);
+    pthread_mutex_unlock(&synth_lock);
+
+    return (index < 0) ? NULL : format_id(PHOTO_ID_BASE, (unsigned int)index);
+}
+
+static int synthetic_set_photo_title(const char *photo_id, const char *title) {
+    long index;
+
+    round_trip();
+
+    pthread_mutex_lock(&synth_lock);
+    if((index = photo_index(photo_id)) >= 0) {
+        free(photos[index].title);
+        photos[index].title = strdup(title);
+    }
+    pthread_mutex_unlock(&synth_lock);
+
+    return (index < 0) ? FAIL : SUCCESS;
+}
+
+static int synthetic_set_photoset_title(const char *photoset_id, const char *title) {
+    long index;
+
+    round_trip();
+
+    pthread_mutex_lock(&synth_lock);
+    if((index = set_index(photoset_id)) >= 0) {
+        free(sets[index].title);
+        sets[index].title = strdup(title);
+    }
+    pthread_mutex_unlock(&synth_lock);
+
+    return (index < 0) ? FAIL : SUCCESS;
+}
+
+static char *synthetic_create_photoset(const char *title, const char *primary_photo_id) {
+    long set, photo;
+
+    round_trip();
+
+    pthread_mutex_lock(&synth_lock);
+    if((photo = photo_index(primary_photo_id)) < 0 || (set = add_synth_set(title)) < 0 ||
+      add_to_set(&sets[set], (unsigned int)photo))
+        set = -1;
+    pthread_mutex_unlock(&synth_lock);
+
+    return (set < 0) ? NULL : format_id(SET_ID_BASE, (unsigned int)set);
+}
+
+static int synthetic_add_photo(const char *photoset_id, const char *photo_id) {
+    long set, photo;
+    int retval = FAIL;
+
+    round_trip();
+
+    pthread_mutex_lock(&synth_lock);
+    if((set = set_index(photoset_id)) >= 0 && (photo = photo_index(photo_id)) >= 0)
+        retval = add_to_set(&sets[set], (unsigned int)photo);
+    pthread_mutex_unlock(&synth_lock);
+
+    return retval;
+}
+
+static int synthetic_remove_photo(const char *photoset_id, const char *photo_id) {
+    long set, photo;
+    int retval = FAIL;
+
+    round_trip();
+
+    pthread_mutex_lock(&synth_lock);
+    if((set = set_index(photoset_id)) >= 0 && (photo = photo_index(photo_id)) >= 0) {
+        remove_from_set(&sets[set], (unsigned int)photo);
+        retval = SUCCESS;
+    }
+    pthread_mutex_unlock(&synth_lock);
+
+    return retval;
+}
+
+static int synthetic_delete_photo(const char *photo_id) {
+    unsigned int i;
+    long photo;
+
+    round_trip();
+
+    pthread_mutex_lock(&synth_lock);
+    if((photo = photo_index(photo_id)) >= 0) {
+        for(i = 0; i < num_sets; i++)
+            remove_from_set(&sets[i], (unsigned int)photo);
+        photos[photo].deleted = 1;
+    }
+    pthread_mutex_unlock(&synth_lock);
+
+    return (photo < 0) ? FAIL : SUCCESS;
+}
+
+const backend synthetic_backend = {
+    .name = "synthetic",
+    .init = synthetic_init,
+    .kill = synthetic_kill,
+    .ping = synthetic_ping,
+    .get_photosets = synthetic_get_photosets,
+    .get_photos = synthetic_get_photos,
+    .fetch = synthetic_fetch,
+    .content_length = synthetic_content_length,
+    .upload = synthetic_upload,
+    .set_photo_title = synthetic_set_photo_title,
+    .set_photoset_title = synthetic_set_photoset_title,
+    .create_photoset = synthetic_create_photoset,
+    .add_photo = synthetic_add_photo,
+    .remove_photo = synthetic_remove_photo,
+    .delete_photo = synthetic_delete_photo
+};
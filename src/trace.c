@@ -0,0 +1,92 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+
+#define TRACE_BUFFER    (1024 * 1024)   /* Records are written out this many bytes at a time */
+
+int tracing;                            /* Set while a trace is being written */
+
+static FILE *trace_file;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t trace_start;
+static __thread uint32_t thread_id;
+
+
+/* Starts writing every filesystem callback to the file at path. */
+int trace_open(const char *path) {
+    trace_header header;
+
+    if(!(trace_file = fopen(path, "wb")))
+        return FAIL;
+    setvbuf(trace_file, NULL, _IOFBF, TRACE_BUFFER);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(trace_record);
+
+    if(fwrite(&header, sizeof(header), 1, trace_file) != 1) {
+        fclose(trace_file);
+        trace_file = NULL;
+        return FAIL;
+    }
+
+    trace_start = latency_now();
+    tracing = 1;
+    return SUCCESS;
+}
+
+void trace_close() {
+    pthread_mutex_lock(&trace_lock);
+    tracing = 0;
+    if(trace_file)
+        fclose(trace_file);
+    trace_file = NULL;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static inline uint16_t path_length(const char *path) {
+    size_t len = path ? strlen(path) : 0;
+
+    return (uint16_t)(len > UINT16_MAX ? UINT16_MAX : len);
+}
+
+/* Appends the callback the thread just finished, as timed by latency_end. */
+void trace_record_op(latency_op op, const char *path, const char *path2,
+  int64_t arg0, int64_t arg1, int64_t arg2, int ret) {
+    trace_record rec;
+    uint64_t start, ns;
+
+    if(!thread_id)
+        thread_id = (uint32_t)syscall(SYS_gettid);
+
+    latency_last(&start, &ns);
+
+    memset(&rec, 0, sizeof(rec));
+    rec.time = start - trace_start;
+    rec.duration = ns;
+    rec.args[0] = arg0;
+    rec.args[1] = arg1;
+    rec.args[2] = arg2;
+    rec.thread = thread_id;
+    rec.ret = ret;
+    rec.op = (uint16_t)op;
+    rec.path_len = path_length(path);
+    rec.path2_len = path_length(path2);
+
+    pthread_mutex_lock(&trace_lock);
+    if(trace_file) {
+        fwrite(&rec, sizeof(rec), 1, trace_file);
+        fwrite(path, 1, rec.path_len, trace_file);
+        fwrite(path2, 1, rec.path2_len, trace_file);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
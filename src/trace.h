@@ -0,0 +1,42 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#include "common.h"
+#include "latency.h"
+
+#define TRACE_MAGIC     "FMSTRACE"
+#define TRACE_VERSION   1
+
+/*
+ * A trace file is a trace_header followed by a trace_record per finished
+ * filesystem callback, each followed by its path and then its second path,
+ * if any, without terminators. Everything is in host byte order.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;       /* sizeof(trace_record), to catch layout changes */
+} trace_header;
+
+typedef struct {
+    uint64_t time;              /* Start, in ns since the trace was opened */
+    uint64_t duration;          /* In ns */
+    int64_t args[3];            /* Depend on op. See timed_* in flickrms.c */
+    uint32_t thread;
+    int32_t ret;
+    uint16_t op;                /* A latency_op */
+    uint16_t path_len;
+    uint16_t path2_len;         /* The new path of a rename */
+    uint16_t unused;
+} trace_record;
+
+extern int tracing;
+
+int trace_open(const char *path);
+void trace_close();
+void trace_record_op(latency_op op, const char *path, const char *path2,
+  int64_t arg0, int64_t arg1, int64_t arg2, int ret);
+
+#endif
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "unshare.h"
+
+
+#define TEMP_SUFFIX     ".XXXXXX"   /* The copy is made next to its target, then renamed over it */
+
+/*
+ * Copies from into a file of its own and renames it over to, so to never
+ * shares its inode with another link. from and to may be the same path.
+ * The copy keeps the mode and times of from.
+ */
+int copy_file(const char *from, const char *to) {
+    struct timespec times[2];
+    struct stat st;
+    char *temp;
+    off_t offset = 0;
+    int src, dst;
+    int retval = FAIL;
+
+    if((src = open(from, O_RDONLY)) < 0)
+        return FAIL;
+
+    if(fstat(src, &st) || !(temp = (char *)malloc(strlen(to) + sizeof(TEMP_SUFFIX)))) {
+        close(src);
+        return FAIL;
+    }
+    strcpy(temp, to);
+    strcat(temp, TEMP_SUFFIX);
+
+    if((dst = mkstemp(temp)) < 0)
+        goto fail;
+
+    while(offset < st.st_size)
+        if(sendfile(dst, src, &offset, (size_t)(st.st_size - offset)) <= 0)
+            break;
+
+    /* The age of the photo decides when it is downloaded again */
+    times[0] = st.st_atim;
+    times[1] = st.st_mtim;
+    if(offset == st.st_size && !fchmod(dst, st.st_mode & 07777) && !futimens(dst, times))
+        retval = SUCCESS;
+
+    if(close(dst) || (retval == SUCCESS && rename(temp, to)))
+        retval = FAIL;
+    if(retval)
+        unlink(temp);
+
+fail: close(src);
+    free(temp);
+    return retval;
+}
+
+/* Makes path a file of its own, if it is linked from elsewhere. A missing file is left missing. */
+int unshare_file(const char *path) {
+    struct stat st;
+
+    if(stat(path, &st))
+        return (errno == ENOENT) ? SUCCESS : FAIL;
+
+    return (st.st_nlink > 1) ? copy_file(path, path) : SUCCESS;
+}
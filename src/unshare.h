@@ -0,0 +1,15 @@
+#ifndef UNSHARE_H
+#define UNSHARE_H
+
+#include "common.h"
+
+/*
+ * A photo in several photosets is stored once, under its Flickr id, and
+ * hardlinked into each photoset's directory. Writing through one of the
+ * links would change every photoset's copy, so a file is made private
+ * before it is opened for writing.
+ */
+int copy_file(const char *from, const char *to);
+int unshare_file(const char *path);
+
+#endif
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "unshare.h"
+
+
+/*
+ * Lays out a photo the way flickrms does for one in two photosets: stored
+ * once under its id and hardlinked into both photoset directories. Then
+ * writes through one photoset, the way a writable open does, and checks
+ * that the other photoset and the id keep the photo as it was.
+ *
+ *   unshare_test
+ */
+
+#define ORIGINAL    "original photo"
+#define WRITTEN     "WRITTEN!"  /* As long as the first word of ORIGINAL */
+#define PATH_SIZE   4096
+
+static char dir[] = "/tmp/unshare_test.XXXXXX";
+static unsigned int failed;
+
+static void path_in(char *path, const char *name) {
+    snprintf(path, PATH_SIZE, "%s/%s", dir, name);
+}
+
+static int write_file(const char *name, const char *contents, int flags) {
+    char path[PATH_SIZE];
+    ssize_t len = (ssize_t)strlen(contents);
+    int fd;
+
+    path_in(path, name);
+    if((fd = open(path, O_WRONLY | flags, 0644)) < 0)
+        return FAIL;
+    if(write(fd, contents, (size_t)len) != len) {
+        close(fd);
+        return FAIL;
+    }
+    return close(fd);
+}
+
+static void expect(const char *name, const char *contents) {
+    char path[PATH_SIZE], buf[64];
+    ssize_t len = 0;
+    int fd;
+
+    path_in(path, name);
+    if((fd = open(path, O_RDONLY)) >= 0) {
+        len = read(fd, buf, sizeof(buf) - 1);
+        close(fd);
+    }
+    buf[(len > 0) ? len : 0] = '\0';
+
+    if(strcmp(buf, contents)) {
+        fprintf(stderr, "%s: \"%s\", expected \"%s\"\n", name, buf, contents);
+        failed++;
+    }
+}
+
+int main() {
+    char id[PATH_SIZE], set_a[PATH_SIZE], set_b[PATH_SIZE];
+    struct stat st;
+
+    if(!mkdtemp(dir)) {
+        perror(dir);
+        return 1;
+    }
+    path_in(id, "1234");
+    path_in(set_a, "a");
+    path_in(set_b, "b");
+
+    if(write_file("1234", ORIGINAL, O_CREAT) || link(id, set_a) || link(id, set_b)) {
+        perror(dir);
+        return 1;
+    }
+
+    /* Written through set a, without truncating */
+    if(unshare_file(set_a) || write_file("a", WRITTEN, 0))
+        failed++;
+    expect("a", WRITTEN " photo");
+    expect("b", ORIGINAL);
+    expect("1234", ORIGINAL);
+
+    /* Set a is its own file now, set b still shares the id's */
+    if(stat(set_a, &st) || st.st_nlink != 1 || stat(set_b, &st) || st.st_nlink != 2)
+        failed++;
+
+    /* Truncated through set b */
+    if(unshare_file(set_b) || write_file("b", WRITTEN, O_TRUNC))
+        failed++;
+    expect("b", WRITTEN);
+    expect("1234", ORIGINAL);
+
+    /* A copy made for a writable open */
+    if(copy_file(id, set_a) || write_file("a", WRITTEN, O_TRUNC))
+        failed++;
+    expect("a", WRITTEN);
+    expect("1234", ORIGINAL);
+
+    unlink(id);
+    unlink(set_a);
+    unlink(set_b);
+    rmdir(dir);
+
+    printf("%s\n", failed ? "writes reached another photoset's copy" : "writes stayed in their photoset");
+    return failed ? 1 : 0;
+}
@@ -1,10 +1,36 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <unistd.h>
 #include <curl/curl.h>
 
 #include "wget.h"
+#include "backend.h"
+#include "stats.h"
+#include "latency.h"
+#include "sched.h"
+
+
+#define HTTP_CLIENT_ERROR           400     /* 4xx: the server turned the request down */
+#define HTTP_SERVER_ERROR           500
+#define HTTP_TOO_MANY_REQUESTS      429
+#define HTTP_SERVICE_UNAVAILABLE    503
+
+#define PART_SUFFIX     ".XXXXXX"   /* mkstemp template of unfinished downloads */
+
+
+/* One of the requests racing for the same download or HEAD. */
+typedef struct {
+    CURL *curl;
+    FILE *fp;                   /* NULL for a HEAD */
+    char *part;                 /* Where fp is */
+    uint64_t start;
+    CURLcode res;
+    long status;                /* The HTTP status, 0 if there was no answer */
+    unsigned short answered;    /* Got a byte of the photo, or finished fine */
+    unsigned short done;
+} attempt;
 
 
 int wget_init() {
@@ -18,64 +44,261 @@ void wget_destroy() {
     curl_global_cleanup();
 }
 
-int wget(const char *in, const char *out) {
-    CURL *curl;
-    CURLcode res;
-    FILE *fp;
+/* Tells the scheduler to back off if the server turned the request down for going too fast. */
+static int throttled(CURL *curl) {
+    long code = 0;
 
-    if(!(curl = curl_easy_init()))
-        return FAIL;
+    if(curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code) == CURLE_OK &&
+      (code == HTTP_TOO_MANY_REQUESTS || code == HTTP_SERVICE_UNAVAILABLE)) {
+        sched_rate_limited();
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Applies backend_timeout to the request. A download of a large photo on
+ * a slow link may take long, so only the stall timeout bounds it.
+ */
+static void set_timeouts(CURL *curl, int download) {
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);    /* Threads can't time out on SIGALRM */
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, (long)backend_timeout.connect);
+    if(!download)
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)backend_timeout.transfer);
+    if(backend_timeout.stall) {
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, (long)backend_timeout.stall);
+    }
+}
 
-    if(!(fp = fopen(out, "wb")))    // Open in binary
+static size_t throw_away(void *ptr, size_t size, size_t nmemb, void *data)
+{
+    (void)ptr;
+    (void)data;
+    return (size_t)(size * nmemb);
+}
+
+/* Writes the body of a download, noting when its first byte came. */
+static size_t write_part(void *ptr, size_t size, size_t nmemb, void *data) {
+    attempt *at = (attempt *)data;
+
+    if(!at->answered) {
+        at->answered = 1;
+        latency_record(LAT_FIRST_BYTE, latency_now() - at->start);
+    }
+    return fwrite(ptr, size, nmemb, at->fp);
+}
+
+/*
+ * Sets up an attempt at the request: a HEAD of url if out is NULL, else a
+ * download of it to a temporary file next to out.
+ */
+static int start_attempt(attempt *at, const char *url, const char *out) {
+    int fd;
+
+    memset(at, 0, sizeof(attempt));
+    at->start = latency_now();
+
+    if(out) {
+        if(!(at->part = (char *)malloc(strlen(out) + sizeof(PART_SUFFIX))))
+            return FAIL;
+        strcpy(at->part, out);
+        strcat(at->part, PART_SUFFIX);
+
+        if((fd = mkstemp(at->part)) < 0) {
+            free(at->part);
+            return FAIL;
+        }
+        if(!(at->fp = fdopen(fd, "wb"))) {
+            close(fd);
+            unlink(at->part);
+            free(at->part);
+            return FAIL;
+        }
+    }
+
+    if(!(at->curl = curl_easy_init())) {
+        if(out) {
+            fclose(at->fp);
+            unlink(at->part);
+            free(at->part);
+        }
         return FAIL;
+    }
 
     // Set the curl easy options
-    curl_easy_setopt(curl, CURLOPT_URL, in);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
-    //curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+    curl_easy_setopt(at->curl, CURLOPT_URL, url);
+    curl_easy_setopt(at->curl, CURLOPT_FAILONERROR, 1L);   /* Don't keep an error page as the photo */
+    if(out) {
+        curl_easy_setopt(at->curl, CURLOPT_WRITEFUNCTION, write_part);
+        curl_easy_setopt(at->curl, CURLOPT_WRITEDATA, at);
+    }
+    else {
+        curl_easy_setopt(at->curl, CURLOPT_NOBODY, 1); // Use HEADER request
+        curl_easy_setopt(at->curl, CURLOPT_HEADERFUNCTION, throw_away);
+        curl_easy_setopt(at->curl, CURLOPT_HEADER, 0L);
+    }
+    set_timeouts(at->curl, out != NULL);
+    //curl_easy_setopt(at->curl, CURLOPT_VERBOSE, 1L);
 
-    res = curl_easy_perform(curl);  // Perform the download and write
+    stat_inc(STAT_CONNECTIONS);
+    return SUCCESS;
+}
 
-    curl_easy_cleanup(curl);
-    fsync(fileno(fp));
-    fclose(fp);
+/* Ends the attempt, keeping what it downloaded only if it is the one taken. */
+static void end_attempt(CURLM *multi, attempt *at, int taken) {
+    curl_multi_remove_handle(multi, at->curl);
+    curl_easy_cleanup(at->curl);
+    stat_dec(STAT_CONNECTIONS);
+
+    if(at->fp && !taken) {
+        fclose(at->fp);
+        unlink(at->part);
+        free(at->part);
+    }
+}
+
+/* Notes the result of every attempt that finished. */
+static void collect(CURLM *multi, attempt *at, int num) {
+    CURLMsg *msg;
+    int left, i;
+
+    while((msg = curl_multi_info_read(multi, &left))) {
+        if(msg->msg != CURLMSG_DONE)
+            continue;
+
+        for(i = 0; i < num && at[i].curl != msg->easy_handle; i++);
+        if(i == num)
+            continue;
+
+        at[i].done = 1;
+        at[i].res = msg->data.result;
+        curl_easy_getinfo(at[i].curl, CURLINFO_RESPONSE_CODE, &at[i].status);
+        if(at[i].res == CURLE_OPERATION_TIMEDOUT)
+            stat_inc(STAT_TIMEOUTS);
+        if(throttled(at[i].curl))
+            at[i].res = CURLE_HTTP_RETURNED_ERROR;
+        if(at[i].res == CURLE_OK)
+            at[i].answered = 1;     /* Also a HEAD, or a download with nothing in it */
+    }
+}
+
+/*
+ * Performs the request, timed as op. If it isn't answered within the
+ * hedge delay of op, a duplicate is sent and whichever is answered first
+ * is taken: the first to finish for a HEAD, the first to get a byte of
+ * the photo for a download. The other one is dropped right then, so a
+ * duplicate costs at most a connection and a few packets. Only if the
+ * attempt taken succeeds is it left in taken, still to be ended.
+ */
+static CURLcode race(const char *url, const char *out, latency_op op, attempt *taken) {
+    attempt at[2];
+    CURLM *multi;
+    CURLcode res;
+    uint64_t start = latency_now(), delay = sched_hedge_delay(op), now;
+    int num = 1, winner = -1, running, i;
+    long wait_ms;
+
+    if(!(multi = curl_multi_init()))
+        return CURLE_OUT_OF_MEMORY;
+    if(start_attempt(&at[0], url, out)) {
+        curl_multi_cleanup(multi);
+        return CURLE_OUT_OF_MEMORY;
+    }
+    curl_multi_add_handle(multi, at[0].curl);
+
+    for(;;) {
+        curl_multi_perform(multi, &running);
+        collect(multi, at, num);
+
+        if(winner < 0) {
+            for(i = 0; i < num && !at[i].answered; i++);
+            if(i < num) {
+                winner = i;
+                if(num == 2) {
+                    end_attempt(multi, &at[1 - winner], 0);
+                    if(winner == 1)
+                        stat_inc(STAT_HEDGE_WINS);
+                }
+            }
+        }
+
+        if(winner >= 0 ? at[winner].done : (at[0].done && (num == 1 || at[1].done)))
+            break;
+
+        /* A request that failed is not hedged, only one that is slow */
+        now = latency_now();
+        if(winner < 0 && num == 1 && delay && now - start >= delay) {
+            delay = 0;
+            if(sched_hedge(0) && !start_attempt(&at[1], url, out)) {
+                curl_multi_add_handle(multi, at[1].curl);
+                num = 2;
+                continue;
+            }
+        }
+
+        wait_ms = 1000;
+        if(winner < 0 && num == 1 && delay && now - start < delay)
+            wait_ms = (long)((start + delay - now) / 1000000) + 1;
+        curl_multi_poll(multi, NULL, 0, (int)wait_ms, NULL);
+    }
+
+    if(winner < 0) {            /* Every attempt failed */
+        res = at[num - 1].res;
+        if(at[num - 1].status >= HTTP_CLIENT_ERROR && at[num - 1].status < HTTP_SERVER_ERROR)
+            backend_refused();
+        for(i = 0; i < num; i++)
+            end_attempt(multi, &at[i], 0);
+    }
+    else if((res = at[winner].res) != CURLE_OK)     /* Failed after its first byte */
+        end_attempt(multi, &at[winner], 0);
+    else {
+        *taken = at[winner];
+        curl_multi_remove_handle(multi, taken->curl);
+    }
+    curl_multi_cleanup(multi);
+
+    latency_record(op, latency_now() - start);
     return res;
 }
 
-static size_t throw_away(void *ptr, size_t size, size_t nmemb, void *data)
-{
-    (void)ptr;
-    (void)data;
-    return (size_t)(size * nmemb);
+/*
+ * Downloads in to out. The download goes to a temporary file next to out
+ * first, so one that fails or times out never leaves a truncated photo
+ * where the cache would find it.
+ */
+int wget(const char *in, const char *out) {
+    attempt at;
+    int failed;
+
+    if(race(in, out, LAT_WGET, &at))
+        return FAIL;
+
+    curl_easy_cleanup(at.curl);
+    stat_dec(STAT_CONNECTIONS);
+
+    fsync(fileno(at.fp));
+    failed = fclose(at.fp) || rename(at.part, out);
+    if(failed)
+        unlink(at.part);
+    free(at.part);
+    return failed ? FAIL : SUCCESS;
 }
 
 /* Perform a HEAD request to the url to get the Content Length from
  * the headers. Does not get the body.
  */
 int get_url_content_length(const char *url) {
-    CURL *curl;
+    attempt at;
     CURLcode res;
     double content_length;
 
-    if(!(curl = curl_easy_init()))
-        return FAIL;
-
-    // Set the curl easy options
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_NOBODY, 1); // Use HEADER request
-    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, throw_away);
-    curl_easy_setopt(curl, CURLOPT_HEADER, 0L);
-    //curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
-
-    res = curl_easy_perform(curl);
-
-    if(res) {
-        curl_easy_cleanup(curl);
+    if(race(url, NULL, LAT_HEAD, &at))
         return FAIL;
-    }
 
-    res = curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &content_length);
-    curl_easy_cleanup(curl);
+    res = curl_easy_getinfo(at.curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &content_length);
+    curl_easy_cleanup(at.curl);
+    stat_dec(STAT_CONNECTIONS);
 
     return (res) ? FAIL : (int)round(content_length);
 }